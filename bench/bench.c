@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Benchmark helpers
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+const struct bench_size bench_sizes[BENCH_NUM_SIZES] = {
+	{ "480p", 640, 480 },
+	{ "720p", 1280, 720 },
+	{ "1080p", 1920, 1080 },
+};
+
+static uint64_t bench_clock(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t bench_now(void)
+{
+	return bench_clock(CLOCK_MONOTONIC);
+}
+
+int bench_init(struct bench_run *run, unsigned int iterations)
+{
+	memset(run, 0, sizeof(*run));
+
+	run->samples = calloc(iterations, sizeof(*run->samples));
+	if (!run->samples)
+		return -ENOMEM;
+
+	run->size = iterations;
+	return 0;
+}
+
+void bench_cleanup(struct bench_run *run)
+{
+	free(run->samples);
+	run->samples = NULL;
+}
+
+void bench_start(struct bench_run *run)
+{
+	run->count = 0;
+	run->bytes = 0;
+	run->wall_start = bench_now();
+	run->cpu_start = bench_clock(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void bench_stop(struct bench_run *run)
+{
+	run->wall = bench_now() - run->wall_start;
+	run->cpu = bench_clock(CLOCK_PROCESS_CPUTIME_ID) - run->cpu_start;
+}
+
+void bench_sample(struct bench_run *run, uint64_t latency)
+{
+	if (run->count < run->size)
+		run->samples[run->count++] = latency;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double bench_percentile(const struct bench_run *run, unsigned int pct)
+{
+	if (!run->count)
+		return 0.0;
+
+	/* Nearest rank, the samples are sorted. */
+	return run->samples[(run->count * pct + 99) / 100 - 1] / 1000.0;
+}
+
+void bench_report(struct bench_run *run, const char *name, const char *params)
+{
+	double wall = run->wall / 1e9;
+
+	qsort(run->samples, run->count, sizeof(*run->samples), bench_compare);
+
+	printf("{\"benchmark\": \"%s\", %s%s\"iterations\": %u, "
+	       "\"per_second\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+	       "\"max_us\": %.2f, \"bytes_per_iteration\": %.0f, "
+	       "\"wall_s\": %.6f, \"cpu_s\": %.6f}\n",
+	       name, params, *params ? ", " : "", run->count,
+	       wall > 0 ? run->count / wall : 0.0,
+	       bench_percentile(run, 50), bench_percentile(run, 99),
+	       bench_percentile(run, 100),
+	       run->count ? (double)run->bytes / run->count : 0.0,
+	       wall, run->cpu / 1e9);
+	fflush(stdout);
+}
+
+unsigned int bench_iterations(int argc, char *argv[], unsigned int def)
+{
+	long value;
+
+	if (argc < 2)
+		return def;
+
+	value = strtol(argv[1], NULL, 10);
+	return value > 0 ? value : def;
+}
@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Benchmark helpers
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * struct bench_run - Measurements of one benchmark case
+ * @samples: per-iteration latencies in ns
+ * @count: number of recorded samples
+ * @size: number of allocated samples
+ * @bytes: total number of bytes produced
+ * @wall_start: CLOCK_MONOTONIC time at which the case started, in ns
+ * @cpu_start: process CPU time at which the case started, in ns
+ * @wall: duration of the case, in ns
+ * @cpu: process CPU time used by the case, all threads included, in ns
+ */
+struct bench_run {
+	uint64_t *samples;
+	unsigned int count;
+	unsigned int size;
+	uint64_t bytes;
+
+	uint64_t wall_start;
+	uint64_t cpu_start;
+	uint64_t wall;
+	uint64_t cpu;
+};
+
+/* Frame sizes covered by the frame processing benchmarks. */
+struct bench_size {
+	const char *name;
+	unsigned int width;
+	unsigned int height;
+};
+
+#define BENCH_NUM_SIZES	3
+
+extern const struct bench_size bench_sizes[BENCH_NUM_SIZES];
+
+uint64_t bench_now(void);
+
+int bench_init(struct bench_run *run, unsigned int iterations);
+void bench_cleanup(struct bench_run *run);
+
+void bench_start(struct bench_run *run);
+void bench_stop(struct bench_run *run);
+void bench_sample(struct bench_run *run, uint64_t latency);
+
+/*
+ * bench_report - Print the results of a benchmark case
+ * @run: the measurements
+ * @name: benchmark name
+ * @params: parameters of the case, as the members of a JSON object
+ *
+ * The results are printed to stdout as a single line JSON object containing
+ * the benchmark name, the parameters, the number of iterations, the
+ * iterations per second, the p50, p99 and maximum latencies in µs, the
+ * average bytes produced per iteration and the wall and CPU times in s. The
+ * output of successive runs can be compared line by line.
+ */
+void bench_report(struct bench_run *run, const char *name, const char *params);
+
+/*
+ * bench_iterations - Parse the iteration count from the command line
+ * @argc: argument count
+ * @argv: arguments
+ * @def: default iteration count
+ *
+ * Return the iteration count given as the first argument, or @def if no
+ * argument is given or if it isn't a positive number.
+ */
+unsigned int bench_iterations(int argc, char *argv[], unsigned int def);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __BENCH_H__ */
@@ -0,0 +1,150 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Event loop dispatch benchmark
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ *
+ * Measure the time from an eventfd being signalled to its callback being
+ * dispatched, with each backend and an increasing number of idle watched file
+ * descriptors. The callback signals the eventfd again, so every iteration is
+ * one wakeup of the loop.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include "bench.h"
+#include "events.h"
+
+struct ping {
+	struct events events;
+	struct bench_run *run;
+	unsigned int iterations;
+	uint64_t signalled;
+	int fd;
+};
+
+static const unsigned int idle_counts[] = { 0, 64, 512 };
+
+static void ping_signal(struct ping *ping)
+{
+	uint64_t value = 1;
+
+	ping->signalled = bench_now();
+	if (write(ping->fd, &value, sizeof(value)) != sizeof(value))
+		events_stop(&ping->events);
+}
+
+static void ping_event(void *data)
+{
+	struct ping *ping = data;
+	uint64_t value;
+
+	bench_sample(ping->run, bench_now() - ping->signalled);
+
+	if (read(ping->fd, &value, sizeof(value)) != sizeof(value) ||
+	    ping->run->count == ping->iterations) {
+		events_stop(&ping->events);
+		return;
+	}
+
+	ping_signal(ping);
+}
+
+static int bench_events(struct bench_run *run, unsigned int iterations,
+			enum events_backend backend, unsigned int num_idle)
+{
+	struct ping ping = {
+		.run = run,
+		.iterations = iterations,
+		.fd = -1,
+	};
+	unsigned int num_watched = 0;
+	char params[128];
+	unsigned int i;
+	int *idle;
+	int ret = -1;
+
+	idle = calloc(num_idle + 1, sizeof(*idle));
+	if (!idle)
+		return -1;
+
+	if (events_init_backend(&ping.events, backend) < 0)
+		goto done_free;
+
+	for (num_watched = 0; num_watched < num_idle; ++num_watched) {
+		int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		if (fd < 0)
+			goto done;
+
+		idle[num_watched] = fd;
+		events_watch_fd(&ping.events, fd, EVENT_READ, ping_event, &ping);
+	}
+
+	ping.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ping.fd < 0)
+		goto done;
+
+	events_watch_fd(&ping.events, ping.fd, EVENT_READ, ping_event, &ping);
+
+	bench_start(run);
+	ping_signal(&ping);
+	events_loop(&ping.events);
+	bench_stop(run);
+
+	snprintf(params, sizeof(params),
+		 "\"backend\": \"%s\", \"idle_fds\": %u",
+		 events_backend_name(ping.events.backend), num_idle);
+	bench_report(run, "events_loop", params);
+
+	ret = run->count == iterations ? 0 : -1;
+
+done:
+	for (i = 0; i < num_watched; ++i) {
+		events_unwatch_fd(&ping.events, idle[i], EVENT_READ);
+		close(idle[i]);
+	}
+	if (ping.fd >= 0) {
+		events_unwatch_fd(&ping.events, ping.fd, EVENT_READ);
+		close(ping.fd);
+	}
+	events_cleanup(&ping.events);
+done_free:
+	free(idle);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	static const enum events_backend backends[] = {
+		EVENTS_BACKEND_SELECT,
+		EVENTS_BACKEND_EPOLL,
+	};
+	unsigned int iterations = bench_iterations(argc, argv, 100000);
+	struct bench_run run;
+	unsigned int b, i;
+	int ret = 0;
+
+	if (bench_init(&run, iterations) < 0)
+		return 1;
+
+	for (b = 0; b < sizeof(backends) / sizeof(backends[0]); ++b) {
+		for (i = 0; i < sizeof(idle_counts) / sizeof(idle_counts[0]); ++i) {
+			if (bench_events(&run, iterations, backends[b],
+					 idle_counts[i]) < 0) {
+				fprintf(stderr, "%s with %u idle fds: failed\n",
+					events_backend_name(backends[b]),
+					idle_counts[i]);
+				ret = 1;
+			}
+		}
+	}
+
+	bench_cleanup(&run);
+	return ret;
+}
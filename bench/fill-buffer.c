@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Test source frame generation benchmark
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ *
+ * Fill YUYV frames with each test pattern, cycling through a set of buffers
+ * as the stream does. The static bars are only drawn the first time a buffer
+ * is used, their cost is dominated by the first few frames.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <linux/videodev2.h>
+
+#include "bench.h"
+#include "test-source.h"
+#include "video-buffers.h"
+#include "video-source.h"
+
+#define NUM_BUFFERS	4
+
+static const struct {
+	const char *name;
+	enum test_source_pattern pattern;
+} patterns[] = {
+	{ "bars", TEST_PATTERN_BARS },
+	{ "scroll", TEST_PATTERN_SCROLL },
+	{ "barcode", TEST_PATTERN_BARCODE },
+};
+
+static int bench_fill_buffer(struct bench_run *run, unsigned int iterations,
+			     const struct bench_size *size, unsigned int p)
+{
+	struct video_buffer buffers[NUM_BUFFERS] = { 0 };
+	struct v4l2_pix_format fmt = { 0 };
+	struct video_source *src;
+	char params[128];
+	unsigned int i;
+	int ret = -1;
+
+	src = test_video_source_create();
+	if (!src)
+		return -1;
+
+	fmt.width = size->width;
+	fmt.height = size->height;
+	fmt.pixelformat = V4L2_PIX_FMT_YUYV;
+	fmt.bytesperline = size->width * 2;
+	fmt.sizeimage = fmt.bytesperline * size->height;
+
+	test_video_source_set_pattern(src, patterns[p].pattern);
+	if (video_source_set_format(src, &fmt) < 0)
+		goto done;
+
+	for (i = 0; i < NUM_BUFFERS; ++i) {
+		buffers[i].index = i;
+		buffers[i].size = fmt.sizeimage;
+		buffers[i].mem = malloc(fmt.sizeimage);
+		if (!buffers[i].mem)
+			goto done;
+	}
+
+	video_source_stream_on(src);
+	bench_start(run);
+
+	for (i = 0; i < iterations; ++i) {
+		struct video_buffer *buf = &buffers[i % NUM_BUFFERS];
+		uint64_t start = bench_now();
+
+		video_source_fill_buffer(src, buf);
+
+		bench_sample(run, bench_now() - start);
+		run->bytes += buf->bytesused;
+	}
+
+	bench_stop(run);
+	video_source_stream_off(src);
+
+	snprintf(params, sizeof(params),
+		 "\"format\": \"YUYV\", \"size\": \"%s\", \"width\": %u, "
+		 "\"height\": %u, \"pattern\": \"%s\"", size->name, size->width,
+		 size->height, patterns[p].name);
+	bench_report(run, "test_source_fill_buffer", params);
+
+	ret = 0;
+
+done:
+	for (i = 0; i < NUM_BUFFERS; ++i)
+		free(buffers[i].mem);
+	video_source_destroy(src);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int iterations = bench_iterations(argc, argv, 500);
+	struct bench_run run;
+	unsigned int s, p;
+	int ret = 0;
+
+	if (bench_init(&run, iterations) < 0)
+		return 1;
+
+	for (s = 0; s < BENCH_NUM_SIZES; ++s) {
+		for (p = 0; p < sizeof(patterns) / sizeof(patterns[0]); ++p) {
+			if (bench_fill_buffer(&run, iterations, &bench_sizes[s], p) < 0) {
+				fprintf(stderr, "%s %s: failed\n", bench_sizes[s].name,
+					patterns[p].name);
+				ret = 1;
+			}
+		}
+	}
+
+	bench_cleanup(&run);
+	return ret;
+}
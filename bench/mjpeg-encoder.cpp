@@ -0,0 +1,172 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * MJPEG encoder benchmark
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ *
+ * Encode synthetic YUV420 frames with a range of thread counts and quality
+ * levels. Frames are queued as the libcamera source does, keeping a bounded
+ * number of frames in flight, and the latency of each frame is measured from
+ * the moment it is queued to the moment the output callback receives it.
+ */
+
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include <libcamera/libcamera.h>
+
+#include "bench.h"
+#include "mjpeg_encoder.hpp"
+
+/* Number of distinct source frames, to avoid encoding the same data in a loop. */
+static constexpr unsigned int NUM_FRAMES = 2;
+
+static const unsigned int thread_counts[] = { 1, 2, 4 };
+static const int qualities[] = { 50, 75, 90 };
+
+/*
+ * Generate a YUV420 frame with smooth gradients shifted by @seed and some
+ * noise, which compresses in the same order of magnitude as camera images.
+ */
+static void generate_frame(std::vector<uint8_t> &frame, unsigned int width,
+			   unsigned int height, unsigned int seed)
+{
+	uint8_t *y = frame.data();
+	uint8_t *u = y + width * height;
+	uint8_t *v = u + width / 2 * (height / 2);
+	uint32_t random = 0x12345678 + seed;
+
+	for (unsigned int row = 0; row < height; row++) {
+		for (unsigned int col = 0; col < width; col++) {
+			random = random * 1103515245 + 12345;
+			y[row * width + col] = ((row + col + seed * 8) & 0xff) / 2
+					     + ((random >> 16) & 0x3f);
+		}
+	}
+
+	for (unsigned int row = 0; row < height / 2; row++) {
+		for (unsigned int col = 0; col < width / 2; col++) {
+			u[row * (width / 2) + col] = (col * 256 / (width / 2) + seed) & 0xff;
+			v[row * (width / 2) + col] = (row * 256 / (height / 2) + seed) & 0xff;
+		}
+	}
+}
+
+static int bench_encoder(struct bench_run *run, unsigned int iterations,
+			 const struct bench_size *size, unsigned int threads,
+			 int quality)
+{
+	unsigned int frame_size = size->width * size->height * 3 / 2;
+	unsigned int dest_size = size->width * size->height * 2;
+	unsigned int in_flight = std::min(threads * 2, 16U);
+	std::vector<std::vector<uint8_t>> frames(NUM_FRAMES);
+	std::vector<std::vector<uint8_t>> dests(in_flight);
+	std::vector<uint64_t> queued(in_flight);
+	std::vector<unsigned int> free_slots;
+	std::condition_variable cond;
+	std::mutex mutex;
+	char params[160];
+	StreamInfo info;
+
+	for (unsigned int i = 0; i < NUM_FRAMES; i++) {
+		frames[i].resize(frame_size);
+		generate_frame(frames[i], size->width, size->height, i);
+	}
+
+	for (unsigned int i = 0; i < in_flight; i++) {
+		dests[i].resize(dest_size);
+		free_slots.push_back(i);
+	}
+
+	info.width = size->width;
+	info.height = size->height;
+	info.stride = size->width;
+
+	MjpegEncoderConfig config;
+	config.threads = threads;
+
+	auto encoder = std::make_unique<MjpegEncoder>(config);
+	encoder->SetQuality(quality);
+	encoder->SetFramesInFlight(in_flight);
+	encoder->SetOutputReadyCallback(
+		[&](void *, size_t bytes_used, int64_t, unsigned int slot,
+		    const MjpegEncodeTimes &) {
+			uint64_t now = bench_now();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			bench_sample(run, now - queued[slot]);
+			run->bytes += bytes_used;
+			free_slots.push_back(slot);
+			cond.notify_one();
+		});
+
+	bench_start(run);
+
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int slot;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cond.wait(lock, [&] { return !free_slots.empty(); });
+			slot = free_slots.back();
+			free_slots.pop_back();
+			queued[slot] = bench_now();
+		}
+
+		encoder->EncodeBuffer(frames[i % NUM_FRAMES].data(),
+				      dests[slot].data(), frame_size, dest_size,
+				      info, i, slot);
+	}
+
+	encoder->Flush();
+
+	bench_stop(run);
+
+	if (encoder->Threads() != threads)
+		std::cerr << "using " << encoder->Threads() << " threads instead of "
+			  << threads << std::endl;
+
+	snprintf(params, sizeof(params),
+		 "\"format\": \"YUV420\", \"size\": \"%s\", \"width\": %u, "
+		 "\"height\": %u, \"threads\": %u, \"quality\": %d",
+		 size->name, size->width, size->height, threads, quality);
+
+	bench_report(run, "mjpeg_encoder", params);
+
+	return run->count == iterations ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int iterations = bench_iterations(argc, argv, 60);
+	struct bench_run run;
+	int ret = 0;
+
+	/* The encoder reports its configuration on std::cout, keep stdout for the results. */
+	std::cout.rdbuf(std::cerr.rdbuf());
+
+	if (bench_init(&run, iterations) < 0)
+		return 1;
+
+	for (const bench_size &size : bench_sizes) {
+		for (unsigned int threads : thread_counts) {
+			for (int quality : qualities) {
+				if (bench_encoder(&run, iterations, &size, threads,
+						  quality) < 0) {
+					std::cerr << size.name << " " << threads
+						  << " threads quality " << quality
+						  << ": failed" << std::endl;
+					ret = 1;
+				}
+			}
+		}
+	}
+
+	bench_cleanup(&run);
+	return ret;
+}
@@ -20,14 +20,51 @@
 
 #include "list.h"
 
+struct event_fd;
+
+/*
+ * enum events_backend - Mechanism used to wait for file descriptor events
+ * @EVENTS_BACKEND_DEFAULT: The backend selected at build time
+ * @EVENTS_BACKEND_SELECT: select(), limited to FD_SETSIZE descriptors
+ * @EVENTS_BACKEND_EPOLL: epoll, dispatching in O(ready fds)
+ */
+enum events_backend {
+	EVENTS_BACKEND_DEFAULT,
+	EVENTS_BACKEND_SELECT,
+	EVENTS_BACKEND_EPOLL,
+};
+
+/*
+ * struct events - Event loop
+ * @events: List of watched file descriptors
+ * @done: Set to stop the event loop
+ * @backend: Backend in use, never EVENTS_BACKEND_DEFAULT once initialized
+ * @maxfd: Highest watched file descriptor (select backend)
+ * @rfds: Descriptors watched for reading (select backend)
+ * @wfds: Descriptors watched for writing (select backend)
+ * @efds: Descriptors watched for exceptions (select backend)
+ * @epfd: epoll instance file descriptor (epoll backend)
+ * @handlers: Watched events indexed by file descriptor (epoll backend)
+ * @num_handlers: Number of file descriptors covered by @handlers
+ * @wakeups: Number of times the loop returned from waiting
+ * @dispatches: Number of callbacks invoked
+ */
 struct events {
 	struct list_entry events;
 	volatile bool done;
+	enum events_backend backend;
 
 	int maxfd;
 	fd_set rfds;
 	fd_set wfds;
 	fd_set efds;
+
+	int epfd;
+	struct event_fd **handlers;
+	unsigned int num_handlers;
+
+	unsigned long wakeups;
+	unsigned long dispatches;
 };
 
 enum event_type {
@@ -44,6 +81,9 @@ bool events_loop(struct events *events);
 void events_stop(struct events *events);
 
 void events_init(struct events *events);
+int events_init_backend(struct events *events, enum events_backend backend);
 void events_cleanup(struct events *events);
 
+const char *events_backend_name(enum events_backend backend);
+
 #endif
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Null and file video sinks
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+#ifndef __FILE_VIDEO_SINK_H__
+#define __FILE_VIDEO_SINK_H__
+
+#include <stdint.h>
+
+#include "video-sink.h"
+
+struct video_sink;
+
+/*
+ * null_video_sink_create - Create a sink that discards frames
+ * @rate: Rate at which the sink consumes frame data, in bytes per second, 0
+ *	to consume frames as soon as they're queued
+ *
+ * The null and file sinks let the source to sink pipeline run without a UDC.
+ * They consume buffers in order, each buffer taking bytesused / @rate seconds,
+ * mimicking the transfer of frames over a USB link of the given bandwidth.
+ *
+ * Returns the new sink on success, or NULL if memory can't be allocated.
+ */
+struct video_sink *null_video_sink_create(uint64_t rate);
+
+/*
+ * file_video_sink_create - Create a sink that writes frames to a file
+ * @path: Path to the output file, created or truncated
+ * @rate: Rate at which the sink consumes frame data, as for the null sink
+ *
+ * Frames are written back to back, which produces a raw video file for
+ * uncompressed formats and a stream of JPEG images for MJPEG.
+ *
+ * Returns the new sink on success, or NULL if the file can't be opened or
+ * memory can't be allocated.
+ */
+struct video_sink *file_video_sink_create(const char *path, uint64_t rate);
+
+#endif /* __FILE_VIDEO_SINK_H__ */
@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * UVC host emulator
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+#ifndef __UVC_HOST_EMULATOR_H__
+#define __UVC_HOST_EMULATOR_H__
+
+#include <linux/usb/ch9.h>
+#include <stdint.h>
+
+struct events;
+struct uvc_host_emulator;
+struct uvc_request_data;
+struct video_sink;
+
+/*
+ * enum uvc_host_step_type - Type of a host emulator script step
+ * @UVC_HOST_STEP_CONNECT: Signal a connection at the given bus speed
+ * @UVC_HOST_STEP_CONTROL: Issue a control request, completes when the response
+ *	has been sent
+ * @UVC_HOST_STEP_STREAM_ON: Start streaming, completes when the first frame
+ *	has been received
+ * @UVC_HOST_STEP_STREAM_OFF: Stop streaming, completes when the sink has been
+ *	stopped
+ * @UVC_HOST_STEP_WAIT_FRAMES: Wait until the given number of frames have been
+ *	received
+ */
+enum uvc_host_step_type {
+	UVC_HOST_STEP_CONNECT,
+	UVC_HOST_STEP_CONTROL,
+	UVC_HOST_STEP_STREAM_ON,
+	UVC_HOST_STEP_STREAM_OFF,
+	UVC_HOST_STEP_WAIT_FRAMES,
+};
+
+/* Send the data of the last device-to-host response in the data stage. */
+#define UVC_HOST_STEP_DATA_FROM_RESPONSE	(1 << 0)
+
+#define UVC_HOST_DATA_SIZE			60
+
+/*
+ * struct uvc_host_step - Step of a host emulator script
+ * @type: Step type
+ * @flags: UVC_HOST_STEP_* flags
+ * @speed: Bus speed (CONNECT)
+ * @req: Setup packet (CONTROL)
+ * @data: Data stage payload of host-to-device requests (CONTROL)
+ * @frames: Number of frames to wait for (WAIT_FRAMES)
+ */
+struct uvc_host_step {
+	enum uvc_host_step_type type;
+	unsigned int flags;
+	enum usb_device_speed speed;
+	struct usb_ctrlrequest req;
+	uint8_t data[UVC_HOST_DATA_SIZE];
+	unsigned int frames;
+};
+
+/*
+ * struct uvc_host_latency - Latency statistics, in nanoseconds
+ * @count: Number of samples
+ * @min: Minimum latency
+ * @p50: Median latency
+ * @p99: 99th percentile latency
+ * @max: Maximum latency
+ */
+struct uvc_host_latency {
+	unsigned int count;
+	uint64_t min;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t max;
+};
+
+/*
+ * struct uvc_host_stats - Host emulator statistics
+ * @control: Control request to response latency
+ * @stream_on: Stream start to first frame latency
+ * @stream_off: Stream stop latency
+ * @frames: Number of frames received
+ * @stalls: Number of control requests stalled by the device
+ * @timeouts: Number of steps that didn't complete in time
+ */
+struct uvc_host_stats {
+	struct uvc_host_latency control;
+	struct uvc_host_latency stream_on;
+	struct uvc_host_latency stream_off;
+	unsigned int frames;
+	unsigned int stalls;
+	unsigned int timeouts;
+};
+
+typedef void(*uvc_host_response_handler_t)(void *, const struct uvc_host_step *,
+					   const struct uvc_request_data *);
+typedef void(*uvc_host_done_handler_t)(void *, int);
+
+/*
+ * uvc_host_emulator_new - Create a UVC host emulator
+ * @events: Event loop
+ * @sink: Sink that consumes the frames, initialized by the caller
+ *
+ * The host emulator replaces the UVC gadget device node. It injects UVC events
+ * corresponding to a script of host operations, captures the responses, and
+ * receives frames through @sink, which it wraps. Use uvc_stream_new_emulated()
+ * to create a stream driven by the emulator.
+ *
+ * Returns the new emulator on success, or NULL on failure.
+ */
+struct uvc_host_emulator *uvc_host_emulator_new(struct events *events,
+						struct video_sink *sink);
+void uvc_host_emulator_delete(struct uvc_host_emulator *host);
+
+struct video_sink *uvc_host_emulator_sink(struct uvc_host_emulator *host);
+
+/*
+ * uvc_host_emulator_set_response_handler - Set the control response handler
+ * @host: The host emulator
+ * @handler: Function called with every control response
+ * @data: Private data for @handler
+ */
+void uvc_host_emulator_set_response_handler(struct uvc_host_emulator *host,
+					    uvc_host_response_handler_t handler,
+					    void *data);
+
+/*
+ * uvc_host_emulator_run - Run a script
+ * @host: The host emulator
+ * @steps: Script steps, which must stay valid until the script completes
+ * @count: Number of steps
+ * @timeout: Maximum duration of a step in milliseconds
+ * @done: Function called when the script completes, with 0 on success or
+ *	-ETIMEDOUT if a step timed out
+ * @data: Private data for @done
+ *
+ * Steps are executed asynchronously from the event loop.
+ *
+ * Returns 0 if the script has been started, or a negative error code.
+ */
+int uvc_host_emulator_run(struct uvc_host_emulator *host,
+			  const struct uvc_host_step *steps, unsigned int count,
+			  unsigned int timeout, uvc_host_done_handler_t done,
+			  void *data);
+
+void uvc_host_emulator_get_stats(struct uvc_host_emulator *host,
+				 struct uvc_host_stats *stats);
+
+#endif /* __UVC_HOST_EMULATOR_H__ */
@@ -33,6 +33,22 @@ struct camera_arguments {
 	float sharpness;
 
 	int debug_report_enabled;
+
+	/* MJPEG encoder behaviour when a frame overflows its buffer */
+	char *mjpeg_overflow;
+	/* Number of horizontal slices encoded in parallel per frame */
+	unsigned int mjpeg_slices;
+
+	/*
+	 * MJPEG encoder thread pool: 0 threads sizes the pool from the online
+	 * CPUs minus the reserved ones, an empty CPU mask doesn't restrict the
+	 * affinity and a NULL scheduling policy keeps SCHED_OTHER.
+	 */
+	unsigned int encoder_threads;
+	unsigned int encoder_reserved_cpus;
+	unsigned long encoder_cpus;
+	char *encoder_sched;
+	int encoder_priority;
 };
 
 #ifdef __cplusplus
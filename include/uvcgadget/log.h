@@ -0,0 +1,172 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Logging
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum uvc_log_level {
+	UVC_LOG_ERROR,
+	UVC_LOG_WARNING,
+	UVC_LOG_INFO,
+	UVC_LOG_DEBUG,
+};
+
+/*
+ * Messages above UVC_LOG_MAX_LEVEL are compiled out, the build system sets it
+ * from the log_level option.
+ */
+#ifndef UVC_LOG_MAX_LEVEL
+#define UVC_LOG_MAX_LEVEL	UVC_LOG_DEBUG
+#endif
+
+/*
+ * struct uvc_log_module - Per-module logging state
+ * @name: module name, matched against the filters
+ * @level: maximum level of the messages printed for the module
+ * @generation: value of uvc_log_generation @level has been resolved for
+ *
+ * Every source file that logs declares its module with UVC_LOG_MODULE(). The
+ * level is resolved from the filters the first time the module logs after
+ * they change, checking whether a message is enabled is otherwise a
+ * comparison.
+ */
+struct uvc_log_module {
+	const char *name;
+	int level;
+	unsigned int generation;
+};
+
+/*
+ * struct uvc_log_ratelimit - Rate limiting state of a call site
+ * @begin: start of the current interval, in ns
+ * @printed: messages printed in the current interval
+ * @suppressed: messages suppressed in the current interval
+ */
+struct uvc_log_ratelimit {
+	uint64_t begin;
+	unsigned int printed;
+	unsigned int suppressed;
+};
+
+#define UVC_LOG_MODULE(n) \
+	static struct uvc_log_module uvc_log_this_module = { #n, 0, 0 }
+
+extern unsigned int uvc_log_generation;
+
+void uvc_log_resolve(struct uvc_log_module *module);
+
+static inline bool uvc_log_enabled(struct uvc_log_module *module,
+				   enum uvc_log_level level)
+{
+	if (__atomic_load_n(&module->generation, __ATOMIC_ACQUIRE) !=
+	    __atomic_load_n(&uvc_log_generation, __ATOMIC_ACQUIRE))
+		uvc_log_resolve(module);
+
+	return (int)level <= __atomic_load_n(&module->level, __ATOMIC_RELAXED);
+}
+
+void uvc_log_write(struct uvc_log_module *module, enum uvc_log_level level,
+		   const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+void uvc_log_write_ratelimited(struct uvc_log_module *module,
+			       struct uvc_log_ratelimit *ratelimit,
+			       enum uvc_log_level level, const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+/*
+ * uvc_log - Log a message
+ * @level: the message level
+ *
+ * The arguments following @level are a printf() format string and its
+ * arguments. The message is formatted by the caller and printed by the log
+ * thread once started with uvc_log_start(), or synchronously otherwise.
+ */
+#define uvc_log(level, ...)							\
+	do {									\
+		if ((level) <= UVC_LOG_MAX_LEVEL &&				\
+		    uvc_log_enabled(&uvc_log_this_module, level))		\
+			uvc_log_write(&uvc_log_this_module, level,		\
+				      __VA_ARGS__);				\
+	} while (0)
+
+/*
+ * uvc_log_ratelimited - Log a message, limiting the rate of the call site
+ * @level: the message level
+ *
+ * As uvc_log(), but print at most UVC_LOG_RATELIMIT_BURST messages per
+ * UVC_LOG_RATELIMIT_INTERVAL ms from the call site, and report the number of
+ * suppressed messages when the next interval starts. Use it for errors that
+ * can repeat for every frame or request.
+ */
+#define uvc_log_ratelimited(level, ...)						\
+	do {									\
+		static struct uvc_log_ratelimit uvc_log_ratelimit_state;	\
+		if ((level) <= UVC_LOG_MAX_LEVEL &&				\
+		    uvc_log_enabled(&uvc_log_this_module, level))		\
+			uvc_log_write_ratelimited(&uvc_log_this_module,		\
+						  &uvc_log_ratelimit_state,	\
+						  level, __VA_ARGS__);		\
+	} while (0)
+
+#define UVC_LOG_RATELIMIT_BURST		10
+#define UVC_LOG_RATELIMIT_INTERVAL	5000
+
+#define log_error(...)		uvc_log(UVC_LOG_ERROR, __VA_ARGS__)
+#define log_warning(...)	uvc_log(UVC_LOG_WARNING, __VA_ARGS__)
+#define log_info(...)		uvc_log(UVC_LOG_INFO, __VA_ARGS__)
+#define log_debug(...)		uvc_log(UVC_LOG_DEBUG, __VA_ARGS__)
+
+#define log_error_ratelimited(...)	uvc_log_ratelimited(UVC_LOG_ERROR, __VA_ARGS__)
+#define log_warning_ratelimited(...)	uvc_log_ratelimited(UVC_LOG_WARNING, __VA_ARGS__)
+
+/*
+ * uvc_log_set_filter - Set the runtime log levels
+ * @spec: comma-separated list of a default level and of module=level pairs,
+ *	for instance "info,uvc=debug,v4l2=error". Levels are error, warning,
+ *	info and debug.
+ *
+ * Modules without a filter use the default level, initially info. This
+ * function isn't thread-safe with respect to itself, it is meant to be
+ * called from the main thread, typically at startup.
+ *
+ * Return 0 on success, or -EINVAL if @spec can't be parsed, in which case the
+ * filters are left unchanged.
+ */
+int uvc_log_set_filter(const char *spec);
+
+/*
+ * uvc_log_start - Start the log thread
+ *
+ * Messages logged after this call are formatted by the caller into a
+ * lock-free ring and written by a background thread, logging thus never
+ * blocks on the output. When the ring is full messages are dropped and their
+ * number reported. Before the thread is started, or if it fails to start,
+ * messages are written synchronously.
+ *
+ * Return 0 on success or a negative error code otherwise.
+ */
+int uvc_log_start(void);
+
+/*
+ * uvc_log_stop - Stop the log thread
+ *
+ * Write the pending messages and stop the log thread. Messages logged
+ * afterwards are written synchronously.
+ */
+void uvc_log_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LOG_H__ */
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Metrics server
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+#ifndef __METRICS_SERVER_H__
+#define __METRICS_SERVER_H__
+
+#include <stdio.h>
+
+struct events;
+struct metrics_server;
+
+/*
+ * metrics_render_t - Write the metrics in the Prometheus text format
+ * @data: the data pointer passed to metrics_server_new()
+ * @file: the file to write to
+ */
+typedef void (*metrics_render_t)(void *data, FILE *file);
+
+/*
+ * metrics_server_new - Serve metrics on a Unix domain socket
+ * @events: the event loop the server runs from
+ * @path: path of the socket, a stale socket at that path is replaced
+ * @render: function called to render the metrics for every client
+ * @data: data pointer passed to @render
+ *
+ * Clients can either send an HTTP GET request, as with
+ * 'curl --unix-socket <path> http://localhost/metrics', and receive an HTTP
+ * response, or shut down their side of the connection without sending
+ * anything and receive the metrics alone. Sockets are non-blocking and all
+ * processing happens from the event loop. The number of clients served
+ * concurrently is limited, additional connections wait in the listen backlog.
+ *
+ * Return the server on success, or NULL on failure.
+ */
+struct metrics_server *metrics_server_new(struct events *events,
+					  const char *path,
+					  metrics_render_t render, void *data);
+
+/*
+ * metrics_server_delete - Stop serving metrics
+ * @server: the server, may be NULL
+ *
+ * Close all connections and remove the socket.
+ */
+void metrics_server_delete(struct metrics_server *server);
+
+#endif /* __METRICS_SERVER_H__ */
@@ -7,14 +7,34 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
 #include <mutex>
 #include <queue>
 #include <thread>
 #include <functional>
+#include <vector>
+
+#include <sched.h>
 
 struct jpeg_compress_struct;
-typedef std::function<void(void *, size_t, int64_t, unsigned int)> OutputReadyCallback;
+
+/*
+ * CLOCK_MONOTONIC times, in ns, at which a frame went through the encoder:
+ * @encode_start: an encode thread started encoding the frame, or its first band
+ * @encode_end: the frame has been encoded, or its bands stitched
+ * @output: the frame left the reorder buffer to be passed to the callback
+ */
+struct MjpegEncodeTimes
+{
+	uint64_t encode_start;
+	uint64_t encode_end;
+	uint64_t output;
+};
+
+typedef std::function<void(void *, size_t, int64_t, unsigned int,
+			   const MjpegEncodeTimes &)> OutputReadyCallback;
 
 struct StreamInfo
 {
@@ -26,22 +46,102 @@ struct StreamInfo
 	std::optional<libcamera::ColorSpace> colour_space;
 };
 
+/*
+ * What to do with a frame that doesn't fit in its destination buffer:
+ * @Retry: encode again at a lower quality, truncate if it still doesn't fit
+ * @Truncate: keep the data that fits and terminate it with an EOI marker
+ * @Drop: report the frame with no payload so that the caller can recycle it
+ */
+enum class MjpegOverflowPolicy
+{
+	Retry,
+	Truncate,
+	Drop,
+};
+
+/*
+ * Encoder thread pool configuration:
+ * @threads: number of encode threads, 0 to size the pool automatically
+ * @reserved_cpus: CPUs left to the rest of the pipeline when sizing the pool
+ *	automatically
+ * @cpus: CPUs the encode threads are allowed to run on, empty for all CPUs
+ * @sched_policy: scheduling policy of the encode threads (SCHED_OTHER,
+ *	SCHED_FIFO or SCHED_RR)
+ * @sched_priority: real-time priority, ignored for SCHED_OTHER
+ */
+struct MjpegEncoderConfig
+{
+	MjpegEncoderConfig()
+		: threads(0), reserved_cpus(1), sched_policy(SCHED_OTHER),
+		  sched_priority(0)
+	{
+		CPU_ZERO(&cpus);
+	}
+
+	unsigned int threads;
+	unsigned int reserved_cpus;
+	cpu_set_t cpus;
+	int sched_policy;
+	int sched_priority;
+};
+
 class MjpegEncoder
 {
 public:
-	MjpegEncoder();
+	/* Maximum number of frames queued to the encoder and not delivered yet. */
+	static constexpr unsigned int MAX_FRAMES_IN_FLIGHT = 16;
+
+	MjpegEncoder(const MjpegEncoderConfig &config = MjpegEncoderConfig());
 	~MjpegEncoder();
 
 	void EncodeBuffer(void *mem, void *dest, unsigned int size,
-			  StreamInfo const &info, int64_t timestamp_us,
-			  unsigned int cookie);
+			  unsigned int dest_size, StreamInfo const &info,
+			  int64_t timestamp_us, unsigned int cookie);
 	StreamInfo getStreamInfo(libcamera::Stream *stream);
+
+	/* Wait until the callback has returned for all queued frames. */
+	void Flush();
 	void SetOutputReadyCallback(OutputReadyCallback callback) { output_ready_callback_ = callback; }
+	void SetOverflowPolicy(MjpegOverflowPolicy policy) { overflow_policy_ = policy; }
+
+	/*
+	 * Set the JPEG quality, from MIN_QUALITY to 100. Must be called before
+	 * the first frame is queued.
+	 */
+	void SetQuality(int quality) { quality_ = std::clamp(quality, MIN_QUALITY, 100); }
+
+	/*
+	 * Split each frame in up to @slices horizontal bands encoded in
+	 * parallel, to reduce the latency of a single frame. Must be called
+	 * before the first frame is queued, 1 encodes whole frames.
+	 */
+	void SetSlices(unsigned int slices) { num_slices_ = std::clamp(slices, 1U, MAX_SLICES); }
+
+	/*
+	 * Limit the number of frames queued to the encoder and not delivered
+	 * yet, normally the number of camera buffers. Must be called before
+	 * the first frame is queued.
+	 */
+	void SetFramesInFlight(unsigned int frames)
+	{
+		frames_in_flight_ = std::clamp(frames, 1U, MAX_FRAMES_IN_FLIGHT);
+	}
+
+	/* Number of frames that didn't fit in their destination buffer. */
+	uint64_t Overflows() const { return overflows_; }
+
+	/* Number of threads in the encode pool. */
+	unsigned int Threads() const { return encode_thread_.size(); }
 
 private:
-	static const int NUM_ENC_THREADS = 4;
+	static const unsigned int MAX_ENC_THREADS = 16;
+	static constexpr int QUALITY = 50;
+	static constexpr int MIN_QUALITY = 10;
+	static constexpr unsigned int MCU_SIZE = 16;
+	static constexpr unsigned int MAX_SLICES = 16;
 
 	void encodeThread(int num);
+	void setupThread(const char *name);
 
 	/*
 	 * Handle the output buffers in another thread so as not to block the
@@ -59,18 +159,60 @@ private:
 		void *mem;
 		void *dest;
 		unsigned int size;
+		unsigned int dest_size;
 		StreamInfo info;
 		int64_t timestamp_us;
 		uint64_t index;
 		unsigned int cookie;
+		unsigned int band;
+		unsigned int num_bands;
+	};
+
+	struct Band
+	{
+		unsigned int first_row;
+		unsigned int num_rows;
+		unsigned int restart_interval;
+		uint8_t *dest;
+		size_t dest_size;
+	};
+
+	/*
+	 * State of a frame encoded in bands, indexed by frame index modulo
+	 * MAX_FRAMES_IN_FLIGHT. The number of frames in flight is bounded by
+	 * frames_in_flight_.
+	 */
+	struct SliceFrame
+	{
+		unsigned int num_bands;
+		unsigned int band_rows;
+		unsigned int restart_interval;
+		std::atomic<unsigned int> remaining{ 0 };
+		std::atomic<uint64_t> encode_start{ 0 };
+		size_t bytes_used[MAX_SLICES];
+		bool overflow[MAX_SLICES];
 	};
 
 	std::queue<EncodeItem> encode_queue_;
 	std::mutex encode_mutex_;
 	std::condition_variable encode_cond_var_;
-	std::thread encode_thread_[NUM_ENC_THREADS];
-	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item,
-			uint8_t *&encoded_buffer, size_t &buffer_len);
+	std::vector<std::thread> encode_thread_;
+	bool encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item,
+			int quality, size_t &bytes_used);
+	bool encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item,
+			const Band &band, int quality, size_t &bytes_used);
+	size_t encodeFrame(struct jpeg_compress_struct &cinfo, EncodeItem &item);
+	void encodeBand(struct jpeg_compress_struct &cinfo, EncodeItem &item,
+			SliceFrame &frame);
+	size_t stitchBands(EncodeItem &item, SliceFrame &frame);
+
+	MjpegEncoderConfig config_;
+	MjpegOverflowPolicy overflow_policy_;
+	int quality_;
+	std::atomic<uint64_t> overflows_;
+	unsigned int num_slices_;
+	unsigned int frames_in_flight_;
+	SliceFrame slice_frames_[MAX_FRAMES_IN_FLIGHT];
 
 	struct OutputItem
 	{
@@ -79,9 +221,28 @@ private:
 		int64_t timestamp_us;
 		uint64_t index;
 		unsigned int cookie;
+		MjpegEncodeTimes times;
+	};
+
+	/*
+	 * Reorder buffer between the encode threads and the output thread,
+	 * indexed by frame index modulo MAX_FRAMES_IN_FLIGHT. The slots are
+	 * protected by output_mutex_. output_index_ is the index of the next
+	 * frame to deliver, only written by the output thread with the mutex
+	 * held. delivered_index_ trails it until the output ready callback
+	 * has returned, Flush() waits on it.
+	 */
+	struct OutputSlot
+	{
+		OutputItem item;
+		bool ready = false;
 	};
 
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
+	OutputSlot output_slots_[MAX_FRAMES_IN_FLIGHT];
+	std::atomic<uint64_t> output_index_;
+	std::condition_variable slot_cond_var_;
+	uint64_t delivered_index_;
+	std::condition_variable delivered_cond_var_;
 	std::mutex output_mutex_;
 	std::condition_variable output_cond_var_;
 	std::thread output_thread_;
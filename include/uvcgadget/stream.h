@@ -10,10 +10,14 @@
 #ifndef __STREAM_H__
 #define __STREAM_H__
 
+#include <stdio.h>
+
 struct events;
 struct uvc_function_config;
+struct uvc_host_emulator;
 struct uvc_stream;
 struct v4l2_pix_format;
+struct video_sink;
 struct video_source;
 
 /*
@@ -23,6 +27,12 @@ struct video_source;
  * Create a new UVC stream to handle the UVC function corresponding to the video
  * device node @uvc_device.
  *
+ * If @uvc_device is NULL, the stream isn't associated with a UDC. Frames are
+ * then delivered to a sink set with uvc_stream_set_video_sink(), and the stream
+ * is controlled by calling uvc_stream_set_format(), uvc_stream_set_frame_rate()
+ * and uvc_stream_enable() directly. This allows running the pipeline without
+ * USB hardware.
+ *
  * Streams allocated with this function can be deleted with uvc_stream_delete().
  *
  * On success, returns a pointer to newly allocated and populated struct uvc_stream.
@@ -30,6 +40,20 @@ struct video_source;
  */
 struct uvc_stream *uvc_stream_new(const char *uvc_device);
 
+/*
+ * uvc_stream_new_emulated - Create a new UVC stream driven by a host emulator
+ * @host: the host emulator
+ *
+ * Create a new UVC stream that receives UVC events from the host emulator
+ * @host instead of a UVC gadget device node, and delivers frames to the
+ * emulator's sink. The stream must then be initialized with
+ * uvc_stream_init_uvc() as for streams created with uvc_stream_new().
+ *
+ * On success, returns a pointer to newly allocated and populated struct uvc_stream.
+ * On failure, returns NULL.
+ */
+struct uvc_stream *uvc_stream_new_emulated(struct uvc_host_emulator *host);
+
 /*
  * uvc_stream_init_uvc - Initialize a UVC stream
  * @stream: the UVC stream
@@ -46,9 +70,12 @@ struct uvc_stream *uvc_stream_new(const char *uvc_device);
  * and ensure that the event handler is immediately usable. If the event loop is
  * already running, all initialization steps required to handle events must be
  * fully performed before calling this function.
+ *
+ * Returns 0 on success, or a negative error code if the function configuration
+ * is invalid or memory can't be allocated.
  */
-void uvc_stream_init_uvc(struct uvc_stream *stream,
-			 struct uvc_function_config *fc);
+int uvc_stream_init_uvc(struct uvc_stream *stream,
+			struct uvc_function_config *fc);
 
 /*
  * uvc_stream_set_event_handler - Set an event handler for a stream
@@ -64,6 +91,66 @@ void uvc_stream_set_event_handler(struct uvc_stream *stream,
 void uvc_stream_set_video_source(struct uvc_stream *stream,
 				 struct video_source *src);
 
+/*
+ * uvc_stream_set_video_sink - Override the video sink of a stream
+ * @stream: the UVC stream
+ * @sink: the video sink
+ *
+ * Streams deliver frames to the UVC V4L2 output device by default. This
+ * function replaces it with @sink, which must have been initialized with
+ * video_sink_init(). The caller keeps ownership of @sink and must destroy it
+ * after deleting the stream.
+ */
+void uvc_stream_set_video_sink(struct uvc_stream *stream,
+			       struct video_sink *sink);
+
+#define UVC_STREAM_MIN_BUFFERS		2
+#define UVC_STREAM_MAX_BUFFERS		16
+#define UVC_STREAM_DEFAULT_BUFFERS	4
+
+/*
+ * uvc_stream_set_buffer_count - Set the number of buffers used by a stream
+ * @stream: the UVC stream
+ * @nbufs: the number of buffers
+ *
+ * This function sets the number of buffers allocated on the sink and requested
+ * from the video source when the stream starts, and thus the number of frames
+ * that can be in flight between the source and the host. Fewer buffers reduce
+ * latency, more buffers absorb scheduling jitter on the USB bus. The setting
+ * takes effect the next time buffers are allocated. Buffers are kept when the
+ * stream is restarted with the same format, and reallocated on a format change
+ * or once they have been freed by the idle timeout.
+ *
+ * Returns 0 on success, or -EINVAL if @nbufs is out of the
+ * [UVC_STREAM_MIN_BUFFERS, UVC_STREAM_MAX_BUFFERS] range.
+ */
+int uvc_stream_set_buffer_count(struct uvc_stream *stream, unsigned int nbufs);
+
+/*
+ * uvc_stream_buffer_preset - Look up a named buffer count preset
+ * @name: the preset name, "low-latency", "balanced" or "throughput"
+ *
+ * Returns the number of buffers for the preset, or -EINVAL if @name isn't a
+ * known preset.
+ */
+int uvc_stream_buffer_preset(const char *name);
+
+#define UVC_STREAM_DEFAULT_IDLE_TIMEOUT	10000
+
+/*
+ * uvc_stream_set_idle_timeout - Set the delay before freeing stream buffers
+ * @stream: the UVC stream
+ * @timeout: the delay in milliseconds
+ *
+ * When streaming stops, the stream keeps its buffers and the video source
+ * configuration for @timeout milliseconds. If the host restarts streaming with
+ * the same format in the meantime, the stream resumes without reallocating
+ * anything. A format change always frees the buffers. A @timeout of 0 frees the
+ * buffers as soon as streaming stops.
+ */
+void uvc_stream_set_idle_timeout(struct uvc_stream *stream,
+				 unsigned int timeout);
+
 /*
  * uvc_stream_delete - Delete a UVC stream
  * @stream: the UVC stream
@@ -77,6 +164,36 @@ void uvc_stream_set_video_source(struct uvc_stream *stream,
  */
 void uvc_stream_delete(struct uvc_stream *stream);
 
+/*
+ * uvc_stream_dump_latency - Print the frame latency histograms
+ * @stream: the UVC stream
+ * @file: the file to print to
+ *
+ * Frames are time stamped as they go through the pipeline stages, from
+ * capture to the sink handing the buffer back after transmission. Print the
+ * distribution of the time spent reaching each stage from the previous one,
+ * and of the total, for all frames since the stream was created.
+ *
+ * This function only reads the histograms and may be called at any time from
+ * the thread running the event loop.
+ */
+void uvc_stream_dump_latency(struct uvc_stream *stream, FILE *file);
+
+/*
+ * uvc_stream_write_metrics - Write the stream metrics
+ * @stream: the UVC stream
+ * @file: the file to write to
+ *
+ * Write the frame, byte, drop and underrun counters, the buffer queue depths,
+ * and the frame size and latency distributions of the stream in the
+ * Prometheus text exposition format. Counters accumulate since the stream was
+ * created.
+ *
+ * As uvc_stream_dump_latency(), this function must be called from the thread
+ * running the event loop.
+ */
+void uvc_stream_write_metrics(struct uvc_stream *stream, FILE *file);
+
 /*
  * uvc_stream_set_format - Set the active video format for the stream
  * @stream: the UVC stream
@@ -92,8 +209,8 @@ int uvc_stream_set_format(struct uvc_stream *stream,
 
 /*
  * uvc_stream_set_frame_rate - Set the frame rate for the stream
- * @stream: the UVC stream
- * @fps:    the frame rate in frames per second
+ * @stream:   the UVC stream
+ * @interval: the frame interval in 100ns units, as in the UVC dwFrameInterval
  *
  * This function is called from the UVC protocol handler to configure the frame
  * rate for the video source of the @stream. It must not be called directly by
@@ -101,7 +218,8 @@ int uvc_stream_set_format(struct uvc_stream *stream,
  *
  * Returns 0 on success, or a negative error code on failure.
  */
-int uvc_stream_set_frame_rate(struct uvc_stream *stream, unsigned int fps);
+int uvc_stream_set_frame_rate(struct uvc_stream *stream,
+			      unsigned int interval);
 
 /*
  * uvc_stream_enable - Turn on/off video streaming for the UVC stream
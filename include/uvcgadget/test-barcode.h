@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Frame identification barcode
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+#ifndef __TEST_BARCODE_H__
+#define __TEST_BARCODE_H__
+
+#include <stdint.h>
+
+/*
+ * The barcode is a grid of TEST_BARCODE_COLUMNS x TEST_BARCODE_ROWS square
+ * blocks drawn at the top left corner of the frame, white for ones and black
+ * for zeros, read left to right and top to bottom. It carries a 16-bit sync
+ * word, the frame sequence number, the time stamp and a CRC-16 of the sequence
+ * number and time stamp, all most significant bit first. Blocks are large
+ * enough to survive MJPEG compression and scaling by the host.
+ */
+#define TEST_BARCODE_COLUMNS	32U
+#define TEST_BARCODE_ROWS	4U
+#define TEST_BARCODE_BITS	(TEST_BARCODE_COLUMNS * TEST_BARCODE_ROWS)
+#define TEST_BARCODE_SYNC	0xa55a
+
+/*
+ * struct test_barcode - Frame identification
+ * @sequence: frame sequence number, starting at 0 when streaming starts
+ * @timestamp: CLOCK_MONOTONIC time at which the frame was generated, in ns
+ */
+struct test_barcode {
+	uint32_t sequence;
+	uint64_t timestamp;
+};
+
+/*
+ * test_barcode_size - Compute the size of the barcode blocks
+ * @width: frame width in pixels
+ * @height: frame height in pixels
+ *
+ * Returns the width and height of a block in pixels, always even, or 0 if the
+ * frame is too small to hold a barcode.
+ */
+unsigned int test_barcode_size(unsigned int width, unsigned int height);
+
+/*
+ * test_barcode_draw_yuyv - Draw a barcode in a YUYV frame
+ * @mem: frame memory
+ * @width: frame width in pixels
+ * @height: frame height in pixels
+ * @stride: line length in bytes
+ * @code: frame identification to encode
+ */
+void test_barcode_draw_yuyv(void *mem, unsigned int width, unsigned int height,
+			    unsigned int stride, const struct test_barcode *code);
+
+/*
+ * test_barcode_read - Read the barcode from the luma plane of a frame
+ * @luma: pointer to the first luma sample
+ * @pixel_step: distance between two horizontally adjacent luma samples in
+ *	bytes, 2 for YUYV and 1 for greyscale images
+ * @width: frame width in pixels
+ * @height: frame height in pixels
+ * @stride: line length in bytes
+ * @code: decoded frame identification
+ *
+ * Returns 0 on success, or -EINVAL if the frame has no valid barcode.
+ */
+int test_barcode_read(const uint8_t *luma, unsigned int pixel_step,
+		      unsigned int width, unsigned int height,
+		      unsigned int stride, struct test_barcode *code);
+
+#endif /* __TEST_BARCODE_H__ */
@@ -14,7 +14,24 @@
 struct events;
 struct video_source;
 
+/*
+ * test_source_pattern - Patterns generated by the test source
+ * @TEST_PATTERN_BARS:		Static colour bars
+ * @TEST_PATTERN_SCROLL:	Horizontally scrolling colour bars with a frame
+ *				counter, every frame differs from the previous one
+ * @TEST_PATTERN_BARCODE:	Scrolling colour bars with a barcode carrying the
+ *				frame sequence number and generation time, see
+ *				test-barcode.h
+ */
+enum test_source_pattern {
+	TEST_PATTERN_BARS,
+	TEST_PATTERN_SCROLL,
+	TEST_PATTERN_BARCODE,
+};
+
 struct video_source *test_video_source_create(void);
+void test_video_source_set_pattern(struct video_source *src,
+				   enum test_source_pattern pattern);
 void test_video_source_init(struct video_source *src, struct events *events);
 
 #endif /* __TEST_VIDEO_SOURCE_H__ */
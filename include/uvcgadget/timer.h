@@ -7,49 +7,63 @@
  * Contact: Daniel Scally <dan.scally@ideasonboard.com>
  */
 
+#include <stdint.h>
+
 struct timer;
 
 /*
  * timer_new - Create a new timer
  *
  * Allocates and returns a new struct timer. This must be configured with
- * timer_set_fps() and then armed with timer_arm(), following which calls to
- * timer_wait() will block until the expiration of a period as defined by
- * timer_set_fps().
+ * timer_set_interval() and then armed with timer_arm(), following which the file
+ * descriptor returned by timer_fd() becomes readable at the expiration of each
+ * period as defined by timer_set_interval().
  *
  * Timers allocated with this function should be removed with timer_destroy()
  */
 struct timer *timer_new(void);
 
 /*
- * timer_set_fps - Configure the timer's wait period
+ * timer_set_interval - Configure the timer's wait period
  *
- * Configure the timer to wait for a period of time such that expirations per
- * second matches @fps
+ * Configure the timer to expire every @interval, expressed in 100ns units like
+ * the UVC dwFrameInterval. The setting takes effect when the timer is armed.
  */
-void timer_set_fps(struct timer *timer, int fps);
+void timer_set_interval(struct timer *timer, unsigned int interval);
 
 /*
  * timer_arm
  *
- * Arms the timer such that calls to timer_wait() become blocking until the
- * expiration of a period.
+ * Arms the timer such that it expires at the end of each period, counted from
+ * now. Expirations are scheduled on CLOCK_MONOTONIC at absolute deadlines and
+ * don't drift.
  */
 int timer_arm(struct timer *timer);
 
 /*
  * timer_disarm
  *
- * Disarms the timer such that calls to timer_wait() return without blocking.
+ * Disarms the timer such that it doesn't expire anymore.
  */
 int timer_disarm(struct timer *timer);
 
 /*
- * timer_wait
+ * timer_fd
+ *
+ * Return the timer's file descriptor, to be watched for EVENT_READ with the
+ * event loop. The descriptor is readable when the timer has expired at least
+ * once since the last call to timer_expirations().
+ */
+int timer_fd(struct timer *timer);
+
+/*
+ * timer_expirations
  *
- * If the timer is armed, block until the expiration of a period
+ * Return the number of periods that have elapsed since the last call without
+ * blocking, and reset the count. A value larger than 1 means that expirations
+ * have been missed.
  */
-void timer_wait(struct timer *timer);
+uint64_t timer_expirations(struct timer *timer);
 
 /*
  * timer_destroy
@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Abstract video sink
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+#ifndef __VIDEO_SINK_H__
+#define __VIDEO_SINK_H__
+
+#include <linux/videodev2.h>
+
+struct events;
+struct video_buffer;
+struct video_buffer_set;
+struct video_sink;
+
+struct video_sink_ops {
+	void(*destroy)(struct video_sink *sink);
+	int(*set_format)(struct video_sink *sink, struct v4l2_pix_format *fmt);
+	int(*alloc_buffers)(struct video_sink *sink, enum v4l2_memory memtype,
+			    unsigned int nbufs);
+	int(*mmap_buffers)(struct video_sink *sink,
+			   struct video_buffer_set **buffers);
+	int(*import_buffers)(struct video_sink *sink,
+			     const struct video_buffer_set *buffers);
+	int(*free_buffers)(struct video_sink *sink);
+	int(*stream_on)(struct video_sink *sink);
+	int(*stream_off)(struct video_sink *sink);
+	int(*queue_buffer)(struct video_sink *sink, struct video_buffer *buf);
+};
+
+/*
+ * The buffer handler is called with every buffer the sink has consumed, once
+ * it has been dequeued. Ownership of the buffer is transferred to the handler.
+ */
+typedef void(*video_sink_buffer_handler_t)(void *, struct video_sink *,
+					   struct video_buffer *);
+
+struct video_sink {
+	const struct video_sink_ops *ops;
+	struct events *events;
+	video_sink_buffer_handler_t handler;
+	void *handler_data;
+};
+
+void video_sink_init(struct video_sink *sink, struct events *events);
+void video_sink_set_buffer_handler(struct video_sink *sink,
+				   video_sink_buffer_handler_t handler,
+				   void *data);
+void video_sink_destroy(struct video_sink *sink);
+int video_sink_set_format(struct video_sink *sink,
+			  struct v4l2_pix_format *fmt);
+int video_sink_alloc_buffers(struct video_sink *sink, enum v4l2_memory memtype,
+			     unsigned int nbufs);
+int video_sink_mmap_buffers(struct video_sink *sink,
+			    struct video_buffer_set **buffers);
+int video_sink_import_buffers(struct video_sink *sink,
+			      const struct video_buffer_set *buffers);
+int video_sink_free_buffers(struct video_sink *sink);
+int video_sink_stream_on(struct video_sink *sink);
+int video_sink_stream_off(struct video_sink *sink);
+int video_sink_queue_buffer(struct video_sink *sink, struct video_buffer *buf);
+
+#endif /* __VIDEO_SINK_H__ */
@@ -9,16 +9,30 @@
 #ifndef __VIDEO_SOURCE_H__
 #define __VIDEO_SOURCE_H__
 
+#include <stdint.h>
+
 struct v4l2_buffer;
 struct v4l2_pix_format;
 struct video_buffer;
 struct video_buffer_set;
 struct video_source;
 
+/*
+ * struct video_source_stats - Statistics reported by a video source
+ * @queued: number of frames held by the source and not delivered yet, for
+ *	instance waiting to be encoded
+ * @dropped: number of frames the source dropped since it was created
+ */
+struct video_source_stats {
+	unsigned int queued;
+	uint64_t dropped;
+};
+
 struct video_source_ops {
 	void(*destroy)(struct video_source *src);
 	int(*set_format)(struct video_source *src, struct v4l2_pix_format *fmt);
-	int(*set_frame_rate)(struct video_source *src, unsigned int fps);
+	int(*set_frame_rate)(struct video_source *src, unsigned int interval);
+	/* Return the number of buffers allocated, which may differ from nbufs. */
 	int(*alloc_buffers)(struct video_source *src, unsigned int nbufs);
 	int(*export_buffers)(struct video_source *src,
 			     struct video_buffer_set **buffers);
@@ -29,6 +43,8 @@ struct video_source_ops {
 	int(*stream_off)(struct video_source *src);
 	int(*queue_buffer)(struct video_source *src, struct video_buffer *buf);
 	void(*fill_buffer)(struct video_source *src, struct video_buffer *buf);
+	void(*get_stats)(struct video_source *src,
+			 struct video_source_stats *stats);
 };
 
 typedef void(*video_source_buffer_handler_t)(void *, struct video_source *,
@@ -61,7 +77,8 @@ void video_source_set_buffer_handler(struct video_source *src,
 void video_source_destroy(struct video_source *src);
 int video_source_set_format(struct video_source *src,
 			    struct v4l2_pix_format *fmt);
-int video_source_set_frame_rate(struct video_source *src, unsigned int fps);
+int video_source_set_frame_rate(struct video_source *src,
+				unsigned int interval);
 int video_source_alloc_buffers(struct video_source *src, unsigned int nbufs);
 int video_source_export_buffers(struct video_source *src,
 				struct video_buffer_set **buffers);
@@ -74,5 +91,7 @@ int video_source_queue_buffer(struct video_source *src,
 			      struct video_buffer *buf);
 void video_source_fill_buffer(struct video_source *src,
 			      struct video_buffer *buf);
+void video_source_get_stats(struct video_source *src,
+			    struct video_source_stats *stats);
 
 #endif /* __VIDEO_SOURCE_H__ */
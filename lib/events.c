@@ -14,18 +14,28 @@
 
 #define _DEFAULT_SOURCE
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <sys/epoll.h>
 #include <sys/select.h>
 
+#include "config.h"
 #include "events.h"
 #include "list.h"
 #include "tools.h"
 
 #define SELECT_TIMEOUT		2000		/* in milliseconds */
 
+/* Number of ready file descriptors retrieved by a single epoll_wait() call. */
+#define EPOLL_MAX_EVENTS	16
+
+/* Number of event types, and thus of handler slots per file descriptor. */
+#define EVENT_NUM_TYPES		3
+
 struct event_fd {
 	struct list_entry list;
 
@@ -35,38 +45,36 @@ struct event_fd {
 	void *priv;
 };
 
-void events_watch_fd(struct events *events, int fd, enum event_type type,
-		     void(*callback)(void *), void *priv)
-{
-	struct event_fd *event;
-
-	event = malloc(sizeof *event);
-	if (event == NULL)
-		return;
+/* -----------------------------------------------------------------------------
+ * select() backend
+ */
 
-	event->fd = fd;
-	event->type = type;
-	event->callback = callback;
-	event->priv = priv;
+static int events_select_watch(struct events *events, struct event_fd *event)
+{
+	if (event->fd >= FD_SETSIZE) {
+		printf("error: fd %d exceeds FD_SETSIZE\n", event->fd);
+		return -EINVAL;
+	}
 
 	switch (event->type) {
 	case EVENT_READ:
-		FD_SET(fd, &events->rfds);
+		FD_SET(event->fd, &events->rfds);
 		break;
 	case EVENT_WRITE:
-		FD_SET(fd, &events->wfds);
+		FD_SET(event->fd, &events->wfds);
 		break;
 	case EVENT_EXCEPTION:
-		FD_SET(fd, &events->efds);
+		FD_SET(event->fd, &events->efds);
 		break;
 	}
 
-	events->maxfd = max(events->maxfd, fd);
+	events->maxfd = max(events->maxfd, event->fd);
 
-	list_append(&event->list, &events->events);
+	return 0;
 }
 
-void events_unwatch_fd(struct events *events, int fd, enum event_type type)
+static struct event_fd *events_select_unwatch(struct events *events, int fd,
+					      enum event_type type)
 {
 	struct event_fd *event = NULL;
 	struct event_fd *entry;
@@ -80,7 +88,7 @@ void events_unwatch_fd(struct events *events, int fd, enum event_type type)
 	}
 
 	if (event == NULL)
-		return;
+		return NULL;
 
 	switch (event->type) {
 	case EVENT_READ:
@@ -96,67 +104,363 @@ void events_unwatch_fd(struct events *events, int fd, enum event_type type)
 
 	events->maxfd = maxfd;
 
-	list_remove(&event->list);
-	free(event);
+	return event;
 }
 
-static void events_dispatch(struct events *events, const fd_set *rfds,
-			    const fd_set *wfds, const fd_set *efds)
+/*
+ * Callbacks may watch and unwatch file descriptors, including their own, which
+ * frees the list entry being iterated and possibly the next one. Clear each
+ * ready event from the sets once dispatched and restart the walk from the head
+ * of the list, until all the @ready events reported by select() have been
+ * dispatched or no ready event is left.
+ */
+static void events_select_dispatch(struct events *events, fd_set *rfds,
+				   fd_set *wfds, fd_set *efds, int ready)
 {
 	struct event_fd *event;
+	fd_set *fds;
 
+restart:
 	list_for_each_entry(event, &events->events, list) {
-		if (event->type == EVENT_READ &&
-		    FD_ISSET(event->fd, rfds))
-			event->callback(event->priv);
-		else if (event->type == EVENT_WRITE &&
-			 FD_ISSET(event->fd, wfds))
-			event->callback(event->priv);
-		else if (event->type == EVENT_EXCEPTION &&
-			 FD_ISSET(event->fd, efds))
-			event->callback(event->priv);
+		switch (event->type) {
+		case EVENT_READ:
+			fds = rfds;
+			break;
+		case EVENT_WRITE:
+			fds = wfds;
+			break;
+		case EVENT_EXCEPTION:
+			fds = efds;
+			break;
+		default:
+			continue;
+		}
+
+		if (!FD_ISSET(event->fd, fds))
+			continue;
+
+		FD_CLR(event->fd, fds);
+		event->callback(event->priv);
+
+		events->dispatches++;
 
 		/* If the callback stopped events processing, we're done. */
-		if (events->done)
-			break;
+		if (events->done || !--ready)
+			return;
+
+		goto restart;
 	}
 }
 
+static int events_select_wait(struct events *events)
+{
+	fd_set rfds;
+	fd_set wfds;
+	fd_set efds;
+	int ret;
+	struct timeval tv;
+
+	rfds = events->rfds;
+	wfds = events->wfds;
+	efds = events->efds;
+
+	/* This 100ms timeout is here to reduce latency on shutdown events. */
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+
+	ret = select(events->maxfd + 1, &rfds, &wfds, &efds, &tv);
+	if (ret < 0)
+		return -errno;
+
+	events->wakeups++;
+
+	if (ret > 0)
+		events_select_dispatch(events, &rfds, &wfds, &efds, ret);
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * epoll backend
+ *
+ * epoll requires a single registration per file descriptor, while users of the
+ * events API watch the same descriptor for different event types (the UVC
+ * device node is watched for exceptions and, while streaming, for writes). The
+ * handlers are thus stored in a table indexed by file descriptor with one slot
+ * per event type, and the epoll registration mask is derived from the occupied
+ * slots. Only file descriptors are stored in the epoll data, so handlers
+ * removed by a callback are never dereferenced by the remainder of the batch.
+ */
+
+static unsigned int event_type_slot(enum event_type type)
+{
+	switch (type) {
+	case EVENT_READ:
+	default:
+		return 0;
+	case EVENT_WRITE:
+		return 1;
+	case EVENT_EXCEPTION:
+		return 2;
+	}
+}
+
+static struct event_fd **events_epoll_slots(struct events *events, int fd)
+{
+	if (fd < 0 || (unsigned int)fd >= events->num_handlers)
+		return NULL;
+
+	return &events->handlers[fd * EVENT_NUM_TYPES];
+}
+
+static uint32_t events_epoll_mask(struct events *events, int fd)
+{
+	struct event_fd **slots = events_epoll_slots(events, fd);
+	uint32_t mask = 0;
+
+	if (!slots)
+		return 0;
+
+	if (slots[event_type_slot(EVENT_READ)])
+		mask |= EPOLLIN;
+	if (slots[event_type_slot(EVENT_WRITE)])
+		mask |= EPOLLOUT;
+	if (slots[event_type_slot(EVENT_EXCEPTION)])
+		mask |= EPOLLPRI;
+
+	return mask;
+}
+
+static int events_epoll_update(struct events *events, int fd, uint32_t old_mask)
+{
+	struct epoll_event ev;
+	int op;
+	int ret;
+
+	memset(&ev, 0, sizeof ev);
+	ev.events = events_epoll_mask(events, fd);
+	ev.data.fd = fd;
+
+	if (!ev.events)
+		op = EPOLL_CTL_DEL;
+	else if (!old_mask)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+
+	ret = epoll_ctl(events->epfd, op, fd, &ev);
+
+	/*
+	 * Closing a file descriptor removes it from the epoll set behind our
+	 * back. Recover by registering it again.
+	 */
+	if (ret < 0 && errno == ENOENT && op == EPOLL_CTL_MOD)
+		ret = epoll_ctl(events->epfd, EPOLL_CTL_ADD, fd, &ev);
+	if (ret < 0 && op == EPOLL_CTL_DEL && (errno == ENOENT || errno == EBADF))
+		ret = 0;
+
+	if (ret < 0) {
+		ret = -errno;
+		printf("error: epoll_ctl(%d) on fd %d failed with %d\n", op, fd,
+		       -ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int events_epoll_watch(struct events *events, struct event_fd *event)
+{
+	struct event_fd **slot;
+	uint32_t old_mask;
+	int ret;
+
+	if (event->fd < 0)
+		return -EBADF;
+
+	if ((unsigned int)event->fd >= events->num_handlers) {
+		unsigned int num = max_t(unsigned int, event->fd + 1,
+					 events->num_handlers * 2);
+		struct event_fd **handlers;
+
+		handlers = realloc(events->handlers,
+				   num * EVENT_NUM_TYPES * sizeof(*handlers));
+		if (!handlers)
+			return -ENOMEM;
+
+		memset(&handlers[events->num_handlers * EVENT_NUM_TYPES], 0,
+		       (num - events->num_handlers) * EVENT_NUM_TYPES *
+		       sizeof(*handlers));
+
+		events->handlers = handlers;
+		events->num_handlers = num;
+	}
+
+	slot = &events_epoll_slots(events, event->fd)[event_type_slot(event->type)];
+	if (*slot) {
+		printf("error: fd %d already watched for event type %u\n",
+		       event->fd, event->type);
+		return -EBUSY;
+	}
+
+	old_mask = events_epoll_mask(events, event->fd);
+	*slot = event;
+
+	ret = events_epoll_update(events, event->fd, old_mask);
+	if (ret < 0)
+		*slot = NULL;
+
+	return ret;
+}
+
+static struct event_fd *events_epoll_unwatch(struct events *events, int fd,
+					     enum event_type type)
+{
+	struct event_fd **slots = events_epoll_slots(events, fd);
+	struct event_fd *event;
+	uint32_t old_mask;
+
+	if (!slots)
+		return NULL;
+
+	event = slots[event_type_slot(type)];
+	if (!event)
+		return NULL;
+
+	old_mask = events_epoll_mask(events, fd);
+	slots[event_type_slot(type)] = NULL;
+
+	events_epoll_update(events, fd, old_mask);
+
+	return event;
+}
+
+static void events_epoll_dispatch(struct events *events, int fd,
+				  enum event_type type)
+{
+	struct event_fd **slots = events_epoll_slots(events, fd);
+	struct event_fd *event;
+
+	/* The handler may have been removed by a previous callback. */
+	if (!slots || events->done)
+		return;
+
+	event = slots[event_type_slot(type)];
+	if (!event)
+		return;
+
+	events->dispatches++;
+	event->callback(event->priv);
+}
+
+static int events_epoll_wait(struct events *events)
+{
+	struct epoll_event ready[EPOLL_MAX_EVENTS];
+	int nfds;
+	int i;
+
+	/*
+	 * There's no timeout: signals interrupt epoll_wait() regardless of
+	 * SA_RESTART, so shutdown requests are handled immediately.
+	 */
+	nfds = epoll_wait(events->epfd, ready, ARRAY_SIZE(ready), -1);
+	if (nfds < 0)
+		return -errno;
+
+	events->wakeups++;
+
+	for (i = 0; i < nfds && !events->done; ++i) {
+		uint32_t revents = ready[i].events;
+		int fd = ready[i].data.fd;
+
+		/*
+		 * Translate the events the same way select() does, errors and
+		 * hang-ups are reported to readers and errors to writers.
+		 * Exceptions are handled first, as they carry the UVC control
+		 * requests.
+		 */
+		if (revents & EPOLLPRI)
+			events_epoll_dispatch(events, fd, EVENT_EXCEPTION);
+		if (revents & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			events_epoll_dispatch(events, fd, EVENT_READ);
+		if (revents & (EPOLLOUT | EPOLLERR))
+			events_epoll_dispatch(events, fd, EVENT_WRITE);
+	}
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Events API
+ */
+
+void events_watch_fd(struct events *events, int fd, enum event_type type,
+		     void(*callback)(void *), void *priv)
+{
+	struct event_fd *event;
+	int ret;
+
+	event = malloc(sizeof *event);
+	if (event == NULL)
+		return;
+
+	event->fd = fd;
+	event->type = type;
+	event->callback = callback;
+	event->priv = priv;
+
+	if (events->backend == EVENTS_BACKEND_EPOLL)
+		ret = events_epoll_watch(events, event);
+	else
+		ret = events_select_watch(events, event);
+
+	if (ret < 0) {
+		free(event);
+		return;
+	}
+
+	list_append(&event->list, &events->events);
+}
+
+void events_unwatch_fd(struct events *events, int fd, enum event_type type)
+{
+	struct event_fd *event;
+
+	if (events->backend == EVENTS_BACKEND_EPOLL)
+		event = events_epoll_unwatch(events, fd, type);
+	else
+		event = events_select_unwatch(events, fd, type);
+
+	if (event == NULL)
+		return;
+
+	list_remove(&event->list);
+	free(event);
+}
+
 bool events_loop(struct events *events)
 {
 	events->done = false;
 
 	while (!events->done) {
-		fd_set rfds;
-		fd_set wfds;
-		fd_set efds;
 		int ret;
-		struct timeval tv;
-
-		rfds = events->rfds;
-		wfds = events->wfds;
-		efds = events->efds;
 
-		/* This 100ms timeout is here to reduce latency on shutdown
-		 * events.
-		 */
-		tv.tv_sec = 0;
-		tv.tv_usec = 100000;
+		if (events->backend == EVENTS_BACKEND_EPOLL)
+			ret = events_epoll_wait(events);
+		else
+			ret = events_select_wait(events);
 
-		ret = select(events->maxfd + 1, &rfds, &wfds, &efds, &tv);
 		if (ret < 0) {
 			/* EINTR means that a signal has been received, continue
 			 * to the next iteration in that case.
 			 */
-			if (errno == EINTR)
+			if (ret == -EINTR)
 				continue;
 
-			printf("error: select failed with %d\n", errno);
+			printf("error: %s failed with %d\n",
+			       events_backend_name(events->backend), -ret);
 			break;
 		}
-
-		if (ret > 0)
-			events_dispatch(events, &rfds, &wfds, &efds);
 	}
 
 	return !events->done;
@@ -167,7 +471,7 @@ void events_stop(struct events *events)
 	events->done = true;
 }
 
-void events_init(struct events *events)
+int events_init_backend(struct events *events, enum events_backend backend)
 {
 	memset(events, 0, sizeof *events);
 
@@ -175,7 +479,38 @@ void events_init(struct events *events)
 	FD_ZERO(&events->wfds);
 	FD_ZERO(&events->efds);
 	events->maxfd = 0;
+	events->epfd = -1;
+	events->backend = EVENTS_BACKEND_SELECT;
 	list_init(&events->events);
+
+	if (backend == EVENTS_BACKEND_DEFAULT) {
+#ifdef CONFIG_EVENTS_EPOLL
+		backend = EVENTS_BACKEND_EPOLL;
+#else
+		backend = EVENTS_BACKEND_SELECT;
+#endif
+	}
+
+	if (backend == EVENTS_BACKEND_EPOLL) {
+		events->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (events->epfd < 0) {
+			int ret = -errno;
+
+			printf("error: epoll_create1 failed with %d\n", -ret);
+			return ret;
+		}
+	}
+
+	events->backend = backend;
+
+	return 0;
+}
+
+void events_init(struct events *events)
+{
+	/* Fall back to select() if the default backend can't be created. */
+	if (events_init_backend(events, EVENTS_BACKEND_DEFAULT) < 0)
+		events_init_backend(events, EVENTS_BACKEND_SELECT);
 }
 
 void events_cleanup(struct events *events)
@@ -187,4 +522,26 @@ void events_cleanup(struct events *events)
 		list_remove(&event->list);
 		free(event);
 	}
+
+	free(events->handlers);
+	events->handlers = NULL;
+	events->num_handlers = 0;
+
+	if (events->epfd >= 0) {
+		close(events->epfd);
+		events->epfd = -1;
+	}
+}
+
+const char *events_backend_name(enum events_backend backend)
+{
+	switch (backend) {
+	case EVENTS_BACKEND_SELECT:
+		return "select";
+	case EVENTS_BACKEND_EPOLL:
+		return "epoll";
+	case EVENTS_BACKEND_DEFAULT:
+	default:
+		return "default";
+	}
 }
@@ -0,0 +1,474 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Null and file video sinks
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include <linux/videodev2.h>
+
+#include "events.h"
+#include "file-sink.h"
+#include "log.h"
+#include "tools.h"
+#include "video-buffers.h"
+
+UVC_LOG_MODULE(sink);
+
+/*
+ * struct file_sink_entry - Buffer queued to the sink
+ * @buf: the buffer
+ * @queued: CLOCK_MONOTONIC time at which the buffer has been queued, in ns
+ */
+struct file_sink_entry {
+	struct video_buffer buf;
+	uint64_t queued;
+};
+
+struct file_sink {
+	struct video_sink sink;
+
+	/* Output file, -1 for the null sink. */
+	char *path;
+	int fd;
+
+	uint64_t rate;
+
+	struct v4l2_pix_format format;
+	enum v4l2_memory memtype;
+	struct video_buffer_set buffers;
+
+	/*
+	 * Queued buffers in FIFO order. The first one is being consumed and
+	 * completes at @deadline, the previous one completed at @done.
+	 */
+	struct file_sink_entry queue[VIDEO_MAX_FRAME];
+	unsigned int queue_first;
+	unsigned int queue_count;
+	uint64_t deadline;
+	uint64_t done;
+
+	int timer;
+	bool streaming;
+
+	/* Statistics for the current streaming session. */
+	uint64_t start;
+	uint64_t frames;
+	uint64_t bytes;
+};
+
+#define to_file_sink(s) container_of(s, struct file_sink, sink)
+
+static uint64_t file_sink_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Compute the completion time of the first buffer and arm the timer for it. */
+static void file_sink_schedule(struct file_sink *sink)
+{
+	const struct file_sink_entry *entry = &sink->queue[sink->queue_first];
+	struct itimerspec its = { 0 };
+	uint64_t start;
+
+	start = max(sink->done, entry->queued);
+	sink->deadline = start;
+	if (sink->rate)
+		sink->deadline += entry->buf.bytesused * 1000000000ULL / sink->rate;
+
+	/* A zero it_value disarms the timer, make sure the deadline isn't 0. */
+	its.it_value.tv_sec = sink->deadline / 1000000000;
+	its.it_value.tv_nsec = sink->deadline % 1000000000 ? : 1;
+	timerfd_settime(sink->timer, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void file_sink_write(struct file_sink *sink,
+			    const struct video_buffer *buf)
+{
+	const uint8_t *mem = sink->buffers.buffers[buf->index].mem;
+	unsigned int size = buf->bytesused;
+	ssize_t ret;
+
+	while (size) {
+		ret = write(sink->fd, mem, size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			log_error_ratelimited("%s: write error: %s (%d)\n",
+					      sink->path, strerror(errno), errno);
+			return;
+		}
+
+		mem += ret;
+		size -= ret;
+	}
+}
+
+static void file_sink_process(void *d)
+{
+	struct file_sink *sink = d;
+	unsigned int count = sink->queue_count;
+	uint64_t expirations;
+	uint64_t now;
+
+	if (read(sink->timer, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN)
+		return;
+
+	now = file_sink_now();
+
+	/*
+	 * Complete the buffers that are due. Buffers queued by the handler
+	 * are left for the next iteration of the event loop, to avoid
+	 * starving other file descriptors when the rate is unlimited.
+	 */
+	while (count-- && sink->queue_count && sink->deadline <= now) {
+		struct video_buffer buf = sink->queue[sink->queue_first].buf;
+
+		sink->queue_first = (sink->queue_first + 1) % VIDEO_MAX_FRAME;
+		sink->queue_count--;
+		sink->done = sink->deadline;
+
+		if (sink->fd >= 0)
+			file_sink_write(sink, &buf);
+
+		sink->frames++;
+		sink->bytes += buf.bytesused;
+
+		if (sink->queue_count)
+			file_sink_schedule(sink);
+
+		sink->sink.handler(sink->sink.handler_data, &sink->sink, &buf);
+
+		/* The handler may have stopped the stream. */
+		if (!sink->streaming)
+			return;
+	}
+}
+
+static unsigned int file_sink_frame_size(const struct v4l2_pix_format *fmt,
+					 unsigned int *bytesperline)
+{
+	switch (fmt->pixelformat) {
+	case V4L2_PIX_FMT_GREY:
+		*bytesperline = fmt->width;
+		return fmt->width * fmt->height;
+
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+		*bytesperline = fmt->width;
+		return fmt->width * fmt->height * 3 / 2;
+
+	case V4L2_PIX_FMT_MJPEG:
+		*bytesperline = 0;
+		return fmt->width * fmt->height * 2;
+
+	default:
+		*bytesperline = fmt->width * 2;
+		return fmt->width * fmt->height * 2;
+	}
+}
+
+static int file_sink_free_buffers(struct video_sink *s)
+{
+	struct file_sink *sink = to_file_sink(s);
+	unsigned int i;
+
+	for (i = 0; i < sink->buffers.nbufs; ++i) {
+		struct video_buffer *buffer = &sink->buffers.buffers[i];
+
+		if (sink->memtype == V4L2_MEMORY_MMAP) {
+			free(buffer->mem);
+			continue;
+		}
+
+		if (buffer->mem)
+			munmap(buffer->mem, buffer->size);
+		if (buffer->dmabuf >= 0)
+			close(buffer->dmabuf);
+	}
+
+	free(sink->buffers.buffers);
+	sink->buffers.buffers = NULL;
+	sink->buffers.nbufs = 0;
+
+	return 0;
+}
+
+static void file_sink_destroy(struct video_sink *s)
+{
+	struct file_sink *sink = to_file_sink(s);
+
+	file_sink_free_buffers(s);
+
+	if (sink->fd >= 0)
+		close(sink->fd);
+	close(sink->timer);
+
+	free(sink->path);
+	free(sink);
+}
+
+static int file_sink_set_format(struct video_sink *s,
+				struct v4l2_pix_format *fmt)
+{
+	struct file_sink *sink = to_file_sink(s);
+	unsigned int size;
+
+	/* Mimic the UVC gadget driver, which computes the line and image sizes. */
+	size = file_sink_frame_size(fmt, &fmt->bytesperline);
+	if (fmt->pixelformat != V4L2_PIX_FMT_MJPEG || !fmt->sizeimage)
+		fmt->sizeimage = size;
+
+	sink->format = *fmt;
+
+	return 0;
+}
+
+static int file_sink_alloc_buffers(struct video_sink *s,
+				   enum v4l2_memory memtype, unsigned int nbufs)
+{
+	struct file_sink *sink = to_file_sink(s);
+	unsigned int i;
+
+	if (sink->buffers.nbufs)
+		return -EBUSY;
+
+	if (memtype != V4L2_MEMORY_MMAP && memtype != V4L2_MEMORY_DMABUF)
+		return -EINVAL;
+
+	nbufs = min(nbufs, (unsigned int)VIDEO_MAX_FRAME);
+
+	sink->buffers.buffers = calloc(nbufs, sizeof *sink->buffers.buffers);
+	if (!sink->buffers.buffers)
+		return -ENOMEM;
+
+	sink->buffers.nbufs = nbufs;
+	sink->memtype = memtype;
+
+	for (i = 0; i < nbufs; ++i) {
+		struct video_buffer *buffer = &sink->buffers.buffers[i];
+
+		buffer->index = i;
+		buffer->dmabuf = -1;
+	}
+
+	return 0;
+}
+
+static int file_sink_mmap_buffers(struct video_sink *s,
+				  struct video_buffer_set **buffers)
+{
+	struct file_sink *sink = to_file_sink(s);
+	unsigned int i;
+
+	if (sink->memtype != V4L2_MEMORY_MMAP || !sink->buffers.nbufs)
+		return -EINVAL;
+
+	for (i = 0; i < sink->buffers.nbufs; ++i) {
+		struct video_buffer *buffer = &sink->buffers.buffers[i];
+
+		if (buffer->mem)
+			continue;
+
+		buffer->size = sink->format.sizeimage;
+		buffer->mem = malloc(buffer->size);
+		if (!buffer->mem)
+			return -ENOMEM;
+	}
+
+	*buffers = &sink->buffers;
+	return 0;
+}
+
+static int file_sink_import_buffers(struct video_sink *s,
+				    const struct video_buffer_set *buffers)
+{
+	struct file_sink *sink = to_file_sink(s);
+	unsigned int i;
+
+	if (sink->memtype != V4L2_MEMORY_DMABUF ||
+	    sink->buffers.nbufs > buffers->nbufs)
+		return -EINVAL;
+
+	for (i = 0; i < sink->buffers.nbufs; ++i) {
+		const struct video_buffer *src = &buffers->buffers[i];
+		struct video_buffer *buffer = &sink->buffers.buffers[i];
+
+		buffer->size = src->size;
+		buffer->dmabuf = dup(src->dmabuf);
+		if (buffer->dmabuf < 0)
+			return -errno;
+
+		/* Only the file sink needs to access the frame data. */
+		if (sink->fd < 0)
+			continue;
+
+		buffer->mem = mmap(NULL, buffer->size, PROT_READ, MAP_SHARED,
+				   buffer->dmabuf, 0);
+		if (buffer->mem == MAP_FAILED) {
+			buffer->mem = NULL;
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+static int file_sink_stream_on(struct video_sink *s)
+{
+	struct file_sink *sink = to_file_sink(s);
+
+	sink->start = file_sink_now();
+	sink->done = sink->start;
+	sink->frames = 0;
+	sink->bytes = 0;
+	sink->streaming = true;
+
+	events_watch_fd(sink->sink.events, sink->timer, EVENT_READ,
+			file_sink_process, sink);
+
+	if (sink->queue_count)
+		file_sink_schedule(sink);
+
+	return 0;
+}
+
+static int file_sink_stream_off(struct video_sink *s)
+{
+	struct file_sink *sink = to_file_sink(s);
+	struct itimerspec its = { 0 };
+	uint64_t duration;
+
+	if (!sink->streaming)
+		return 0;
+
+	events_unwatch_fd(sink->sink.events, sink->timer, EVENT_READ);
+	timerfd_settime(sink->timer, 0, &its, NULL);
+
+	sink->streaming = false;
+	sink->queue_count = 0;
+
+	duration = file_sink_now() - sink->start;
+	log_info("%s: %" PRIu64 " frames, %" PRIu64 " bytes in %" PRIu64
+		 " ms (%.3f fps)\n", sink->path ? sink->path : "null sink",
+		 sink->frames, sink->bytes, duration / 1000000,
+		 duration ? sink->frames * 1e9 / duration : 0.0);
+
+	return 0;
+}
+
+static int file_sink_queue_buffer(struct video_sink *s,
+				  struct video_buffer *buf)
+{
+	struct file_sink *sink = to_file_sink(s);
+	struct file_sink_entry *entry;
+
+	if (buf->index >= sink->buffers.nbufs)
+		return -EINVAL;
+
+	if (sink->queue_count == VIDEO_MAX_FRAME)
+		return -EBUSY;
+
+	entry = &sink->queue[(sink->queue_first + sink->queue_count) %
+			     VIDEO_MAX_FRAME];
+	entry->buf = *buf;
+	entry->buf.mem = sink->buffers.buffers[buf->index].mem;
+	entry->buf.size = sink->buffers.buffers[buf->index].size;
+	entry->queued = file_sink_now();
+
+	if (!sink->queue_count++ && sink->streaming)
+		file_sink_schedule(sink);
+
+	return 0;
+}
+
+static const struct video_sink_ops file_sink_ops = {
+	.destroy = file_sink_destroy,
+	.set_format = file_sink_set_format,
+	.alloc_buffers = file_sink_alloc_buffers,
+	.mmap_buffers = file_sink_mmap_buffers,
+	.import_buffers = file_sink_import_buffers,
+	.free_buffers = file_sink_free_buffers,
+	.stream_on = file_sink_stream_on,
+	.stream_off = file_sink_stream_off,
+	.queue_buffer = file_sink_queue_buffer,
+};
+
+static struct file_sink *file_sink_create(uint64_t rate)
+{
+	struct file_sink *sink;
+
+	sink = malloc(sizeof *sink);
+	if (!sink)
+		return NULL;
+
+	memset(sink, 0, sizeof *sink);
+	sink->sink.ops = &file_sink_ops;
+	sink->fd = -1;
+	sink->rate = rate;
+
+	sink->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (sink->timer < 0) {
+		log_error("Failed to create sink timer: %s (%d)\n",
+			  strerror(errno), errno);
+		free(sink);
+		return NULL;
+	}
+
+	return sink;
+}
+
+struct video_sink *null_video_sink_create(uint64_t rate)
+{
+	struct file_sink *sink;
+
+	sink = file_sink_create(rate);
+	if (!sink)
+		return NULL;
+
+	return &sink->sink;
+}
+
+struct video_sink *file_video_sink_create(const char *path, uint64_t rate)
+{
+	struct file_sink *sink;
+
+	sink = file_sink_create(rate);
+	if (!sink)
+		return NULL;
+
+	sink->path = strdup(path);
+	if (!sink->path)
+		goto error;
+
+	sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (sink->fd < 0) {
+		log_error("Unable to open %s: %s (%d)\n", path, strerror(errno),
+			  errno);
+		goto error;
+	}
+
+	return &sink->sink;
+
+error:
+	file_sink_destroy(&sink->sink);
+	return NULL;
+}
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Lock-free latency histograms
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "tools.h"
+
+/*
+ * Values below 2 * HISTOGRAM_SUB_BUCKETS are stored with a precision of 1.
+ * Larger values are shifted right until they fit in HISTOGRAM_SUB_BITS + 1
+ * bits, the shift selects the range and the remaining bits the sub-bucket.
+ */
+static unsigned int histogram_index(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value > HISTOGRAM_MAX_VALUE)
+		value = HISTOGRAM_MAX_VALUE;
+
+	if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+		return value;
+
+	shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+
+	return shift * HISTOGRAM_SUB_BUCKETS + (value >> shift);
+}
+
+/* Return the largest value stored in bucket @index. */
+static uint64_t histogram_bucket_value(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < 2 * HISTOGRAM_SUB_BUCKETS)
+		return index;
+
+	shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+
+	return ((uint64_t)(index - shift * HISTOGRAM_SUB_BUCKETS) << shift)
+	       + (1ULL << shift) - 1;
+}
+
+void histogram_record(struct histogram *hist, uint64_t value)
+{
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&hist->counts[histogram_index(value)], 1,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+
+	while (value > max &&
+	       !__atomic_compare_exchange_n(&hist->max, &max, value, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void histogram_snapshot(const struct histogram *hist, struct histogram *snap)
+{
+	unsigned int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; ++i)
+		snap->counts[i] = __atomic_load_n(&hist->counts[i],
+						  __ATOMIC_RELAXED);
+
+	snap->count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	snap->sum = __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+	snap->max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+}
+
+void histogram_reset(struct histogram *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+}
+
+uint64_t histogram_percentile(const struct histogram *hist, double percentile)
+{
+	uint64_t total = 0;
+	uint64_t target;
+	unsigned int i;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; ++i)
+		total += hist->counts[i];
+
+	if (!total)
+		return 0;
+
+	target = total * percentile / 100.0 + 0.5;
+	if (!target)
+		target = 1;
+
+	for (i = 0, total = 0; i < HISTOGRAM_BUCKETS; ++i) {
+		total += hist->counts[i];
+		if (total >= target)
+			break;
+	}
+
+	if (i == HISTOGRAM_BUCKETS)
+		return hist->max;
+
+	return min_t(uint64_t, histogram_bucket_value(i), hist->max);
+}
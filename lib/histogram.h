@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Lock-free latency histograms
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+
+/*
+ * Values are bucketed in the manner of HdrHistogram: each power of two range is
+ * split in HISTOGRAM_SUB_BUCKETS linear sub-buckets, giving a relative error
+ * below 1 / HISTOGRAM_SUB_BUCKETS (about 3%) over the whole range, from 1 ns to
+ * HISTOGRAM_MAX_VALUE (about 18 minutes). Larger values are counted in the last
+ * bucket.
+ */
+#define HISTOGRAM_SUB_BITS	5
+#define HISTOGRAM_SUB_BUCKETS	(1U << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS	40
+#define HISTOGRAM_MAX_VALUE	((1ULL << HISTOGRAM_MAX_BITS) - 1)
+#define HISTOGRAM_BUCKETS	((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * \
+				 HISTOGRAM_SUB_BUCKETS)
+
+/*
+ * struct histogram - Histogram of durations
+ * @counts: number of values recorded in each bucket
+ * @count: total number of values
+ * @sum: sum of all values, in ns
+ * @max: largest value recorded, in ns
+ *
+ * Values can be recorded from any thread without locking, all fields are
+ * updated with relaxed atomic operations. Readers take a snapshot with
+ * histogram_snapshot(), which is consistent for each field but not across
+ * fields if values are recorded concurrently.
+ */
+struct histogram {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+void histogram_record(struct histogram *hist, uint64_t value);
+void histogram_snapshot(const struct histogram *hist, struct histogram *snap);
+void histogram_reset(struct histogram *hist);
+
+/*
+ * histogram_percentile - Compute a percentile of a histogram snapshot
+ * @hist: the snapshot
+ * @percentile: the percentile, between 0 and 100
+ *
+ * Return the highest value equivalent to the bucket containing the requested
+ * percentile, capped to the maximum recorded value, or 0 if the histogram is
+ * empty.
+ */
+uint64_t histogram_percentile(const struct histogram *hist, double percentile);
+
+#endif /* __HISTOGRAM_H__ */
@@ -0,0 +1,565 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * UVC host emulator
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usb/g_uvc.h>
+#include <linux/videodev2.h>
+
+#include "events.h"
+#include "host-emulator.h"
+#include "tools.h"
+#include "uvc.h"
+#include "video-buffers.h"
+#include "video-sink.h"
+
+#define UVC_HOST_MAX_EVENTS	16
+
+/*
+ * struct uvc_host_samples - Growable array of latency samples
+ * @values: Samples in nanoseconds
+ * @count: Number of samples
+ * @size: Allocated size of @values
+ */
+struct uvc_host_samples {
+	uint64_t *values;
+	unsigned int count;
+	unsigned int size;
+};
+
+struct uvc_host_emulator {
+	struct events *events;
+
+	/*
+	 * Events are queued by the emulator and dequeued by the UVC device
+	 * through the transport. The eventfd counts the pending events.
+	 */
+	struct uvc_transport transport;
+	struct v4l2_event queue[UVC_HOST_MAX_EVENTS];
+	unsigned int queue_first;
+	unsigned int queue_count;
+
+	/* The emulator sink wraps the sink provided by the user. */
+	struct video_sink sink;
+	struct video_sink *inner;
+
+	const struct uvc_host_step *steps;
+	unsigned int num_steps;
+	unsigned int current;
+	uint64_t step_start;
+	unsigned int step_frames;
+	bool running;
+
+	int watchdog;
+	unsigned int timeout;
+
+	uvc_host_response_handler_t response_handler;
+	void *response_data;
+	uvc_host_done_handler_t done;
+	void *done_data;
+
+	struct uvc_request_data last_response;
+
+	struct uvc_host_samples control;
+	struct uvc_host_samples stream_on;
+	struct uvc_host_samples stream_off;
+	unsigned int frames;
+	unsigned int stalls;
+	unsigned int timeouts;
+};
+
+#define to_host_emulator(s) container_of(s, struct uvc_host_emulator, sink)
+#define transport_to_host_emulator(t) \
+	container_of(t, struct uvc_host_emulator, transport)
+
+static uint64_t uvc_host_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void uvc_host_add_sample(struct uvc_host_samples *samples,
+				uint64_t value)
+{
+	if (samples->count == samples->size) {
+		unsigned int size = samples->size ? samples->size * 2 : 256;
+		uint64_t *values;
+
+		values = realloc(samples->values, size * sizeof(*values));
+		if (!values)
+			return;
+
+		samples->values = values;
+		samples->size = size;
+	}
+
+	samples->values[samples->count++] = value;
+}
+
+static int uvc_host_compare(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *)a;
+	uint64_t vb = *(const uint64_t *)b;
+
+	return va < vb ? -1 : va > vb;
+}
+
+static void uvc_host_compute_latency(struct uvc_host_samples *samples,
+				     struct uvc_host_latency *latency)
+{
+	unsigned int count = samples->count;
+
+	memset(latency, 0, sizeof(*latency));
+	if (!count)
+		return;
+
+	qsort(samples->values, count, sizeof(*samples->values),
+	      uvc_host_compare);
+
+	latency->count = count;
+	latency->min = samples->values[0];
+	latency->p50 = samples->values[(count - 1) * 50 / 100];
+	latency->p99 = samples->values[(count - 1) * 99 / 100];
+	latency->max = samples->values[count - 1];
+}
+
+/* -----------------------------------------------------------------------------
+ * Event transport
+ */
+
+static int uvc_host_queue_event(struct uvc_host_emulator *host,
+				unsigned int type, const void *data,
+				size_t size)
+{
+	struct v4l2_event *event;
+	uint64_t one = 1;
+
+	if (host->queue_count == UVC_HOST_MAX_EVENTS)
+		return -ENOSPC;
+
+	event = &host->queue[(host->queue_first + host->queue_count) %
+			     UVC_HOST_MAX_EVENTS];
+	memset(event, 0, sizeof(*event));
+	event->type = type;
+	if (data)
+		memcpy(&event->u.data, data, size);
+
+	host->queue_count++;
+
+	if (write(host->transport.fd, &one, sizeof(one)) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int uvc_host_dequeue_event(struct uvc_transport *transport,
+				  struct v4l2_event *event)
+{
+	struct uvc_host_emulator *host = transport_to_host_emulator(transport);
+	uint64_t count;
+
+	if (read(transport->fd, &count, sizeof(count)) < 0)
+		return -errno;
+
+	if (!host->queue_count)
+		return -EAGAIN;
+
+	*event = host->queue[host->queue_first];
+	host->queue_first = (host->queue_first + 1) % UVC_HOST_MAX_EVENTS;
+	host->queue_count--;
+
+	return 0;
+}
+
+static void uvc_host_complete_step(struct uvc_host_emulator *host);
+
+static int uvc_host_send_response(struct uvc_transport *transport,
+				  struct uvc_request_data *resp)
+{
+	struct uvc_host_emulator *host = transport_to_host_emulator(transport);
+	const struct uvc_host_step *step;
+
+	if (!host->running)
+		return 0;
+
+	step = &host->steps[host->current];
+	if (step->type != UVC_HOST_STEP_CONTROL)
+		return 0;
+
+	uvc_host_add_sample(&host->control, uvc_host_now() - host->step_start);
+
+	if (resp->length < 0) {
+		host->stalls++;
+	} else if (step->req.bRequestType & USB_DIR_IN) {
+		host->last_response = *resp;
+	} else {
+		struct uvc_request_data data;
+
+		/* Host-to-device request, send the data stage. */
+		memset(&data, 0, sizeof(data));
+		data.length = min_t(unsigned int, step->req.wLength,
+				    sizeof(data.data));
+		if (step->flags & UVC_HOST_STEP_DATA_FROM_RESPONSE)
+			memcpy(data.data, host->last_response.data,
+			       sizeof(data.data));
+		else
+			memcpy(data.data, step->data, sizeof(data.data));
+
+		uvc_host_queue_event(host, UVC_EVENT_DATA, &data, sizeof(data));
+	}
+
+	if (host->response_handler)
+		host->response_handler(host->response_data, step, resp);
+
+	uvc_host_complete_step(host);
+	return 0;
+}
+
+static const struct uvc_transport_ops uvc_host_transport_ops = {
+	.dequeue_event = uvc_host_dequeue_event,
+	.send_response = uvc_host_send_response,
+};
+
+struct uvc_transport *uvc_host_emulator_transport(struct uvc_host_emulator *host)
+{
+	return &host->transport;
+}
+
+/* -----------------------------------------------------------------------------
+ * Script execution
+ */
+
+static void uvc_host_finish(struct uvc_host_emulator *host, int status)
+{
+	struct itimerspec its = { 0 };
+
+	timerfd_settime(host->watchdog, 0, &its, NULL);
+	host->running = false;
+
+	if (host->done)
+		host->done(host->done_data, status);
+}
+
+/*
+ * Start the current step. Returns true if the step completes immediately,
+ * false if it waits for a response, a frame or the sink to stop.
+ */
+static bool uvc_host_start_step(struct uvc_host_emulator *host)
+{
+	const struct uvc_host_step *step = &host->steps[host->current];
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = host->timeout / 1000,
+			.tv_nsec = (host->timeout % 1000) * 1000000,
+		},
+	};
+
+	host->step_start = uvc_host_now();
+	host->step_frames = 0;
+
+	timerfd_settime(host->watchdog, 0, &its, NULL);
+
+	switch (step->type) {
+	case UVC_HOST_STEP_CONNECT:
+		uvc_host_queue_event(host, UVC_EVENT_CONNECT, &step->speed,
+				     sizeof(step->speed));
+		return true;
+
+	case UVC_HOST_STEP_CONTROL:
+		uvc_host_queue_event(host, UVC_EVENT_SETUP, &step->req,
+				     sizeof(step->req));
+		return false;
+
+	case UVC_HOST_STEP_STREAM_ON:
+		uvc_host_queue_event(host, UVC_EVENT_STREAMON, NULL, 0);
+		return false;
+
+	case UVC_HOST_STEP_STREAM_OFF:
+		uvc_host_queue_event(host, UVC_EVENT_STREAMOFF, NULL, 0);
+		return false;
+
+	case UVC_HOST_STEP_WAIT_FRAMES:
+		return !step->frames;
+	}
+
+	return true;
+}
+
+/*
+ * Move to the next step. This is called from the event handlers of the UVC
+ * device and sink, the steps only queue events and never call back into them.
+ */
+static void uvc_host_complete_step(struct uvc_host_emulator *host)
+{
+	do {
+		if (++host->current == host->num_steps) {
+			uvc_host_finish(host, 0);
+			return;
+		}
+	} while (uvc_host_start_step(host));
+}
+
+static void uvc_host_watchdog(void *d)
+{
+	struct uvc_host_emulator *host = d;
+	uint64_t expirations;
+
+	if (read(host->watchdog, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	if (!host->running)
+		return;
+
+	printf("host emulator: step %u timed out\n", host->current);
+	host->timeouts++;
+	uvc_host_finish(host, -ETIMEDOUT);
+}
+
+int uvc_host_emulator_run(struct uvc_host_emulator *host,
+			  const struct uvc_host_step *steps, unsigned int count,
+			  unsigned int timeout, uvc_host_done_handler_t done,
+			  void *data)
+{
+	if (host->running)
+		return -EBUSY;
+
+	if (!count)
+		return -EINVAL;
+
+	host->steps = steps;
+	host->num_steps = count;
+	host->current = 0;
+	host->timeout = timeout;
+	host->done = done;
+	host->done_data = data;
+	host->running = true;
+
+	if (uvc_host_start_step(host))
+		uvc_host_complete_step(host);
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Sink
+ */
+
+static void uvc_host_sink_process(void *d,
+				  struct video_sink *sink __attribute__((unused)),
+				  struct video_buffer *buf)
+{
+	struct uvc_host_emulator *host = d;
+	const struct uvc_host_step *step;
+
+	host->frames++;
+	host->step_frames++;
+
+	host->sink.handler(host->sink.handler_data, &host->sink, buf);
+
+	if (!host->running)
+		return;
+
+	step = &host->steps[host->current];
+
+	if (step->type == UVC_HOST_STEP_STREAM_ON && host->step_frames == 1) {
+		uvc_host_add_sample(&host->stream_on,
+				    uvc_host_now() - host->step_start);
+		uvc_host_complete_step(host);
+	} else if (step->type == UVC_HOST_STEP_WAIT_FRAMES &&
+		   host->step_frames == step->frames) {
+		uvc_host_complete_step(host);
+	}
+}
+
+static void uvc_host_sink_destroy(struct video_sink *s __attribute__((unused)))
+{
+	/* The sink is embedded in the emulator, and freed with it. */
+}
+
+static int uvc_host_sink_set_format(struct video_sink *s,
+				    struct v4l2_pix_format *fmt)
+{
+	struct uvc_host_emulator *host = to_host_emulator(s);
+
+	return video_sink_set_format(host->inner, fmt);
+}
+
+static int uvc_host_sink_alloc_buffers(struct video_sink *s,
+				       enum v4l2_memory memtype,
+				       unsigned int nbufs)
+{
+	struct uvc_host_emulator *host = to_host_emulator(s);
+
+	return video_sink_alloc_buffers(host->inner, memtype, nbufs);
+}
+
+static int uvc_host_sink_mmap_buffers(struct video_sink *s,
+				      struct video_buffer_set **buffers)
+{
+	struct uvc_host_emulator *host = to_host_emulator(s);
+
+	return video_sink_mmap_buffers(host->inner, buffers);
+}
+
+static int uvc_host_sink_import_buffers(struct video_sink *s,
+					const struct video_buffer_set *buffers)
+{
+	struct uvc_host_emulator *host = to_host_emulator(s);
+
+	return video_sink_import_buffers(host->inner, buffers);
+}
+
+static int uvc_host_sink_free_buffers(struct video_sink *s)
+{
+	struct uvc_host_emulator *host = to_host_emulator(s);
+
+	return video_sink_free_buffers(host->inner);
+}
+
+static int uvc_host_sink_stream_on(struct video_sink *s)
+{
+	struct uvc_host_emulator *host = to_host_emulator(s);
+
+	video_sink_set_buffer_handler(host->inner, uvc_host_sink_process, host);
+
+	return video_sink_stream_on(host->inner);
+}
+
+static int uvc_host_sink_stream_off(struct video_sink *s)
+{
+	struct uvc_host_emulator *host = to_host_emulator(s);
+	int ret;
+
+	ret = video_sink_stream_off(host->inner);
+
+	if (host->running &&
+	    host->steps[host->current].type == UVC_HOST_STEP_STREAM_OFF) {
+		uvc_host_add_sample(&host->stream_off,
+				    uvc_host_now() - host->step_start);
+		uvc_host_complete_step(host);
+	}
+
+	return ret;
+}
+
+static int uvc_host_sink_queue_buffer(struct video_sink *s,
+				      struct video_buffer *buf)
+{
+	struct uvc_host_emulator *host = to_host_emulator(s);
+
+	return video_sink_queue_buffer(host->inner, buf);
+}
+
+static const struct video_sink_ops uvc_host_sink_ops = {
+	.destroy = uvc_host_sink_destroy,
+	.set_format = uvc_host_sink_set_format,
+	.alloc_buffers = uvc_host_sink_alloc_buffers,
+	.mmap_buffers = uvc_host_sink_mmap_buffers,
+	.import_buffers = uvc_host_sink_import_buffers,
+	.free_buffers = uvc_host_sink_free_buffers,
+	.stream_on = uvc_host_sink_stream_on,
+	.stream_off = uvc_host_sink_stream_off,
+	.queue_buffer = uvc_host_sink_queue_buffer,
+};
+
+struct video_sink *uvc_host_emulator_sink(struct uvc_host_emulator *host)
+{
+	return &host->sink;
+}
+
+/* -----------------------------------------------------------------------------
+ * Creation and statistics
+ */
+
+struct uvc_host_emulator *uvc_host_emulator_new(struct events *events,
+						struct video_sink *sink)
+{
+	struct uvc_host_emulator *host;
+
+	host = malloc(sizeof(*host));
+	if (!host)
+		return NULL;
+
+	memset(host, 0, sizeof(*host));
+	host->events = events;
+	host->inner = sink;
+
+	host->sink.ops = &uvc_host_sink_ops;
+	video_sink_init(&host->sink, events);
+
+	host->transport.ops = &uvc_host_transport_ops;
+	host->transport.fd_event = EVENT_READ;
+	host->transport.fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK |
+					EFD_CLOEXEC);
+	if (host->transport.fd < 0)
+		goto error;
+
+	host->watchdog = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+	if (host->watchdog < 0)
+		goto error;
+
+	events_watch_fd(events, host->watchdog, EVENT_READ, uvc_host_watchdog,
+			host);
+
+	return host;
+
+error:
+	printf("host emulator: unable to create file descriptors: %s (%d)\n",
+	       strerror(errno), errno);
+	if (host->transport.fd >= 0)
+		close(host->transport.fd);
+	free(host);
+	return NULL;
+}
+
+void uvc_host_emulator_delete(struct uvc_host_emulator *host)
+{
+	if (!host)
+		return;
+
+	events_unwatch_fd(host->events, host->watchdog, EVENT_READ);
+	close(host->watchdog);
+	close(host->transport.fd);
+
+	free(host->control.values);
+	free(host->stream_on.values);
+	free(host->stream_off.values);
+	free(host);
+}
+
+void uvc_host_emulator_set_response_handler(struct uvc_host_emulator *host,
+					    uvc_host_response_handler_t handler,
+					    void *data)
+{
+	host->response_handler = handler;
+	host->response_data = data;
+}
+
+void uvc_host_emulator_get_stats(struct uvc_host_emulator *host,
+				 struct uvc_host_stats *stats)
+{
+	uvc_host_compute_latency(&host->control, &stats->control);
+	uvc_host_compute_latency(&host->stream_on, &stats->stream_on);
+	uvc_host_compute_latency(&host->stream_off, &stats->stream_off);
+
+	stats->frames = host->frames;
+	stats->stalls = host->stalls;
+	stats->timeouts = host->timeouts;
+}
@@ -7,10 +7,14 @@
  * Contact: Paul Elder <paul.elder@ideasonboard.com>
  */
 
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
@@ -20,58 +24,448 @@
 #include <linux/videodev2.h>
 
 #include "events.h"
+#include "log.h"
 #include "timer.h"
 #include "tools.h"
 #include "v4l2.h"
 #include "jpg-source.h"
 #include "video-buffers.h"
 
+UVC_LOG_MODULE(jpg);
+
 struct jpg_source {
 	struct video_source src;
 
+	/* Copy of the image file contents. */
+	char *path;
 	unsigned int imgsize;
 	void *imgdata;
 
+	/*
+	 * The image generation is incremented every time the file is reloaded.
+	 * Sink buffers that already contain the current image are tracked by
+	 * index with the generation they've been filled with, 0 if none.
+	 */
+	unsigned int generation;
+	unsigned int buffer_generation[VIDEO_MAX_FRAME];
+
+	/* inotify watch on the directory containing the image. */
+	int inotify_fd;
+
+	/*
+	 * The image is reloaded by a thread, to keep file I/O off the event
+	 * loop. The thread reads the file into @loaded and signals @efd, the
+	 * event loop then swaps the image in between two frames. The lock
+	 * protects @reload, @stop, @loaded and @loaded_size.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t reload_thread;
+	bool reloading;
+	bool reload;
+	bool stop;
+	void *loaded;
+	unsigned int loaded_size;
+	int efd;
+
+	/* Sink buffers waiting for the next timer expiration, in FIFO order. */
+	struct video_buffer pending[VIDEO_MAX_FRAME];
+	unsigned int pending_first;
+	unsigned int pending_count;
+
 	struct timer *timer;
+	uint64_t missed;
 	bool streaming;
 };
 
 #define to_jpg_source(s) container_of(s, struct jpg_source, src)
 
+static void jpg_source_stop_reload(struct jpg_source *src)
+{
+	if (!src->reloading)
+		return;
+
+	pthread_mutex_lock(&src->lock);
+	src->stop = true;
+	pthread_cond_signal(&src->cond);
+	pthread_mutex_unlock(&src->lock);
+
+	pthread_join(src->reload_thread, NULL);
+	src->reloading = false;
+}
+
 static void jpg_source_destroy(struct video_source *s)
 {
 	struct jpg_source *src = to_jpg_source(s);
 
-	if (src->imgdata)
-		free(src->imgdata);
+	jpg_source_stop_reload(src);
+
+	if (src->inotify_fd >= 0) {
+		if (src->src.events)
+			events_unwatch_fd(src->src.events, src->inotify_fd,
+					  EVENT_READ);
+		close(src->inotify_fd);
+	}
+
+	if (src->efd >= 0) {
+		if (src->src.events)
+			events_unwatch_fd(src->src.events, src->efd, EVENT_READ);
+		close(src->efd);
+	}
+
+	pthread_cond_destroy(&src->cond);
+	pthread_mutex_destroy(&src->lock);
 
 	timer_destroy(src->timer);
 
+	free(src->loaded);
+	free(src->imgdata);
+	free(src->path);
 	free(src);
 }
 
+/*
+ * Read the whole image file into a newly allocated buffer. The file is copied
+ * rather than mapped, as accessing a mapping of a file truncated by a writer
+ * raises SIGBUS. Reading fails if the file can't be read in full, for instance
+ * when it is empty because it is being rewritten.
+ */
+static int jpg_source_read(const char *path, void **image, unsigned int *size)
+{
+	struct stat st;
+	size_t done = 0;
+	void *data;
+	int ret;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		log_error("Unable to open MJPEG image '%s'\n", path);
+		return -errno;
+	}
+
+	ret = fstat(fd, &st);
+	if (ret < 0) {
+		ret = -errno;
+		log_error("error reading data from %s: %d\n", path, errno);
+		goto done;
+	}
+
+	if (!st.st_size) {
+		ret = -ENODATA;
+		goto done;
+	}
+
+	data = malloc(st.st_size);
+	if (!data) {
+		ret = -ENOMEM;
+		log_error("failed to allocate memory for image\n");
+		goto done;
+	}
+
+	/* A short read means the file has been truncated meanwhile. */
+	while (done < (size_t)st.st_size) {
+		ssize_t len = read(fd, data + done, st.st_size - done);
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			ret = len ? -errno : -ENODATA;
+			log_error("error reading data from %s: %d\n", path, -ret);
+			free(data);
+			goto done;
+		}
+
+		done += len;
+	}
+
+	*image = data;
+	*size = st.st_size;
+	ret = 0;
+
+done:
+	close(fd);
+	return ret;
+}
+
+/* Replace the current image, must be called from the event loop. */
+static void jpg_source_set_image(struct jpg_source *src, void *data,
+				 unsigned int size)
+{
+	free(src->imgdata);
+
+	src->imgdata = data;
+	src->imgsize = size;
+
+	/* Skip 0, it marks buffers that have never been filled. */
+	if (!++src->generation)
+		src->generation = 1;
+}
+
+static void *jpg_source_reload_thread(void *arg)
+{
+	static const uint64_t one = 1;
+	struct jpg_source *src = arg;
+
+	pthread_mutex_lock(&src->lock);
+
+	while (!src->stop) {
+		unsigned int size;
+		void *data;
+		int ret;
+
+		if (!src->reload) {
+			pthread_cond_wait(&src->cond, &src->lock);
+			continue;
+		}
+
+		src->reload = false;
+
+		/*
+		 * Read the file without holding the lock. The previous image
+		 * is kept if the file can't be read.
+		 */
+		pthread_mutex_unlock(&src->lock);
+		ret = jpg_source_read(src->path, &data, &size);
+		pthread_mutex_lock(&src->lock);
+
+		if (ret < 0)
+			continue;
+
+		/* Only the latest image matters if the loop hasn't caught up. */
+		free(src->loaded);
+		src->loaded = data;
+		src->loaded_size = size;
+
+		write(src->efd, &one, sizeof(one));
+	}
+
+	pthread_mutex_unlock(&src->lock);
+
+	return NULL;
+}
+
+/*
+ * The reload thread has read a new image. The event loop is single-threaded,
+ * the image is swapped in between two frames.
+ */
+static void jpg_source_reloaded(void *d)
+{
+	struct jpg_source *src = d;
+	unsigned int size;
+	uint64_t count;
+	void *data;
+
+	read(src->efd, &count, sizeof(count));
+
+	pthread_mutex_lock(&src->lock);
+	data = src->loaded;
+	size = src->loaded_size;
+	src->loaded = NULL;
+	pthread_mutex_unlock(&src->lock);
+
+	if (!data)
+		return;
+
+	jpg_source_set_image(src, data, size);
+	log_info("reloaded %s (%u bytes)\n", src->path, src->imgsize);
+}
+
+static void jpg_source_inotify_event(void *d)
+{
+	struct jpg_source *src = d;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const char *name = strrchr(src->path, '/');
+	bool changed = false;
+	ssize_t len;
+	char *ptr;
+
+	name = name ? name + 1 : src->path;
+
+	len = read(src->inotify_fd, buf, sizeof(buf));
+	if (len <= 0)
+		return;
+
+	for (ptr = buf; ptr < buf + len;
+	     ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len) {
+		const struct inotify_event *event = (struct inotify_event *)ptr;
+
+		if (event->len && !strcmp(event->name, name))
+			changed = true;
+	}
+
+	if (!changed)
+		return;
+
+	pthread_mutex_lock(&src->lock);
+	src->reload = true;
+	pthread_cond_signal(&src->cond);
+	pthread_mutex_unlock(&src->lock);
+}
+
+/*
+ * Watch the directory rather than the file, to catch the image being replaced
+ * by a rename, which is the recommended way to update it as it never exposes a
+ * partially written file.
+ */
+static int jpg_source_start_reload(struct jpg_source *src)
+{
+	char *dir, *sep;
+	int ret;
+
+	dir = strdup(src->path);
+	if (!dir)
+		return -ENOMEM;
+
+	sep = strrchr(dir, '/');
+	if (sep == dir)
+		sep[1] = '\0';
+	else if (sep)
+		*sep = '\0';
+
+	src->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (src->inotify_fd < 0 ||
+	    inotify_add_watch(src->inotify_fd, sep ? dir : ".",
+			      IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	src->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (src->efd < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	ret = pthread_create(&src->reload_thread, NULL,
+			     jpg_source_reload_thread, src);
+	if (ret) {
+		ret = -ret;
+		goto error;
+	}
+
+	src->reloading = true;
+	free(dir);
+
+	return 0;
+
+error:
+	if (src->efd >= 0)
+		close(src->efd);
+	if (src->inotify_fd >= 0)
+		close(src->inotify_fd);
+	src->efd = -1;
+	src->inotify_fd = -1;
+	free(dir);
+
+	return ret;
+}
+
 static int jpg_source_set_format(struct video_source *s __attribute__((unused)),
 				  struct v4l2_pix_format *fmt)
 {
 	if (fmt->pixelformat != v4l2_fourcc('M', 'J', 'P', 'G')) {
-		printf("jpg-source: unsupported fourcc\n");
+		log_error("jpg-source: unsupported fourcc\n");
 		return -EINVAL;
 	}
 
 	return 0;
 }
 
-static int jpg_source_set_frame_rate(struct video_source *s, unsigned int fps)
+static int jpg_source_set_frame_rate(struct video_source *s,
+				     unsigned int interval)
 {
 	struct jpg_source *src = to_jpg_source(s);
 
-	timer_set_fps(src->timer, fps);
+	timer_set_interval(src->timer, interval);
 
 	return 0;
 }
 
-static int jpg_source_free_buffers(struct video_source *s __attribute__((unused)))
+static int jpg_source_free_buffers(struct video_source *s)
 {
+	struct jpg_source *src = to_jpg_source(s);
+
+	memset(src->buffer_generation, 0, sizeof(src->buffer_generation));
+
+	return 0;
+}
+
+static void jpg_source_fill_buffer(struct video_source *s,
+				   struct video_buffer *buf)
+{
+	struct jpg_source *src = to_jpg_source(s);
+	unsigned int size;
+
+	/*
+	 * Nothing currently stops the user from providing a source file which is
+	 * larger than the buffer size calculated from the format we have set.
+	 * Clamp the size of the buffer we copy to be sure we don't overflow the
+	 * buffer we was allocated to receive it.
+	 */
+	size = min(src->imgsize, buf->size);
+	buf->bytesused = size;
+
+	/*
+	 * The image only changes when the file is replaced, so the sink
+	 * buffers only need to be filled the first time they're used after a
+	 * reload. They keep their content until they are freed.
+	 */
+	if (buf->index >= VIDEO_MAX_FRAME ||
+	    src->buffer_generation[buf->index] != src->generation) {
+		memcpy(buf->mem, src->imgdata, size);
+		if (buf->index < VIDEO_MAX_FRAME)
+			src->buffer_generation[buf->index] = src->generation;
+	}
+}
+
+/*
+ * Fill and hand over one pending buffer per timer expiration, so that the
+ * configured frame rate is adhered to without blocking the event loop. If
+ * expirations have been missed, the corresponding frames are skipped instead of
+ * being sent late.
+ */
+static void jpg_source_timer_expired(void *d)
+{
+	struct jpg_source *src = d;
+	struct video_buffer *buf;
+	uint64_t expirations;
+
+	expirations = timer_expirations(src->timer);
+	if (!expirations)
+		return;
+
+	if (expirations > 1) {
+		src->missed += expirations - 1;
+		log_warning_ratelimited("jpg-source: missed %" PRIu64
+					" frame(s), %" PRIu64 " in total\n",
+					expirations - 1, src->missed);
+	}
+
+	if (!src->pending_count)
+		return;
+
+	buf = &src->pending[src->pending_first];
+	src->pending_first = (src->pending_first + 1) % VIDEO_MAX_FRAME;
+	src->pending_count--;
+
+	jpg_source_fill_buffer(&src->src, buf);
+	src->src.handler(src->src.handler_data, &src->src, buf);
+}
+
+static int jpg_source_queue_buffer(struct video_source *s,
+				   struct video_buffer *buf)
+{
+	struct jpg_source *src = to_jpg_source(s);
+	unsigned int index;
+
+	if (src->pending_count == VIDEO_MAX_FRAME)
+		return -EBUSY;
+
+	index = (src->pending_first + src->pending_count) % VIDEO_MAX_FRAME;
+	src->pending[index] = *buf;
+	src->pending_count++;
+
 	return 0;
 }
 
@@ -80,10 +474,16 @@ static int jpg_source_stream_on(struct video_source *s)
 	struct jpg_source *src = to_jpg_source(s);
 	int ret;
 
+	src->pending_first = 0;
+	src->pending_count = 0;
+
 	ret = timer_arm(src->timer);
 	if (ret)
 		return ret;
 
+	events_watch_fd(src->src.events, timer_fd(src->timer), EVENT_READ,
+			jpg_source_timer_expired, src);
+
 	src->streaming = true;
 	return 0;
 }
@@ -97,34 +497,21 @@ static int jpg_source_stream_off(struct video_source *s)
 	 * No error check here, because we want to flag that streaming is over
 	 * even if the timer is still running due to the failure.
 	 */
+	events_unwatch_fd(src->src.events, timer_fd(src->timer), EVENT_READ);
 	ret = timer_disarm(src->timer);
 	src->streaming = false;
+	src->pending_count = 0;
 
 	return ret;
 }
 
-static void jpg_source_fill_buffer(struct video_source *s,
-				   struct video_buffer *buf)
+static void jpg_source_get_stats(struct video_source *s,
+				 struct video_source_stats *stats)
 {
 	struct jpg_source *src = to_jpg_source(s);
-	unsigned int size;
-
-	/*
-	 * Nothing currently stops the user from providing a source file which is
-	 * larger than the buffer size calculated from the format we have set.
-	 * Clamp the size of the buffer we copy to be sure we don't overflow the
-	 * buffer we was allocated to receive it.
-	 */
-	size = min(src->imgsize, buf->size);
-	memcpy(buf->mem, src->imgdata, size);
-	buf->bytesused = size;
 
-	/*
-	 * Wait for the timer to elapse to ensure that our configured frame rate
-	 * is adhered to.
-	 */
-	if (src->streaming)
-		timer_wait(src->timer);
+	stats->queued = src->pending_count;
+	stats->dropped = src->missed;
 }
 
 static const struct video_source_ops jpg_source_ops = {
@@ -136,17 +523,19 @@ static const struct video_source_ops jpg_source_ops = {
 	.free_buffers = jpg_source_free_buffers,
 	.stream_on = jpg_source_stream_on,
 	.stream_off = jpg_source_stream_off,
-	.queue_buffer = NULL,
+	.queue_buffer = jpg_source_queue_buffer,
 	.fill_buffer = jpg_source_fill_buffer,
+	.get_stats = jpg_source_get_stats,
 };
 
 struct video_source *jpg_video_source_create(const char *img_path)
 {
 	struct jpg_source *src;
-	int fd = -1;
+	unsigned int size;
+	void *data;
 	int ret;
 
-	printf("using jpg video source\n");
+	log_info("using jpg video source\n");
 
 	if (img_path == NULL)
 		return NULL;
@@ -158,40 +547,37 @@ struct video_source *jpg_video_source_create(const char *img_path)
 	memset(src, 0, sizeof *src);
 	src->src.ops = &jpg_source_ops;
 	src->src.type = VIDEO_SOURCE_STATIC;
+	src->inotify_fd = -1;
+	src->efd = -1;
 
-	fd = open(img_path, O_RDONLY);
-	if (fd == -1) {
-		printf("Unable to open MJPEG image '%s'\n", img_path);
+	src->path = strdup(img_path);
+	if (!src->path)
 		goto err_free_src;
-	}
 
-	src->imgsize = lseek(fd, 0, SEEK_END);
-	lseek(fd, 0, SEEK_SET);
-	src->imgdata = malloc(src->imgsize);
-	if (src->imgdata == NULL) {
-		printf("Unable to allocate memory for MJPEG image\n");
-		goto err_close_fd;
-	}
+	if (jpg_source_read(src->path, &data, &size) < 0)
+		goto err_free_src;
 
-	ret = read(fd, src->imgdata, src->imgsize);
-	if (ret < 0) {
-		fprintf(stderr, "error reading data from %s: %d\n", img_path, errno);
-		goto err_free_imgdata;
-	}
+	jpg_source_set_image(src, data, size);
 
 	src->timer = timer_new();
 	if (!src->timer)
-		goto err_free_imgdata;
+		goto err_free_image;
 
-	close(fd);
+	pthread_mutex_init(&src->lock, NULL);
+	pthread_cond_init(&src->cond, NULL);
+
+	/* Failing to watch the image only disables reloading. */
+	ret = jpg_source_start_reload(src);
+	if (ret < 0)
+		log_warning("Unable to watch %s, reloading disabled: %s (%d)\n",
+			    img_path, strerror(-ret), -ret);
 
 	return &src->src;
 
-err_free_imgdata:
+err_free_image:
 	free(src->imgdata);
-err_close_fd:
-	close(fd);
 err_free_src:
+	free(src->path);
 	free(src);
 
 	return NULL;
@@ -202,4 +588,12 @@ void jpg_video_source_init(struct video_source *s, struct events *events)
 	struct jpg_source *src = to_jpg_source(s);
 
 	src->src.events = events;
+
+	if (src->inotify_fd >= 0)
+		events_watch_fd(events, src->inotify_fd, EVENT_READ,
+				jpg_source_inotify_event, src);
+
+	if (src->efd >= 0)
+		events_watch_fd(events, src->efd, EVENT_READ,
+				jpg_source_reloaded, src);
 }
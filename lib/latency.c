@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Per-stage frame latency
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+
+#include <stdlib.h>
+
+#include "latency.h"
+
+/*
+ * Record the stamps of a frame. Stages the frame hasn't been through, for
+ * instance the encoder stages for uncompressed formats, are skipped and the
+ * time is accounted to the next stage. Stamps that go backwards, which can
+ * happen with sensor time stamps taken from a different clock, are ignored.
+ */
+void frame_latency_record(struct frame_latency *latency,
+			  const uint64_t stamps[VIDEO_BUFFER_NUM_STAGES])
+{
+	uint64_t first = 0;
+	uint64_t prev = 0;
+	unsigned int i;
+
+	for (i = 0; i < VIDEO_BUFFER_NUM_STAGES; ++i) {
+		if (!stamps[i] || stamps[i] < prev)
+			continue;
+
+		if (prev)
+			histogram_record(&latency->stages[i], stamps[i] - prev);
+		else
+			first = stamps[i];
+
+		prev = stamps[i];
+	}
+
+	if (prev > first)
+		histogram_record(&latency->total, prev - first);
+}
+
+void frame_latency_reset(struct frame_latency *latency)
+{
+	unsigned int i;
+
+	for (i = 0; i < VIDEO_BUFFER_NUM_STAGES; ++i)
+		histogram_reset(&latency->stages[i]);
+
+	histogram_reset(&latency->total);
+}
+
+static void frame_latency_print(FILE *stream, const char *name,
+				const struct histogram *hist)
+{
+	struct histogram *snap;
+
+	snap = malloc(sizeof(*snap));
+	if (!snap)
+		return;
+
+	histogram_snapshot(hist, snap);
+	if (snap->count)
+		fprintf(stream, "  %-14s %10llu %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+			name, (unsigned long long)snap->count,
+			snap->sum / 1e6 / snap->count,
+			histogram_percentile(snap, 50) / 1e6,
+			histogram_percentile(snap, 90) / 1e6,
+			histogram_percentile(snap, 99) / 1e6,
+			histogram_percentile(snap, 99.9) / 1e6,
+			snap->max / 1e6);
+
+	free(snap);
+}
+
+/*
+ * Print the histograms as a table, one line per stage the frames went
+ * through, with the time spent reaching the stage from the previous one.
+ */
+void frame_latency_dump(const struct frame_latency *latency, FILE *stream)
+{
+	unsigned int i;
+
+	fprintf(stream, "Frame latency (ms):\n");
+	fprintf(stream, "  %-14s %10s %9s %9s %9s %9s %9s %9s\n", "stage",
+		"frames", "mean", "p50", "p90", "p99", "p99.9", "max");
+
+	for (i = VIDEO_BUFFER_STAGE_CAPTURE + 1; i < VIDEO_BUFFER_NUM_STAGES; ++i)
+		frame_latency_print(stream, video_buffer_stage_name(i),
+				    &latency->stages[i]);
+
+	frame_latency_print(stream, "total", &latency->total);
+	fflush(stream);
+}
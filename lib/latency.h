@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Per-stage frame latency
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "histogram.h"
+#include "video-buffers.h"
+
+/*
+ * struct frame_latency - Latency histograms of the pipeline stages
+ * @stages: time spent reaching each stage from the previous stage the frame
+ *	went through, indexed by enum video_buffer_stage. The capture stage
+ *	histogram is unused.
+ * @total: time from the first to the last stage the frame went through
+ */
+struct frame_latency {
+	struct histogram stages[VIDEO_BUFFER_NUM_STAGES];
+	struct histogram total;
+};
+
+void frame_latency_record(struct frame_latency *latency,
+			  const uint64_t stamps[VIDEO_BUFFER_NUM_STAGES]);
+void frame_latency_reset(struct frame_latency *latency);
+void frame_latency_dump(const struct frame_latency *latency, FILE *stream);
+
+#endif /* __LATENCY_H__ */
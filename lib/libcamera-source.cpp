@@ -7,16 +7,17 @@
  * Contact: Daniel Scally <dan.scally@ideasonboard.com>
  */
 
+#include <array>
+#include <atomic>
 #include <errno.h>
-#include <fcntl.h>
-#include <iostream>
+#include <inttypes.h>
 #include <memory.h>
-#include <queue>
 #include <stdlib.h>
 #include <string>
 #include <string.h>
 #include <unistd.h>
 #include <map>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 
 #include <libcamera/libcamera.h>
@@ -28,6 +29,7 @@
 extern "C" {
 #include "events.h"
 #include "libcamera-source.h"
+#include "log.h"
 #include "tools.h"
 #include "video-buffers.h"
 }
@@ -35,8 +37,111 @@ extern "C" {
 using namespace libcamera;
 using namespace std::placeholders;
 
+UVC_LOG_MODULE(libcamera);
+
 #define to_libcamera_source(s) container_of(s, struct libcamera_source, src)
 
+/*
+ * Lock-free bounded multi-producer single-consumer ring. Completions are pushed
+ * from libcamera's thread and from the MJPEG encoder output thread, and popped
+ * from the event loop thread. Each cell carries a sequence number telling
+ * whether it is free for the producer claiming position pos (seq == pos) or
+ * holds an item for the consumer (seq == pos + 1). The capacity must be a
+ * power of two and larger than the number of completions in flight.
+ */
+template<typename T, size_t N>
+class CompletionRing
+{
+public:
+	CompletionRing()
+	{
+		for (size_t i = 0; i < N; i++)
+			cells_[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+	bool push(const T &item)
+	{
+		size_t pos = head_.load(std::memory_order_relaxed);
+		Cell *cell;
+
+		while (true) {
+			cell = &cells_[pos % N];
+			size_t seq = cell->seq.load(std::memory_order_acquire);
+			ssize_t diff = static_cast<ssize_t>(seq - pos);
+
+			if (diff == 0) {
+				if (head_.compare_exchange_weak(pos, pos + 1,
+								std::memory_order_relaxed))
+					break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = head_.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->item = item;
+		cell->seq.store(pos + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	bool pop(T &item)
+	{
+		Cell *cell = &cells_[tail_ % N];
+
+		if (cell->seq.load(std::memory_order_acquire) != tail_ + 1)
+			return false;
+
+		item = cell->item;
+		cell->seq.store(tail_ + N, std::memory_order_release);
+		tail_++;
+
+		return true;
+	}
+
+private:
+	static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+	struct Cell {
+		std::atomic<size_t> seq;
+		T item;
+	};
+
+	std::array<Cell, N> cells_;
+	alignas(64) std::atomic<size_t> head_{ 0 };
+	alignas(64) size_t tail_{ 0 };
+};
+
+/*
+ * Work handed over to the event loop thread: either a completed libcamera
+ * request, or a frame the MJPEG encoder finished compressing into the sink
+ * buffer @index. @completed is the CLOCK_MONOTONIC time in ns at which the
+ * request completed, @times the encoder stage times of encoded frames.
+ */
+struct libcamera_completion {
+	enum {
+		REQUEST_COMPLETE,
+		FRAME_ENCODED,
+	} type;
+	Request *request;
+	unsigned int index;
+	size_t bytesused;
+	int64_t timestamp;
+	uint64_t completed;
+	MjpegEncodeTimes times;
+};
+
+/*
+ * Each request has at most one completion pending, for the request itself or
+ * for the frame encoded from it, and there are at most VIDEO_MAX_FRAME requests.
+ * Leave room for the frames held by the encoder on top, so that pushing a
+ * completion never fails and no request or encoder slot is ever lost.
+ */
+static constexpr size_t COMPLETION_RING_SIZE = 64;
+static_assert(COMPLETION_RING_SIZE >= VIDEO_MAX_FRAME + MjpegEncoder::MAX_FRAMES_IN_FLIGHT,
+	      "completion ring too small for the requests in flight");
+
 struct libcamera_source {
 	struct video_source src;
 
@@ -47,17 +152,28 @@ struct libcamera_source {
 
 	FrameBufferAllocator *allocator;
 	std::vector<std::unique_ptr<Request>> requests;
-	std::queue<Request *> completed_requests;
-	int pfds[2];
+	CompletionRing<libcamera_completion, COMPLETION_RING_SIZE> completions;
+	int efd;
 
-	MjpegEncoder *encoder;
+	MjpegEncoder *encoder{ nullptr };
+	MjpegOverflowPolicy overflow_policy{ MjpegOverflowPolicy::Retry };
+	unsigned int encoder_slices{ 1 };
+	MjpegEncoderConfig encoder_config;
 	std::unordered_map<FrameBuffer *, Span<uint8_t>> mapped_buffers_;
 
 	struct video_buffer_set buffers;
 
+	/*
+	 * Frames queued to the encoder and not handed back yet, and frames
+	 * dropped by the encoder, counted from the event loop thread.
+	 */
+	unsigned int encoding{ 0 };
+	uint64_t dropped{ 0 };
+
 	void mapBuffer(const std::unique_ptr<FrameBuffer> &buffer);
 	void requestComplete(Request *request);
-	void outputReady(void *mem, size_t bytesused, int64_t timestamp, unsigned int cookie);
+	void outputReady(void *mem, size_t bytesused, int64_t timestamp, unsigned int cookie,
+			 const MjpegEncodeTimes &times);
 
 	bool is_debug_report_enabled{false};
 	int64_t last_debug_report_timestamp_ns{0};
@@ -84,74 +200,106 @@ void libcamera_source::mapBuffer(const std::unique_ptr<FrameBuffer> &buffer)
 
 void libcamera_source::requestComplete(Request *request)
 {
+	static const uint64_t one = 1;
+
 	if (request->status() == Request::RequestCancelled)
 		return;
 
-	completed_requests.push(request);
+	/* The ring is sized for all requests, this can't fail. */
+	completions.push({ libcamera_completion::REQUEST_COMPLETE, request,
+			   0, 0, 0, video_buffer_clock(), {} });
 
 	/*
 	 * We want to hand off to the event loop to do any further processing,
-	 * which we can achieve by simply writing to the end of the pipe since
-	 * the loop is polling the other end. Once the event loop picks up this
-	 * write it will run libcamera_source_video_process().
+	 * which we can achieve by incrementing the eventfd counter the loop is
+	 * polling. Once the event loop picks up the event it will run
+	 * libcamera_source_video_process(), which drains every request that
+	 * completed in the meantime.
 	 */
-	write(pfds[1], "x", 1);
+	write(efd, &one, sizeof(one));
 };
 
-void libcamera_source::outputReady(void *mem, size_t bytesused, int64_t timestamp, unsigned int cookie)
+void libcamera_source::outputReady(void *, size_t bytesused, int64_t timestamp, unsigned int cookie,
+				   const MjpegEncodeTimes &times)
 {
-	struct video_buffer buffer;
+	static const uint64_t one = 1;
 
-	buffer.index = cookie;
-	buffer.mem = mem;
-	buffer.bytesused = bytesused;
-	buffer.timestamp.tv_sec = timestamp / 1000000;
-	buffer.timestamp.tv_usec = timestamp % 1000000;
+	/*
+	 * This runs on the encoder output thread. Queueing the buffer to the
+	 * sink, or recycling the request, is left to the event loop thread so
+	 * that all V4L2 and libcamera operations are issued from a single
+	 * thread and in order.
+	 */
+	completions.push({ libcamera_completion::FRAME_ENCODED, nullptr,
+			   cookie, bytesused, timestamp, 0, times });
 
-	src.handler(src.handler_data, &src, &buffer);
+	write(efd, &one, sizeof(one));
 }
 
-static void libcamera_source_video_process(void *d)
+static int libcamera_source_queue_buffer(struct video_source *s,
+					 struct video_buffer *buf);
+
+static void libcamera_source_process_encoded(struct libcamera_source *src,
+					     const libcamera_completion &completion)
 {
-	struct libcamera_source *src = (struct libcamera_source *)d;
-	Stream *stream = src->config->at(0).stream();
-	struct video_buffer buffer;
-	Request *request;
-	char buf;
+	struct video_buffer buffer = src->buffers.buffers[completion.index];
+
+	if (src->encoding)
+		src->encoding--;
+
+	buffer.bytesused = completion.bytesused;
+	buffer.timestamp.tv_sec = completion.timestamp / 1000000;
+	buffer.timestamp.tv_usec = completion.timestamp % 1000000;
+	buffer.stamps[VIDEO_BUFFER_STAGE_ENCODE_START] = completion.times.encode_start;
+	buffer.stamps[VIDEO_BUFFER_STAGE_ENCODE_END] = completion.times.encode_end;
+	buffer.stamps[VIDEO_BUFFER_STAGE_REORDER] = completion.times.output;
 
 	/*
-	 * We need to perform a read here or the fd will stay active each time
-	 * the event loop cycles.
+	 * The encoder dropped a frame that didn't fit in the sink buffer. Give
+	 * the request back to the camera rather than sending an empty frame.
 	 */
-	read(src->pfds[0], &buf, 1);
-
-	if (src->completed_requests.empty())
+	if (!buffer.bytesused) {
+		src->dropped++;
+		libcamera_source_queue_buffer(&src->src, &buffer);
 		return;
+	}
+
+	src->src.handler(src->src.handler_data, &src->src, &buffer);
+}
 
-	request = src->completed_requests.front();
-	src->completed_requests.pop();
+static void libcamera_source_process_request(struct libcamera_source *src,
+					    const libcamera_completion &completion)
+{
+	Stream *stream = src->config->at(0).stream();
+	Request *request = completion.request;
+	struct video_buffer buffer = {};
 
 	/* We have only a single buffer per request, so just pick the first */
 	FrameBuffer *framebuf = request->buffers().begin()->second;
 
+	/* The sensor time stamp is taken from CLOCK_MONOTONIC. */
+	buffer.stamps[VIDEO_BUFFER_STAGE_CAPTURE] = framebuf->metadata().timestamp;
+	buffer.stamps[VIDEO_BUFFER_STAGE_COMPLETE] = completion.completed;
+
 	/* Debug: output lens position and colour gains to logs (approx. every 1s)*/
 	if (src->is_debug_report_enabled) {
 		int64_t debug_timestamp_ns = framebuf->metadata().timestamp;
 		const ControlList &controls_metadata = request->metadata();
 		if (src->last_debug_report_timestamp_ns == 0 || (debug_timestamp_ns - src->last_debug_report_timestamp_ns) >= 1000000000LL) {
 			src->last_debug_report_timestamp_ns = debug_timestamp_ns;
-			std::cout << "CAMERA_DEBUG: ";
-			if (controls_metadata.contains(controls::LensPosition.id())) {
-				std::cout << "LensPos=\"" << *controls_metadata.get(controls::LensPosition) << "\", ";
-			} else {
-				std::cout << "LensPos=\"n/a\", ";
-			}
+			char lens[32] = "n/a";
+			char gain_r[32] = "n/a";
+			char gain_b[32] = "n/a";
+
+			if (controls_metadata.contains(controls::LensPosition.id()))
+				snprintf(lens, sizeof(lens), "%g", *controls_metadata.get(controls::LensPosition));
 			if (controls_metadata.contains(controls::ColourGains.id())) {
-				std::cout	<< "ColGainR=\"" << (*controls_metadata.get(controls::ColourGains))[0] << "\", "
-							<< "ColGainB=\"" << (*controls_metadata.get(controls::ColourGains))[1] << "\"" << std::endl;
-			} else {
-				std::cout << "ColGainR=\"n/a\", ColGainB=\"n/a\"" << std::endl;
+				snprintf(gain_r, sizeof(gain_r), "%g", (*controls_metadata.get(controls::ColourGains))[0]);
+				snprintf(gain_b, sizeof(gain_b), "%g", (*controls_metadata.get(controls::ColourGains))[1]);
 			}
+
+			log_info("CAMERA_DEBUG: LensPos=\"%s\", ColGainR=\"%s\", ColGainB=\"%s\"\n",
+				 lens, gain_r, gain_b);
 		}
 	}
 
@@ -166,10 +314,21 @@ static void libcamera_source_video_process(void *d)
 		StreamInfo info = src->encoder->getStreamInfo(stream);
 		auto span = src->mapped_buffers_.find(framebuf);
 		void *mem = span->second.data();
-		void *dest = src->buffers.buffers[request->cookie()].mem;
+		struct video_buffer *sink_buffer = &src->buffers.buffers[request->cookie()];
+		void *dest = sink_buffer->mem;
+		unsigned int dest_size = sink_buffer->size;
 		unsigned int size = span->second.size();
 
-		src->encoder->EncodeBuffer(mem, dest, size, info, timestamp_ns / 1000, request->cookie());
+		/*
+		 * The encoded frame is reported with the sink buffer, carry
+		 * the stamps over.
+		 */
+		memcpy(sink_buffer->stamps, buffer.stamps, sizeof(buffer.stamps));
+		video_buffer_stamp(sink_buffer, VIDEO_BUFFER_STAGE_ENCODE_QUEUE);
+
+		src->encoder->EncodeBuffer(mem, dest, size, dest_size, info,
+					   timestamp_ns / 1000, request->cookie());
+		src->encoding++;
 
 		return;
 	}
@@ -180,21 +339,49 @@ static void libcamera_source_video_process(void *d)
 	buffer.size = framebuf->planes()[0].length;
 	buffer.mem = NULL;
 	buffer.bytesused = framebuf->metadata().planes()[0].bytesused;
-	buffer.timestamp.tv_usec = framebuf->metadata().timestamp;
+	buffer.timestamp.tv_sec = framebuf->metadata().timestamp / 1000000000;
+	buffer.timestamp.tv_usec = framebuf->metadata().timestamp / 1000 % 1000000;
 	buffer.error = false;
 
 	src->src.handler(src->src.handler_data, &src->src, &buffer);
 }
 
+static void libcamera_source_video_process(void *d)
+{
+	struct libcamera_source *src = (struct libcamera_source *)d;
+	libcamera_completion completion;
+	uint64_t count;
+
+	/*
+	 * We need to perform a read here or the fd will stay active each time
+	 * the event loop cycles. Reading resets the counter, the ring is then
+	 * drained completely as the counter only tells us that at least one
+	 * completion is pending.
+	 */
+	read(src->efd, &count, sizeof(count));
+
+	while (src->completions.pop(completion)) {
+		switch (completion.type) {
+		case libcamera_completion::REQUEST_COMPLETE:
+			libcamera_source_process_request(src, completion);
+			break;
+		case libcamera_completion::FRAME_ENCODED:
+			libcamera_source_process_encoded(src, completion);
+			break;
+		}
+	}
+}
+
 static void libcamera_source_destroy(struct video_source *s)
 {
 	struct libcamera_source *src = to_libcamera_source(s);
 
 	src->camera->requestCompleted.disconnect(src);
 
-	/* Closing the event notification file descriptors */
-	close(src->pfds[0]);
-	close(src->pfds[1]);
+	delete src->encoder;
+
+	/* Closing the event notification file descriptor */
+	close(src->efd);
 
 	src->camera->release();
 	src->camera.reset();
@@ -209,6 +396,13 @@ static int libcamera_source_set_format(struct video_source *s,
 	StreamConfiguration &streamConfig = src->config->at(0);
 	__u32 chosen_pixelformat = fmt->pixelformat;
 
+	/*
+	 * We need to reinitialise this here, as if the user previously
+	 * selected an unsupported MJPEG format the encoding routine will have
+	 * overriden this setting.
+	 */
+	src->src.type = VIDEO_SOURCE_DMABUF;
+
 	streamConfig.size.width = fmt->width;
 	streamConfig.size.height = fmt->height;
 	streamConfig.pixelFormat = PixelFormat(chosen_pixelformat);
@@ -218,14 +412,12 @@ static int libcamera_source_set_format(struct video_source *s,
 #ifdef CONFIG_CAN_ENCODE
 	/*
 	 * If the user requests MJPEG but the camera can't supply it, try again
-	 * with YUV420 and initialise an MjpegEncoder to compress the data.
+	 * with YUV420. An MjpegEncoder will compress the data, it is created
+	 * along with the buffers.
 	 */
 	if (chosen_pixelformat == V4L2_PIX_FMT_MJPEG &&
 	    streamConfig.pixelFormat.fourcc() != chosen_pixelformat) {
-		std::cout << "MJPEG format not natively supported; encoding YUV420" << std::endl;
-
-		src->encoder = new MjpegEncoder();
-		src->encoder->SetOutputReadyCallback(std::bind(&libcamera_source::outputReady, src, _1, _2, _3, _4));
+		log_info("MJPEG format not natively supported; encoding YUV420\n");
 
 		streamConfig.pixelFormat = PixelFormat(V4L2_PIX_FMT_YUV420);
 		src->src.type = VIDEO_SOURCE_ENCODED;
@@ -235,9 +427,9 @@ static int libcamera_source_set_format(struct video_source *s,
 #endif
 
 	if (fmt->pixelformat != streamConfig.pixelFormat.fourcc())
-		std::cerr << "Warning: set_format: Requested format unavailable" << std::endl;
+		log_warning("Warning: set_format: Requested format unavailable\n");
 
-	std::cout << "setting format to " << streamConfig.toString() << std::endl;
+	log_info("setting format to %s\n", streamConfig.toString().c_str());
 
 	/*
 	 * No .configure() call at this stage, because we need to pick up the
@@ -246,7 +438,8 @@ static int libcamera_source_set_format(struct video_source *s,
 
 	fmt->width = streamConfig.size.width;
 	fmt->height = streamConfig.size.height;
-	fmt->pixelformat = src->encoder ? V4L2_PIX_FMT_MJPEG : streamConfig.pixelFormat.fourcc();
+	fmt->pixelformat = src->src.type == VIDEO_SOURCE_ENCODED
+			 ? V4L2_PIX_FMT_MJPEG : streamConfig.pixelFormat.fourcc();
 	fmt->field = V4L2_FIELD_ANY;
 
 	/* TODO: Can we use libcamera helpers to get image size / stride? */
@@ -255,10 +448,12 @@ static int libcamera_source_set_format(struct video_source *s,
 	return 0;
 }
 
-static int libcamera_source_set_frame_rate(struct video_source *s, unsigned int fps)
+static int libcamera_source_set_frame_rate(struct video_source *s,
+					   unsigned int interval)
 {
 	struct libcamera_source *src = to_libcamera_source(s);
-	int64_t frame_time = 1000000 / fps;
+	/* FrameDurationLimits is in µs, the interval in 100ns units. */
+	int64_t frame_time = interval / 10;
 
 	src->controls.set(controls::FrameDurationLimits,
 			  Span<const int64_t, 2>({ frame_time, frame_time }));
@@ -275,7 +470,7 @@ static int libcamera_source_alloc_buffers(struct video_source *s, unsigned int n
 	streamConfig.bufferCount = nbufs;
 	ret = src->camera->configure(src->config.get());
 	if (ret) {
-		std::cerr << "failed to configure the camera" << std::endl;
+		log_error("failed to configure the camera\n");
 		return ret;
 	}
 
@@ -286,7 +481,7 @@ static int libcamera_source_alloc_buffers(struct video_source *s, unsigned int n
 
 	ret = allocator->allocate(stream);
 	if (ret < 0) {
-		std::cerr << "failed to allocate buffers" << std::endl;
+		log_error("failed to allocate buffers\n");
 		return ret;
 	}
 
@@ -295,14 +490,31 @@ static int libcamera_source_alloc_buffers(struct video_source *s, unsigned int n
 	const std::vector<std::unique_ptr<FrameBuffer>> &buffers = allocator->buffers(stream);
 	src->buffers.nbufs = buffers.size();
 
+	/* The completion ring is sized for at most VIDEO_MAX_FRAME requests. */
+	if (buffers.size() > VIDEO_MAX_FRAME) {
+		log_error("camera provided %zu buffers, more than %u\n",
+			  buffers.size(), VIDEO_MAX_FRAME);
+		return -EINVAL;
+	}
+
+	if (buffers.size() != nbufs)
+		log_info("camera provided %zu buffers, %u requested\n",
+			 buffers.size(), nbufs);
+
 	if (src->src.type == VIDEO_SOURCE_ENCODED) {
 		for (const std::unique_ptr<FrameBuffer> &buffer : buffers)
 			src->mapBuffer(buffer);
+
+		src->encoder = new MjpegEncoder(src->encoder_config);
+		src->encoder->SetOutputReadyCallback(std::bind(&libcamera_source::outputReady, src, _1, _2, _3, _4, _5));
+		src->encoder->SetOverflowPolicy(src->overflow_policy);
+		src->encoder->SetSlices(src->encoder_slices);
+		src->encoder->SetFramesInFlight(buffers.size());
 	}
 
 	src->buffers.buffers = (video_buffer *)calloc(src->buffers.nbufs, sizeof(*src->buffers.buffers));
 	if (!src->buffers.buffers) {
-		std::cerr << "failed to allocate buffers" << std::endl;
+		log_error("failed to allocate buffers\n");
 		return -ENOMEM;
 	}
 
@@ -311,7 +523,7 @@ static int libcamera_source_alloc_buffers(struct video_source *s, unsigned int n
 		src->buffers.buffers[i].dmabuf = -1;
 	}
 
-	return ret;
+	return src->buffers.nbufs;
 }
 
 static int libcamera_source_export_buffers(struct video_source *s,
@@ -351,8 +563,17 @@ static int libcamera_source_import_buffers(struct video_source *s,
 {
 	struct libcamera_source *src = to_libcamera_source(s);
 
-	for (unsigned int i = 0; i < buffers->nbufs; i++)
+	/* Frames are encoded into the sink buffer of the same index. */
+	if (buffers->nbufs < src->buffers.nbufs) {
+		log_error("%u sink buffers for %u camera buffers\n",
+			  buffers->nbufs, src->buffers.nbufs);
+		return -EINVAL;
+	}
+
+	for (unsigned int i = 0; i < src->buffers.nbufs; i++) {
 		src->buffers.buffers[i].mem = buffers->buffers[i].mem;
+		src->buffers.buffers[i].size = buffers->buffers[i].size;
+	}
 
 	return 0;
 }
@@ -362,6 +583,11 @@ static int libcamera_source_free_buffers(struct video_source *s)
 	struct libcamera_source *src = to_libcamera_source(s);
 	Stream *stream = src->config->at(0).stream();
 
+	src->requests.clear();
+
+	delete src->encoder;
+	src->encoder = nullptr;
+
 	for (auto &[buf, span] : src->mapped_buffers_)
 		munmap(span.data(), span.size());
 
@@ -382,17 +608,24 @@ static int libcamera_source_stream_on(struct video_source *s)
 
 	const std::vector<std::unique_ptr<FrameBuffer>> &buffers = src->allocator->buffers(stream);
 
-	for (unsigned int i = 0; i < buffers.size(); ++i) {
+	/*
+	 * The requests are kept when the stream is stopped, and only need to
+	 * be recycled when it is restarted.
+	 */
+	for (std::unique_ptr<Request> &request : src->requests)
+		request->reuse(Request::ReuseBuffers);
+
+	for (unsigned int i = src->requests.size(); i < buffers.size(); ++i) {
 		std::unique_ptr<Request> request = src->camera->createRequest(i);
 		if (!request) {
-			std::cerr << "failed to create request" << std::endl;
+			log_error("failed to create request\n");
 			return -ENOMEM;
 		}
 
 		const std::unique_ptr<FrameBuffer> &buffer = buffers[i];
 		ret = request->addBuffer(stream, buffer.get());
 		if (ret < 0) {
-			std::cerr << "failed to set buffer for request" << std::endl;
+			log_error("failed to set buffer for request\n");
 			return ret;
 		}
 
@@ -401,14 +634,14 @@ static int libcamera_source_stream_on(struct video_source *s)
 
 	ret = src->camera->start(&src->controls);
 	if (ret) {
-		std::cerr << "failed to start camera" << std::endl;
+		log_error("failed to start camera\n");
 		return ret;
 	}
 
 	for (std::unique_ptr<Request> &request : src->requests) {
 		ret = src->camera->queueRequest(request.get());
 		if (ret) {
-			std::cerr << "failed to queue request" << std::endl;
+			log_error("failed to queue request\n");
 			src->camera->stop();
 			return ret;
 		}
@@ -416,11 +649,10 @@ static int libcamera_source_stream_on(struct video_source *s)
 
 	/*
 	 * Given our event handling code is designed for V4L2 file descriptors
-	 * and lacks a way to trigger an event manually, we're using a pipe so
-	 * that we can watch the read end and write to the other end when
-	 * requestComplete() is ran.
+	 * and lacks a way to trigger an event manually, we're using an eventfd
+	 * that becomes readable when requestComplete() is ran.
 	 */
-	events_watch_fd(src->src.events, src->pfds[0], EVENT_READ,
+	events_watch_fd(src->src.events, src->efd, EVENT_READ,
 			libcamera_source_video_process, src);
 
 	return 0;
@@ -429,26 +661,29 @@ static int libcamera_source_stream_on(struct video_source *s)
 static int libcamera_source_stream_off(struct video_source *s)
 {
 	struct libcamera_source *src = to_libcamera_source(s);
+	libcamera_completion completion;
+	uint64_t count;
 
 	src->camera->stop();
-	events_unwatch_fd(src->src.events, src->pfds[0], EVENT_READ);
-	src->requests.clear();
+	events_unwatch_fd(src->src.events, src->efd, EVENT_READ);
 
-	while (!src->completed_requests.empty())
-		src->completed_requests.pop();
-
-	if (src->src.type == VIDEO_SOURCE_ENCODED) {
-		delete src->encoder;
-		src->encoder = nullptr;
-	}
+	/*
+	 * The encoder is kept for the next session, wait for the frames it's
+	 * still compressing.
+	 */
+	if (src->encoder)
+		src->encoder->Flush();
 
 	/*
-	 * We need to reinitialise this here, as if the user selected an
-	 * unsupported MJPEG format the encoding routine will have overriden
-	 * this setting.
+	 * The camera is stopped and the encoder idle, so nothing will push any
+	 * more completions. Discard the pending ones, the requests will all be
+	 * requeued when streaming restarts.
 	 */
-	src->src.type = VIDEO_SOURCE_DMABUF;
+	while (src->completions.pop(completion))
+		;
+	read(src->efd, &count, sizeof(count));
 
+	src->encoding = 0;
 	src->last_debug_report_timestamp_ns = 0;
 
 	return 0;
@@ -471,6 +706,15 @@ static int libcamera_source_queue_buffer(struct video_source *s,
 	return 0;
 }
 
+static void libcamera_source_get_stats(struct video_source *s,
+				       struct video_source_stats *stats)
+{
+	struct libcamera_source *src = to_libcamera_source(s);
+
+	stats->queued = src->encoding;
+	stats->dropped = src->dropped;
+}
+
 static const struct video_source_ops libcamera_source_ops = {
 	.destroy = libcamera_source_destroy,
 	.set_format = libcamera_source_set_format,
@@ -483,6 +727,7 @@ static const struct video_source_ops libcamera_source_ops = {
 	.stream_off = libcamera_source_stream_off,
 	.queue_buffer = libcamera_source_queue_buffer,
 	.fill_buffer = NULL,
+	.get_stats = libcamera_source_get_stats,
 };
 
 std::string cameraName(Camera *camera)
@@ -518,24 +763,22 @@ struct video_source *libcamera_source_create(const char *devname)
 	int ret;
 
 	if (!devname) {
-		std::cerr << "No camera identifier was passed" << std::endl;
+		log_error("No camera identifier was passed\n");
 		return NULL;
 	}
 
 	src = new libcamera_source;
 
 	/*
-	 * Event handling in libuvcgadget currently depends on select(), but
+	 * Event handling in libuvcgadget is based on file descriptors, but
 	 * unlike a V4L2 devnode there's no file descriptor for completed
-	 * libcamera Requests. We'll spoof the events using a pipe for now,
-	 * but...
-	 *
-	 * TODO: Replace event handling with libevent
+	 * libcamera Requests or encoded frames. Signal them through an
+	 * eventfd, whose counter coalesces bursts of completions into a single
+	 * wakeup.
 	 */
-
-	ret = pipe2(src->pfds, O_NONBLOCK);
-	if (ret) {
-		std::cerr << "failed to create pipe" << std::endl;
+	src->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (src->efd < 0) {
+		log_error("failed to create eventfd\n");
 		goto err_free_src;
 	}
 
@@ -546,13 +789,13 @@ struct video_source *libcamera_source_create(const char *devname)
 	src->cm->start();
 
 	if (src->cm->cameras().empty()) {
-		std::cout << "No cameras were identified on the system" << std::endl;
-		goto err_close_pipe;
+		log_info("No cameras were identified on the system\n");
+		goto err_close_eventfd;
 	}
 
 	/* TODO: make a separate way to list libcamera cameras */
 	for (auto const &camera : src->cm->cameras())
-		printf("- %s\n", cameraName(camera.get()).c_str());
+		log_info("- %s\n", cameraName(camera.get()).c_str());
 
 	/*
 	 * Camera selection is by ID or index. Camera ID's start with a slash.
@@ -563,31 +806,31 @@ struct video_source *libcamera_source_create(const char *devname)
 		unsigned long index = std::atoi(devname);
 
 		if (index >= src->cm->cameras().size()) {
-			std::cerr << "No camera at index " << index << std::endl;
-			goto err_close_pipe;
+			log_error("No camera at index %lu\n", index);
+			goto err_close_eventfd;
 		}
 
 		src->camera = src->cm->cameras()[index];
 	} else {
 		src->camera = src->cm->get(std::string(devname));
 		if (!src->camera) {
-			std::cerr << "found no camera matching " << devname << std::endl;
-			goto err_close_pipe;
+			log_error("found no camera matching %s\n", devname);
+			goto err_close_eventfd;
 		}
 	}
 
 	ret = src->camera->acquire();
 	if (ret) {
-		fprintf(stderr, "failed to acquire camera\n");
-		goto err_close_pipe;
+		log_error("failed to acquire camera\n");
+		goto err_close_eventfd;
 	}
 
-	std::cout << "Using camera " << cameraName(src->camera.get()) << std::endl;
+	log_info("Using camera %s\n", cameraName(src->camera.get()).c_str());
 
 	src->config =
 		src->camera->generateConfiguration( { StreamRole::VideoRecording });
 	if (!src->config) {
-		std::cerr << "failed to generate camera config" << std::endl;
+		log_error("failed to generate camera config\n");
 		goto err_release_camera;
 	}
 
@@ -597,9 +840,8 @@ struct video_source *libcamera_source_create(const char *devname)
 
 err_release_camera:
 	src->camera->release();
-err_close_pipe:
-	close(src->pfds[0]);
-	close(src->pfds[1]);
+err_close_eventfd:
+	close(src->efd);
 	src->cm->stop();
 err_free_src:
 	delete src;
@@ -614,16 +856,59 @@ void libcamera_source_set_controls(struct video_source *s, struct camera_argumen
 
 	struct libcamera_source *src = to_libcamera_source(s);
 	if (!src || !src->camera) {
-		std::cerr << "Error when setting camera controls: source or camera missing" << std::endl;
+		log_error("Error when setting camera controls: source or camera missing\n");
 		return;
 	}
 
 	if (input_arguments->debug_report_enabled) {
 		src->is_debug_report_enabled = input_arguments->debug_report_enabled;
-		std::cout << "Debug enabled: will print lens position and colour gains every 1s" << std::endl;
+		log_info("Debug enabled: will print lens position and colour gains every 1s\n");
+	}
+
+	if (input_arguments->mjpeg_overflow) {
+		static const struct { const char *string_value; MjpegOverflowPolicy policy; } overflow_policies[] = {
+			{ "retry",         MjpegOverflowPolicy::Retry },
+			{ "truncate",      MjpegOverflowPolicy::Truncate },
+			{ "drop",          MjpegOverflowPolicy::Drop },
+		};
+
+		for (const auto &entry : overflow_policies) {
+			if (!strcmp(entry.string_value, input_arguments->mjpeg_overflow))
+				src->overflow_policy = entry.policy;
+		}
+	}
+
+	if (input_arguments->mjpeg_slices)
+		src->encoder_slices = input_arguments->mjpeg_slices;
+
+	src->encoder_config.threads = input_arguments->encoder_threads;
+	src->encoder_config.reserved_cpus = input_arguments->encoder_reserved_cpus;
+
+	for (unsigned int cpu = 0; cpu < sizeof(input_arguments->encoder_cpus) * 8; cpu++) {
+		if (input_arguments->encoder_cpus & (1UL << cpu))
+			CPU_SET(cpu, &src->encoder_config.cpus);
+	}
+
+	if (input_arguments->encoder_sched) {
+		static const struct { const char *string_value; int policy; } sched_policies[] = {
+			{ "other",         SCHED_OTHER },
+			{ "fifo",          SCHED_FIFO },
+			{ "rr",            SCHED_RR },
+		};
+
+		for (const auto &entry : sched_policies) {
+			if (!strcmp(entry.string_value, input_arguments->encoder_sched))
+				src->encoder_config.sched_policy = entry.policy;
+		}
+
+		src->encoder_config.sched_priority = input_arguments->encoder_priority;
+		if (src->encoder_config.sched_policy != SCHED_OTHER &&
+		    !src->encoder_config.sched_priority)
+			src->encoder_config.sched_priority =
+				sched_get_priority_min(src->encoder_config.sched_policy);
 	}
 
-	std::cout << "Setting camera controls parameters:" << std::endl;
+	log_info("Setting camera controls parameters:\n");
 
 	const ControlInfoMap &infoMap = src->camera->controls();
 
@@ -668,16 +953,16 @@ void libcamera_source_set_controls(struct video_source *s, struct camera_argumen
 		if (!input_value)
 			return;
 		if (!infoMap.count(control_name.id())) {
-			std::cerr << "  Cannot set " << control_label << ": not supported by camera - fallback to camera defaults" << std::endl;
+			log_warning("  Cannot set %s: not supported by camera - fallback to camera defaults\n", control_label);
 			return;
 		}
 		int control_value = lookup_control_mode_from_string(input_value, conversion_map);
 		if (control_value == -1) {
-			std::cerr << "  Cannot set " << control_label << ": unknown value \"" << input_value << "\" - fallback to camera defaults" << std::endl;
+			log_warning("  Cannot set %s: unknown value \"%s\" - fallback to camera defaults\n", control_label, input_value);
 			return;
 		}
 		src->controls.set(control_name, control_value);
-		std::cout << "  " << control_label << ": \"" << input_value << "\"" << std::endl;
+		log_info("  %s: \"%s\"\n", control_label, input_value);
 	};
 
 	auto is_numeric_control_provided = [](float value){
@@ -691,28 +976,28 @@ void libcamera_source_set_controls(struct video_source *s, struct camera_argumen
 	bool is_focus_manual=false;
 	if (!infoMap.count(controls::AfMode.id())) {
 		// If no AfMode control available - cannot set AfModeContinuous (and AF range/speed), nor AfModeManual (lens position)
-		std::cerr << "  Cannot set focus controls: not supported by camera - fallback to camera defaults" << std::endl;
+		log_warning("  Cannot set focus controls: not supported by camera - fallback to camera defaults\n");
 	} else {
 		if (is_numeric_control_provided(input_arguments->lens_position)) {
 			if (infoMap.count(controls::LensPosition.id())) {
 				is_focus_manual = true;
 				src->controls.set(controls::AfMode, controls::AfModeManual);
-				std::cout << "  AF algorithm: disabled - will set manual lens focus position" << std::endl;
+				log_info("  AF algorithm: disabled - will set manual lens focus position\n");
 				if (input_arguments->af_range_mode) {
-					std::cout << "    (AF range mode parameter ignored)" << std::endl;
+					log_info("    (AF range mode parameter ignored)\n");
 				}
 				if (input_arguments->af_speed_mode) {
-					std::cout << "    (AF lens speed mode parameter ignored)" << std::endl;
+					log_info("    (AF lens speed mode parameter ignored)\n");
 				}
 				src->controls.set(controls::LensPosition, input_arguments->lens_position);
-				std::cout << "  Lens focus position: \"" << input_arguments->lens_position << "\"" << std::endl;
+				log_info("  Lens focus position: \"%g\"\n", input_arguments->lens_position);
 			} else {
-				std::cout << "  Cannot set lens focus position: not supported by camera - trying fallback to continuous AF" << std::endl;
+				log_info("  Cannot set lens focus position: not supported by camera - trying fallback to continuous AF\n");
 			}
 		}
 		if (!is_focus_manual) {
 			src->controls.set(controls::AfMode, controls::AfModeContinuous);
-			std::cout << "  AF algorithm mode: \"continuous\" (UVC default)" << std::endl;
+			log_info("  AF algorithm mode: \"continuous\" (UVC default)\n");
 			apply_control_mode_from_string("AF range mode", controls::AfRange, input_arguments->af_range_mode, af_range_mode_conversion_map);
 			apply_control_mode_from_string("AF lens speed mode", controls::AfSpeed, input_arguments->af_speed_mode, af_speed_mode_conversion_map);
 		}
@@ -722,19 +1007,19 @@ void libcamera_source_set_controls(struct video_source *s, struct camera_argumen
 	bool is_wb_manual=false;
 	if (is_numeric_control_provided(input_arguments->colour_gain_r) && is_numeric_control_provided(input_arguments->colour_gain_b)) {
 		if (!infoMap.count(controls::ColourGains.id())) {
-			std::cerr << "  Cannot set colour gains: not supported by camera - fallback to camera defaults" << std::endl;
+			log_warning("  Cannot set colour gains: not supported by camera - fallback to camera defaults\n");
 		} else {
 			is_wb_manual = true;
 			if (infoMap.count(controls::AwbEnable.id())) {
 				src->controls.set(controls::AwbEnable, false);
-				std::cout << "  AWB algorithm: disabled - will set manual colour gains" << std::endl;
+				log_info("  AWB algorithm: disabled - will set manual colour gains\n");
 			} else {
-				std::cout << "  Cannot disable AWB algorithm - will attempt to set manual colour gains anyway" << std::endl;
+				log_info("  Cannot disable AWB algorithm - will attempt to set manual colour gains anyway\n");
 			}
 			if (input_arguments->awb_mode)
-				std::cout << "    (AWB mode parameter ignored)" << std::endl;
+				log_info("    (AWB mode parameter ignored)\n");
 			src->controls.set(controls::ColourGains, { input_arguments->colour_gain_r, input_arguments->colour_gain_b });
-			std::cout << "  Colour gains: r=\"" << input_arguments->colour_gain_r << "\", b=\"" << input_arguments->colour_gain_b << "\"" << std::endl;
+			log_info("  Colour gains: r=\"%g\", b=\"%g\"\n", input_arguments->colour_gain_r, input_arguments->colour_gain_b);
 		}
 	}
 	if (!is_wb_manual)
@@ -744,37 +1029,37 @@ void libcamera_source_set_controls(struct video_source *s, struct camera_argumen
 
 	if (is_numeric_control_provided(input_arguments->brightness)) {
 		if (!infoMap.count(controls::Brightness.id())) {
-			std::cerr << "  Cannot set brightness: not supported by camera - fallback to camera defaults" << std::endl;
+			log_warning("  Cannot set brightness: not supported by camera - fallback to camera defaults\n");
 		} else {
 			src->controls.set(controls::Brightness, input_arguments->brightness);
-			std::cout << "  Brightness: \"" << input_arguments->brightness << "\"" << std::endl;
+			log_info("  Brightness: \"%g\"\n", input_arguments->brightness);
 		}
 	}
 
 	if (is_numeric_control_provided(input_arguments->contrast)) {
 		if (!infoMap.count(controls::Contrast.id())) {
-			std::cerr << "  Cannot set contrast: not supported by camera - fallback to camera defaults" << std::endl;
+			log_warning("  Cannot set contrast: not supported by camera - fallback to camera defaults\n");
 		} else {
 			src->controls.set(controls::Contrast, input_arguments->contrast);
-			std::cout << "  Contrast: \"" << input_arguments->contrast << "\"" << std::endl;
+			log_info("  Contrast: \"%g\"\n", input_arguments->contrast);
 		}
 	}
 
 	if (is_numeric_control_provided(input_arguments->saturation)) {
 		if (!infoMap.count(controls::Saturation.id())) {
-			std::cerr << "  Cannot set saturation: not supported by camera - fallback to camera defaults" << std::endl;
+			log_warning("  Cannot set saturation: not supported by camera - fallback to camera defaults\n");
 		} else {
 			src->controls.set(controls::Saturation, input_arguments->saturation);
-			std::cout << "  Saturation: \"" << input_arguments->saturation << "\"" << std::endl;
+			log_info("  Saturation: \"%g\"\n", input_arguments->saturation);
 		}
 	}
 
 	if (is_numeric_control_provided(input_arguments->sharpness)) {
 		if (!infoMap.count(controls::Sharpness.id())) {
-			std::cerr << "  Cannot set sharpness: not supported by camera - fallback to camera defaults" << std::endl;
+			log_warning("  Cannot set sharpness: not supported by camera - fallback to camera defaults\n");
 		} else {
 			src->controls.set(controls::Sharpness, input_arguments->sharpness);
-			std::cout << "  Sharpness: \"" << input_arguments->sharpness << "\"" << std::endl;
+			log_info("  Sharpness: \"%g\"\n", input_arguments->sharpness);
 		}
 	}
 }
@@ -0,0 +1,404 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Logging
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+
+/* To provide strchrnul from the GNU library. */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "tools.h"
+
+#define LOG_MAX_FILTERS		16
+#define LOG_MODULE_NAME_SIZE	16
+#define LOG_RING_SIZE		256
+#define LOG_MESSAGE_SIZE	256
+
+/*
+ * struct log_slot - Message slot in the ring
+ * @sequence: position the slot is ready to be written at, or position + 1
+ *	once the message has been written and can be read
+ * @level: level of the message
+ * @text: formatted message
+ */
+struct log_slot {
+	unsigned long sequence;
+	enum uvc_log_level level;
+	char text[LOG_MESSAGE_SIZE];
+};
+
+/*
+ * The ring is a bounded multi-producer single-consumer queue. Producers claim a
+ * position by incrementing @head and publish the message by updating the slot
+ * sequence, the log thread consumes the slots in order from @tail. Producers
+ * wake the thread through @eventfd only when it has announced it's going to
+ * sleep, so logging costs no system call while messages keep flowing.
+ */
+static struct {
+	struct {
+		char name[LOG_MODULE_NAME_SIZE];
+		int level;
+	} filters[LOG_MAX_FILTERS];
+	unsigned int num_filters;
+	int default_level;
+
+	struct log_slot ring[LOG_RING_SIZE];
+	unsigned long head;
+	unsigned long tail;
+	unsigned long dropped;
+
+	bool running;
+	bool sleeping;
+	bool stop;
+	int eventfd;
+	pthread_t thread;
+} uvc_log = {
+	.default_level = UVC_LOG_INFO,
+	.eventfd = -1,
+};
+
+/* Start at 1 to resolve the level of the modules the first time they log. */
+unsigned int uvc_log_generation = 1;
+
+static const char * const uvc_log_level_names[] = {
+	[UVC_LOG_ERROR] = "error",
+	[UVC_LOG_WARNING] = "warning",
+	[UVC_LOG_INFO] = "info",
+	[UVC_LOG_DEBUG] = "debug",
+};
+
+/* -----------------------------------------------------------------------------
+ * Filters
+ */
+
+void uvc_log_resolve(struct uvc_log_module *module)
+{
+	unsigned int generation = __atomic_load_n(&uvc_log_generation,
+						  __ATOMIC_ACQUIRE);
+	int level = uvc_log.default_level;
+	unsigned int i;
+
+	for (i = 0; i < uvc_log.num_filters; ++i) {
+		if (!strcmp(uvc_log.filters[i].name, module->name)) {
+			level = uvc_log.filters[i].level;
+			break;
+		}
+	}
+
+	__atomic_store_n(&module->level, level, __ATOMIC_RELAXED);
+	__atomic_store_n(&module->generation, generation, __ATOMIC_RELEASE);
+}
+
+static int uvc_log_parse_level(const char *name, size_t len)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(uvc_log_level_names); ++i) {
+		if (strlen(uvc_log_level_names[i]) == len &&
+		    !strncmp(uvc_log_level_names[i], name, len))
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+int uvc_log_set_filter(const char *spec)
+{
+	unsigned int num_filters = 0;
+	int default_level = uvc_log.default_level;
+	struct {
+		char name[LOG_MODULE_NAME_SIZE];
+		int level;
+	} filters[LOG_MAX_FILTERS];
+	const char *item = spec;
+
+	while (*item) {
+		const char *end = strchrnul(item, ',');
+		const char *sep = memchr(item, '=', end - item);
+		int level;
+
+		if (!sep) {
+			/* A bare level sets the default. */
+			level = uvc_log_parse_level(item, end - item);
+			if (level < 0)
+				return level;
+
+			default_level = level;
+		} else {
+			size_t len = sep - item;
+
+			if (!len || len >= LOG_MODULE_NAME_SIZE ||
+			    num_filters == LOG_MAX_FILTERS)
+				return -EINVAL;
+
+			level = uvc_log_parse_level(sep + 1, end - sep - 1);
+			if (level < 0)
+				return level;
+
+			memcpy(filters[num_filters].name, item, len);
+			filters[num_filters].name[len] = '\0';
+			filters[num_filters].level = level;
+			num_filters++;
+		}
+
+		item = *end ? end + 1 : end;
+	}
+
+	memcpy(uvc_log.filters, filters, sizeof(filters[0]) * num_filters);
+	uvc_log.num_filters = num_filters;
+	uvc_log.default_level = default_level;
+
+	__atomic_add_fetch(&uvc_log_generation, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * Output
+ */
+
+static void uvc_log_output(enum uvc_log_level level, const char *text)
+{
+	fputs(text, level <= UVC_LOG_WARNING ? stderr : stdout);
+}
+
+static void *uvc_log_thread(void *arg __attribute__((unused)))
+{
+	unsigned long dropped;
+	uint64_t value;
+	bool stop;
+
+	while (true) {
+		struct log_slot *slot = &uvc_log.ring[uvc_log.tail % LOG_RING_SIZE];
+
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) ==
+		    uvc_log.tail + 1) {
+			uvc_log_output(slot->level, slot->text);
+
+			__atomic_store_n(&slot->sequence,
+					 uvc_log.tail + LOG_RING_SIZE,
+					 __ATOMIC_RELEASE);
+			uvc_log.tail++;
+			continue;
+		}
+
+		dropped = __atomic_exchange_n(&uvc_log.dropped, 0,
+					      __ATOMIC_RELAXED);
+		if (dropped)
+			fprintf(stderr, "log: %lu message(s) dropped\n", dropped);
+
+		fflush(stdout);
+		fflush(stderr);
+
+		/*
+		 * Announce that the thread is going to sleep and check the ring
+		 * again, a producer that published a message before seeing the
+		 * flag is caught by the second check.
+		 */
+		stop = __atomic_load_n(&uvc_log.stop, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&uvc_log.sleeping, true, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) ==
+		    uvc_log.tail + 1) {
+			__atomic_store_n(&uvc_log.sleeping, false, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (stop)
+			break;
+
+		if (read(uvc_log.eventfd, &value, sizeof(value)) < 0 &&
+		    errno != EINTR)
+			break;
+	}
+
+	return NULL;
+}
+
+static void uvc_log_wake(void)
+{
+	uint64_t value = 1;
+
+	if (__atomic_exchange_n(&uvc_log.sleeping, false, __ATOMIC_SEQ_CST))
+		write(uvc_log.eventfd, &value, sizeof(value));
+}
+
+static void uvc_log_vwrite(enum uvc_log_level level, const char *fmt,
+			   va_list ap)
+{
+	unsigned long pos = __atomic_load_n(&uvc_log.head, __ATOMIC_RELAXED);
+	struct log_slot *slot;
+	int len;
+
+	if (!__atomic_load_n(&uvc_log.running, __ATOMIC_ACQUIRE)) {
+		vfprintf(level <= UVC_LOG_WARNING ? stderr : stdout, fmt, ap);
+		return;
+	}
+
+	/* Claim a slot, or drop the message if the ring is full. */
+	while (true) {
+		unsigned long sequence;
+
+		slot = &uvc_log.ring[pos % LOG_RING_SIZE];
+		sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+		if (sequence == pos) {
+			if (__atomic_compare_exchange_n(&uvc_log.head, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if ((long)(sequence - pos) < 0) {
+			__atomic_add_fetch(&uvc_log.dropped, 1, __ATOMIC_RELAXED);
+			uvc_log_wake();
+			return;
+		} else {
+			pos = __atomic_load_n(&uvc_log.head, __ATOMIC_RELAXED);
+		}
+	}
+
+	/* Keep the line ending of truncated messages. */
+	len = vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+	if (len >= (int)sizeof(slot->text))
+		slot->text[sizeof(slot->text) - 2] = '\n';
+
+	slot->level = level;
+
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_SEQ_CST);
+	uvc_log_wake();
+}
+
+void uvc_log_write(struct uvc_log_module *module __attribute__((unused)),
+		   enum uvc_log_level level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	uvc_log_vwrite(level, fmt, ap);
+	va_end(ap);
+}
+
+static uint64_t uvc_log_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void uvc_log_write_ratelimited(struct uvc_log_module *module,
+			       struct uvc_log_ratelimit *ratelimit,
+			       enum uvc_log_level level, const char *fmt, ...)
+{
+	uint64_t now = uvc_log_clock();
+	uint64_t begin = __atomic_load_n(&ratelimit->begin, __ATOMIC_RELAXED);
+	unsigned int suppressed;
+	va_list ap;
+
+	/*
+	 * The state is updated without a lock, concurrent callers may let a
+	 * few more messages through when a new interval starts.
+	 */
+	if (!begin || now - begin >= UVC_LOG_RATELIMIT_INTERVAL * 1000000ULL) {
+		if (__atomic_compare_exchange_n(&ratelimit->begin, &begin, now,
+						false, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+			suppressed = __atomic_exchange_n(&ratelimit->suppressed,
+							 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&ratelimit->printed, 0,
+					 __ATOMIC_RELAXED);
+
+			if (suppressed)
+				uvc_log_write(module, level,
+					      "%s: %u message(s) suppressed\n",
+					      module->name, suppressed);
+		}
+	}
+
+	if (__atomic_fetch_add(&ratelimit->printed, 1, __ATOMIC_RELAXED) >=
+	    UVC_LOG_RATELIMIT_BURST) {
+		__atomic_add_fetch(&ratelimit->suppressed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	va_start(ap, fmt);
+	uvc_log_vwrite(level, fmt, ap);
+	va_end(ap);
+}
+
+/* -----------------------------------------------------------------------------
+ * Thread
+ */
+
+int uvc_log_start(void)
+{
+	unsigned int i;
+	int ret;
+
+	if (uvc_log.running)
+		return 0;
+
+	for (i = 0; i < LOG_RING_SIZE; ++i)
+		uvc_log.ring[i].sequence = i;
+
+	uvc_log.head = 0;
+	uvc_log.tail = 0;
+	uvc_log.sleeping = false;
+	uvc_log.stop = false;
+
+	uvc_log.eventfd = eventfd(0, EFD_CLOEXEC);
+	if (uvc_log.eventfd < 0)
+		return -errno;
+
+	/*
+	 * Flush the messages written synchronously so far, to keep them ordered
+	 * with the ones the thread will write.
+	 */
+	fflush(stdout);
+	fflush(stderr);
+
+	ret = pthread_create(&uvc_log.thread, NULL, uvc_log_thread, NULL);
+	if (ret) {
+		close(uvc_log.eventfd);
+		uvc_log.eventfd = -1;
+		return -ret;
+	}
+
+	__atomic_store_n(&uvc_log.running, true, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void uvc_log_stop(void)
+{
+	uint64_t value = 1;
+
+	if (!uvc_log.running)
+		return;
+
+	/*
+	 * Messages logged concurrently with the stop may be lost, stop the
+	 * other threads first.
+	 */
+	__atomic_store_n(&uvc_log.running, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&uvc_log.stop, true, __ATOMIC_RELEASE);
+	write(uvc_log.eventfd, &value, sizeof(value));
+
+	pthread_join(uvc_log.thread, NULL);
+
+	close(uvc_log.eventfd);
+	uvc_log.eventfd = -1;
+}
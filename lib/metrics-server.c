@@ -0,0 +1,384 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Metrics server
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+
+/* To provide accept4 from the GNU library. */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+#include "events.h"
+#include "list.h"
+#include "metrics-server.h"
+
+#define METRICS_MAX_CLIENTS	16
+#define METRICS_BACKLOG		32
+#define METRICS_REQUEST_SIZE	1024
+
+/* Time a client has to send its request and read the response, in seconds. */
+#define METRICS_CLIENT_TIMEOUT	5
+
+/*
+ * struct metrics_client - Connection to a metrics client
+ * @list: entry in the server's clients list
+ * @server: the server
+ * @fd: connection socket
+ * @deadline: time at which the client is disconnected, in nanoseconds on the
+ *	monotonic clock
+ * @request: request received so far
+ * @request_len: length of @request
+ * @writing: true once the request has been received and the response is sent
+ * @response: response being sent
+ * @response_len: length of @response
+ * @sent: number of bytes of @response already sent
+ */
+struct metrics_client {
+	struct list_entry list;
+	struct metrics_server *server;
+	int fd;
+	uint64_t deadline;
+
+	char request[METRICS_REQUEST_SIZE];
+	size_t request_len;
+
+	bool writing;
+	char *response;
+	size_t response_len;
+	size_t sent;
+};
+
+struct metrics_server {
+	struct events *events;
+	char *path;
+	int fd;
+
+	metrics_render_t render;
+	void *data;
+
+	/*
+	 * Clients are accepted, and thus listed, in deadline order. The timer
+	 * is armed for the deadline of the first client or earlier whenever
+	 * the list isn't empty.
+	 */
+	struct list_entry clients;
+	unsigned int num_clients;
+	int timer;
+};
+
+static void metrics_server_accept(void *d);
+
+static uint64_t metrics_server_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void metrics_server_arm_timer(struct metrics_server *server,
+				     uint64_t deadline)
+{
+	struct itimerspec its = { 0 };
+
+	its.it_value.tv_sec = deadline / 1000000000;
+	its.it_value.tv_nsec = deadline % 1000000000;
+	timerfd_settime(server->timer, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void metrics_client_close(struct metrics_client *client)
+{
+	struct metrics_server *server = client->server;
+
+	events_unwatch_fd(server->events, client->fd,
+			  client->writing ? EVENT_WRITE : EVENT_READ);
+	close(client->fd);
+
+	list_remove(&client->list);
+
+	/* Resume accepting connections if the limit had been reached. */
+	if (server->num_clients-- == METRICS_MAX_CLIENTS)
+		events_watch_fd(server->events, server->fd, EVENT_READ,
+				metrics_server_accept, server);
+
+	free(client->response);
+	free(client);
+}
+
+static void metrics_client_write(void *d)
+{
+	struct metrics_client *client = d;
+	ssize_t ret;
+
+	while (client->sent < client->response_len) {
+		ret = send(client->fd, client->response + client->sent,
+			   client->response_len - client->sent, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			break;
+		}
+
+		client->sent += ret;
+	}
+
+	metrics_client_close(client);
+}
+
+/*
+ * Render the metrics and build the response. HTTP clients get a status line
+ * and headers, other clients the metrics only.
+ */
+static int metrics_client_respond(struct metrics_client *client, bool http)
+{
+	struct metrics_server *server = client->server;
+	const char *status = "200 OK";
+	char *body = NULL;
+	size_t body_len = 0;
+	FILE *file;
+	int ret;
+
+	if (http && strncmp(client->request, "GET ", 4))
+		status = "405 Method Not Allowed";
+
+	file = open_memstream(&body, &body_len);
+	if (!file)
+		return -ENOMEM;
+
+	if (!http || !strncmp(status, "200", 3))
+		server->render(server->data, file);
+	fclose(file);
+
+	if (http) {
+		FILE *resp = open_memstream(&client->response,
+					    &client->response_len);
+
+		if (!resp) {
+			free(body);
+			return -ENOMEM;
+		}
+
+		fprintf(resp, "HTTP/1.0 %s\r\n"
+			"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n", status, body_len);
+		fwrite(body, 1, body_len, resp);
+		ret = fclose(resp);
+		free(body);
+		if (ret)
+			return -ENOMEM;
+	} else {
+		client->response = body;
+		client->response_len = body_len;
+	}
+
+	events_unwatch_fd(server->events, client->fd, EVENT_READ);
+	client->writing = true;
+	events_watch_fd(server->events, client->fd, EVENT_WRITE,
+			metrics_client_write, client);
+
+	return 0;
+}
+
+static void metrics_client_read(void *d)
+{
+	struct metrics_client *client = d;
+	size_t space = sizeof(client->request) - 1 - client->request_len;
+	bool http;
+	ssize_t ret;
+
+	ret = recv(client->fd, client->request + client->request_len, space, 0);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+		metrics_client_close(client);
+		return;
+	}
+
+	client->request_len += ret;
+	client->request[client->request_len] = '\0';
+
+	/*
+	 * Respond at the end of the HTTP request headers, when the request
+	 * doesn't fit in the buffer, or when the client shuts down its side of
+	 * the connection.
+	 */
+	http = client->request_len != 0;
+	if (ret && client->request_len < sizeof(client->request) - 1 &&
+	    !strstr(client->request, "\r\n\r\n") &&
+	    !strstr(client->request, "\n\n"))
+		return;
+
+	if (metrics_client_respond(client, http) < 0)
+		metrics_client_close(client);
+}
+
+/* Disconnect the clients that have been connected for too long. */
+static void metrics_server_timeout(void *d)
+{
+	struct metrics_server *server = d;
+	struct metrics_client *client;
+	uint64_t expirations;
+	uint64_t now;
+
+	if (read(server->timer, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	now = metrics_server_now();
+
+	while (!list_empty(&server->clients)) {
+		client = list_first_entry(&server->clients,
+					  struct metrics_client, list);
+		if (client->deadline > now) {
+			metrics_server_arm_timer(server, client->deadline);
+			break;
+		}
+
+		metrics_client_close(client);
+	}
+}
+
+static void metrics_server_accept(void *d)
+{
+	struct metrics_server *server = d;
+	struct metrics_client *client;
+	int fd;
+
+	while (true) {
+		/*
+		 * Stop accepting connections when the limit is reached, the
+		 * next ones wait in the listen backlog until a client is done.
+		 */
+		if (server->num_clients == METRICS_MAX_CLIENTS) {
+			events_unwatch_fd(server->events, server->fd, EVENT_READ);
+			return;
+		}
+
+		fd = accept4(server->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		client = calloc(1, sizeof(*client));
+		if (!client) {
+			close(fd);
+			continue;
+		}
+
+		client->server = server;
+		client->fd = fd;
+		client->deadline = metrics_server_now()
+				 + METRICS_CLIENT_TIMEOUT * 1000000000ULL;
+
+		if (list_empty(&server->clients))
+			metrics_server_arm_timer(server, client->deadline);
+
+		list_append(&client->list, &server->clients);
+		server->num_clients++;
+
+		events_watch_fd(server->events, fd, EVENT_READ,
+				metrics_client_read, client);
+	}
+}
+
+struct metrics_server *metrics_server_new(struct events *events,
+					  const char *path,
+					  metrics_render_t render, void *data)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct metrics_server *server;
+	struct stat st;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "metrics: socket path too long: %s\n", path);
+		return NULL;
+	}
+
+	strcpy(addr.sun_path, path);
+
+	server = calloc(1, sizeof(*server));
+	if (!server)
+		return NULL;
+
+	server->events = events;
+	server->render = render;
+	server->data = data;
+	server->fd = -1;
+	server->timer = -1;
+	list_init(&server->clients);
+
+	server->path = strdup(path);
+	if (!server->path)
+		goto error;
+
+	server->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (server->timer < 0)
+		goto error_errno;
+
+	server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (server->fd < 0)
+		goto error_errno;
+
+	/* Replace a socket left behind by a previous instance, nothing else. */
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	if (bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(server->fd, METRICS_BACKLOG) < 0)
+		goto error_errno;
+
+	events_watch_fd(events, server->fd, EVENT_READ, metrics_server_accept,
+			server);
+	events_watch_fd(events, server->timer, EVENT_READ,
+			metrics_server_timeout, server);
+
+	printf("Serving metrics on %s\n", path);
+
+	return server;
+
+error_errno:
+	fprintf(stderr, "metrics: unable to listen on %s: %s (%d)\n", path,
+		strerror(errno), errno);
+	if (server->fd >= 0)
+		close(server->fd);
+	if (server->timer >= 0)
+		close(server->timer);
+error:
+	free(server->path);
+	free(server);
+	return NULL;
+}
+
+void metrics_server_delete(struct metrics_server *server)
+{
+	if (!server)
+		return;
+
+	while (!list_empty(&server->clients))
+		metrics_client_close(list_first_entry(&server->clients,
+						      struct metrics_client,
+						      list));
+
+	/* Closing the clients resumed accepting connections if it was paused. */
+	events_unwatch_fd(server->events, server->fd, EVENT_READ);
+	close(server->fd);
+	unlink(server->path);
+
+	events_unwatch_fd(server->events, server->timer, EVENT_READ);
+	close(server->timer);
+
+	free(server->path);
+	free(server);
+}
@@ -5,9 +5,13 @@
  * mjpeg_encoder.cpp - mjpeg video encoder.
  */
 
-#include <chrono>
+#include <algorithm>
 #include <iostream>
 #include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <jpeglib.h>
 
@@ -15,57 +19,257 @@
 
 #include "mjpeg_encoder.hpp"
 
-#if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
-typedef size_t jpeg_mem_len_t;
-#else
-typedef unsigned long jpeg_mem_len_t;
-#endif
+/*
+ * libjpeg destination manager writing straight into the sink buffer. Unlike
+ * jpeg_mem_dest() it never reallocates: once the buffer is full the remainder
+ * of the bitstream is discarded into a small scratch area and the overflow is
+ * flagged, leaving the caller to decide what to do with the frame.
+ */
+struct BoundedDestination
+{
+	struct jpeg_destination_mgr pub;
+	JOCTET *buffer;
+	size_t size;
+	bool overflow;
+	JOCTET scratch[256];
+};
+
+static void bounded_init_destination(j_compress_ptr cinfo)
+{
+	BoundedDestination *dest = reinterpret_cast<BoundedDestination *>(cinfo->dest);
 
-MjpegEncoder::MjpegEncoder()
-	: abortEncode_(false), abortOutput_(false), index_(0)
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = dest->size;
+	dest->overflow = false;
+}
+
+static boolean bounded_empty_output_buffer(j_compress_ptr cinfo)
 {
+	BoundedDestination *dest = reinterpret_cast<BoundedDestination *>(cinfo->dest);
+
+	dest->overflow = true;
+	dest->pub.next_output_byte = dest->scratch;
+	dest->pub.free_in_buffer = sizeof(dest->scratch);
+
+	return TRUE;
+}
+
+static void bounded_term_destination(j_compress_ptr)
+{
+}
+
+static size_t bounded_bytes_used(const BoundedDestination &dest)
+{
+	return dest.overflow ? dest.size : dest.size - dest.pub.free_in_buffer;
+}
+
+static uint64_t monotonic_ns()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Walk the marker segments of the JPEG header in @data and return the offset of
+ * the first segment of type @marker, or 0 if not found before the SOS marker.
+ * When @marker is JPEG_SOS the offset of the entropy-coded data is returned
+ * instead.
+ */
+static size_t jpeg_find_segment(const uint8_t *data, size_t size, uint8_t marker)
+{
+	static const uint8_t JPEG_SOS = 0xda;
+	size_t offset = 2;
+
+	while (offset + 4 <= size && data[offset] == 0xff) {
+		uint8_t type = data[offset + 1];
+		size_t length = (data[offset + 2] << 8) | data[offset + 3];
+
+		if (type == marker)
+			return type == JPEG_SOS ? offset + 2 + length : offset;
+		if (type == JPEG_SOS)
+			break;
+
+		offset += 2 + length;
+	}
+
+	return 0;
+}
+
+MjpegEncoder::MjpegEncoder(const MjpegEncoderConfig &config)
+	: abortEncode_(false), abortOutput_(false), index_(0), config_(config),
+	  overflow_policy_(MjpegOverflowPolicy::Retry), quality_(QUALITY),
+	  overflows_(0),
+	  num_slices_(1), frames_in_flight_(MAX_FRAMES_IN_FLIGHT),
+	  output_index_(0), delivered_index_(0)
+{
+	unsigned int num_threads = config_.threads;
+
+	/*
+	 * Size the pool from the CPUs the threads may run on, leaving some for
+	 * the event loop and libcamera when no affinity has been given.
+	 */
+	if (!num_threads) {
+		if (CPU_COUNT(&config_.cpus)) {
+			num_threads = CPU_COUNT(&config_.cpus);
+		} else {
+			long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+			if (cpus > static_cast<long>(config_.reserved_cpus))
+				num_threads = cpus - config_.reserved_cpus;
+		}
+	}
+
+	num_threads = std::clamp(num_threads, 1U, MAX_ENC_THREADS);
+
+	std::cout << "MJPEG encoder: " << num_threads << " encode threads" << std::endl;
+
 	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i] = std::thread(std::bind(&MjpegEncoder::encodeThread, this, i));
+	for (unsigned int i = 0; i < num_threads; i++)
+		encode_thread_.emplace_back(std::bind(&MjpegEncoder::encodeThread, this, i));
 }
 
 MjpegEncoder::~MjpegEncoder()
 {
-	abortEncode_ = true;
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i].join();
-	abortOutput_ = true;
+	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		abortEncode_ = true;
+	}
+	encode_cond_var_.notify_all();
+	for (auto &thread : encode_thread_)
+		thread.join();
+
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abortOutput_ = true;
+	}
+	output_cond_var_.notify_one();
 	output_thread_.join();
+
+	if (overflows_)
+		std::cerr << "MJPEG encoder: " << overflows_
+			  << " frames overflowed their output buffer" << std::endl;
+}
+
+/*
+ * Apply the CPU affinity and scheduling parameters to the calling encode
+ * thread. Failures are reported but not fatal, real-time priorities in
+ * particular require CAP_SYS_NICE or an RLIMIT_RTPRIO allowance.
+ */
+void MjpegEncoder::setupThread(const char *name)
+{
+	pthread_t thread = pthread_self();
+	int ret;
+
+	pthread_setname_np(thread, name);
+
+	if (CPU_COUNT(&config_.cpus)) {
+		ret = pthread_setaffinity_np(thread, sizeof(config_.cpus), &config_.cpus);
+		if (ret)
+			std::cerr << "MJPEG encoder: failed to set " << name
+				  << " CPU affinity: " << strerror(ret) << std::endl;
+	}
+
+	if (config_.sched_policy != SCHED_OTHER) {
+		struct sched_param param = {};
+
+		param.sched_priority = config_.sched_priority;
+		ret = pthread_setschedparam(thread, config_.sched_policy, &param);
+		if (ret)
+			std::cerr << "MJPEG encoder: failed to set " << name
+				  << " scheduling policy: " << strerror(ret) << std::endl;
+	}
 }
 
 void MjpegEncoder::EncodeBuffer(void *mem, void *dest, unsigned int size,
-				StreamInfo const &info, int64_t timestamp_us,
-				unsigned int cookie)
+				unsigned int dest_size, StreamInfo const &info,
+				int64_t timestamp_us, unsigned int cookie)
 {
 	std::lock_guard<std::mutex> lock(encode_mutex_);
-	EncodeItem item = { mem, dest, size, info, timestamp_us, index_++, cookie };
+	EncodeItem item = { mem, dest, size, dest_size, info, timestamp_us,
+			    index_++, cookie, 0, 1 };
+	unsigned int mcus_per_row = (info.width + MCU_SIZE - 1) / MCU_SIZE;
+	unsigned int mcu_rows = (info.height + MCU_SIZE - 1) / MCU_SIZE;
+	unsigned int num_bands = std::min(num_slices_, mcu_rows);
+	unsigned int band_mcu_rows = mcu_rows;
 
-	encode_queue_.push(item);
-	encode_cond_var_.notify_all();
+	if (num_bands > 1) {
+		band_mcu_rows = (mcu_rows + num_bands - 1) / num_bands;
+		num_bands = (mcu_rows + band_mcu_rows - 1) / band_mcu_rows;
+
+		/* The restart interval is limited to 16 bits. */
+		if (band_mcu_rows * mcus_per_row > 0xffff)
+			num_bands = 1;
+	}
+
+	/*
+	 * The slice state is indexed by frame index, only slice the frame if
+	 * its slot isn't still used by an earlier frame.
+	 */
+	if (item.index - output_index_ >= frames_in_flight_)
+		num_bands = 1;
+
+	if (num_bands > 1) {
+		SliceFrame &frame = slice_frames_[item.index % MAX_FRAMES_IN_FLIGHT];
+
+		frame.num_bands = num_bands;
+		frame.band_rows = band_mcu_rows * MCU_SIZE;
+		frame.restart_interval = band_mcu_rows * mcus_per_row;
+		frame.remaining.store(num_bands, std::memory_order_relaxed);
+		frame.encode_start.store(0, std::memory_order_relaxed);
+		item.num_bands = num_bands;
+	}
+
+	/*
+	 * Each band is queued as a separate item, whole frames as a single one.
+	 * Wake one worker per item, idle workers stay asleep.
+	 */
+	for (unsigned int band = 0; band < item.num_bands; band++) {
+		item.band = band;
+		encode_queue_.push(item);
+		encode_cond_var_.notify_one();
+	}
 }
 
-void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item,
-			      uint8_t *&encoded_buffer, size_t &buffer_len)
+bool MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item,
+			      int quality, size_t &bytes_used)
 {
+	Band band = { 0, item.info.height, 0, static_cast<uint8_t *>(item.dest),
+		      item.dest_size };
+
+	return encodeJPEG(cinfo, item, band, quality, bytes_used);
+}
+
+bool MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item,
+			      const Band &band, int quality, size_t &bytes_used)
+{
+	BoundedDestination dest;
+
 	cinfo.image_width = item.info.width;
-	cinfo.image_height = item.info.height;
+	cinfo.image_height = band.num_rows;
 	cinfo.input_components = 3;
 	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = 0;
 
 	jpeg_set_defaults(&cinfo);
 	cinfo.raw_data_in = TRUE;
-	jpeg_set_quality(&cinfo, 50, TRUE);
+	cinfo.restart_interval = band.restart_interval;
+	jpeg_set_quality(&cinfo, quality, TRUE);
+
+	dest.pub.init_destination = bounded_init_destination;
+	dest.pub.empty_output_buffer = bounded_empty_output_buffer;
+	dest.pub.term_destination = bounded_term_destination;
+	dest.buffer = band.dest;
+	dest.size = band.dest_size;
+	cinfo.dest = &dest.pub;
 
-	jpeg_mem_len_t jpeg_mem_len = buffer_len;
-	jpeg_mem_dest(&cinfo, &encoded_buffer, &jpeg_mem_len);
 	jpeg_start_compress(&cinfo, TRUE);
 
+	/*
+	 * The row pointers are clamped to the bottom of the whole image, not of
+	 * the band. Only the last band can extend past the bottom of the image,
+	 * as the other ones are made of complete MCU rows.
+	 */
 	int stride2 = item.info.stride / 2;
 	uint8_t *Y = (uint8_t *)item.mem;
 	uint8_t *U = (uint8_t *)Y + item.info.stride * item.info.height;
@@ -78,7 +282,10 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 	JSAMPROW u_rows[8];
 	JSAMPROW v_rows[8];
 
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < item.info.height;)
+	for (uint8_t *Y_row = Y + item.info.stride * band.first_row,
+		     *U_row = U + stride2 * (band.first_row / 2),
+		     *V_row = V + stride2 * (band.first_row / 2);
+	     cinfo.next_scanline < band.num_rows;)
 	{
 		for (int i = 0; i < 16; i++, Y_row += item.info.stride)
 			y_rows[i] = std::min(Y_row, Y_max);
@@ -92,8 +299,126 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 	}
 
 	jpeg_finish_compress(&cinfo);
+	cinfo.dest = nullptr;
 
-	buffer_len = jpeg_mem_len;
+	bytes_used = bounded_bytes_used(dest);
+
+	return !dest.overflow;
+}
+
+size_t MjpegEncoder::encodeFrame(struct jpeg_compress_struct &cinfo, EncodeItem &item)
+{
+	int quality = quality_;
+	size_t bytes_used;
+
+	if (encodeJPEG(cinfo, item, quality, bytes_used))
+		return bytes_used;
+
+	overflows_++;
+
+	switch (overflow_policy_) {
+	case MjpegOverflowPolicy::Retry:
+		while (quality / 2 >= MIN_QUALITY) {
+			quality /= 2;
+			if (encodeJPEG(cinfo, item, quality, bytes_used))
+				return bytes_used;
+		}
+		[[fallthrough]];
+
+	case MjpegOverflowPolicy::Truncate: {
+		uint8_t *data = static_cast<uint8_t *>(item.dest);
+
+		if (bytes_used < 2)
+			return 0;
+
+		data[bytes_used - 2] = 0xff;
+		data[bytes_used - 1] = JPEG_EOI;
+		return bytes_used;
+	}
+
+	case MjpegOverflowPolicy::Drop:
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Encode one horizontal band of a frame as a standalone JPEG image whose
+ * restart interval covers the whole band. Bands are written to equal regions
+ * of the destination buffer and stitched together by stitchBands().
+ */
+void MjpegEncoder::encodeBand(struct jpeg_compress_struct &cinfo, EncodeItem &item,
+			      SliceFrame &frame)
+{
+	unsigned int first_row = item.band * frame.band_rows;
+	size_t region_size = item.dest_size / frame.num_bands;
+	Band band = {
+		first_row,
+		std::min(frame.band_rows, item.info.height - first_row),
+		frame.restart_interval,
+		static_cast<uint8_t *>(item.dest) + item.band * region_size,
+		region_size,
+	};
+
+	frame.overflow[item.band] =
+		!encodeJPEG(cinfo, item, band, quality_, frame.bytes_used[item.band]);
+}
+
+/*
+ * Stitch the bands of a frame into a single bitstream. The headers of the first
+ * band are kept, with the image height patched in the frame header. The
+ * restart interval of the bands matches their number of MCUs, so libjpeg wrote
+ * a DRI marker but no RST marker. The entropy-coded data of each following
+ * band is moved after the previous one, separated by the RST marker a decoder
+ * expects at that position. A restart resets the DC predictors and aligns
+ * the bitstream to a byte boundary, which is exactly the state each band has
+ * been encoded from.
+ *
+ * Return the size of the stitched frame, or 0 if it couldn't be stitched.
+ */
+size_t MjpegEncoder::stitchBands(EncodeItem &item, SliceFrame &frame)
+{
+	uint8_t *dest = static_cast<uint8_t *>(item.dest);
+	size_t region_size = item.dest_size / frame.num_bands;
+	size_t offset;
+	size_t sof;
+
+	for (unsigned int i = 0; i < frame.num_bands; i++) {
+		if (frame.overflow[i])
+			return 0;
+	}
+
+	/* Patch the image height in the SOF0 segment of the first band. */
+	sof = jpeg_find_segment(dest, frame.bytes_used[0], 0xc0);
+	if (!sof)
+		return 0;
+
+	dest[sof + 5] = item.info.height >> 8;
+	dest[sof + 6] = item.info.height & 0xff;
+
+	/* Drop the EOI marker of each band and append the next band. */
+	offset = frame.bytes_used[0] - 2;
+
+	for (unsigned int i = 1; i < frame.num_bands; i++) {
+		uint8_t *band = dest + i * region_size;
+		size_t start = jpeg_find_segment(band, frame.bytes_used[i], 0xda);
+		size_t length;
+
+		if (!start || frame.bytes_used[i] < start + 2)
+			return 0;
+
+		length = frame.bytes_used[i] - start - 2;
+
+		dest[offset++] = 0xff;
+		dest[offset++] = JPEG_RST0 + ((i - 1) & 7);
+		memmove(dest + offset, band + start, length);
+		offset += length;
+	}
+
+	dest[offset++] = 0xff;
+	dest[offset++] = JPEG_EOI;
+
+	return offset;
 }
 
 void MjpegEncoder::encodeThread(int num)
@@ -102,6 +427,10 @@ void MjpegEncoder::encodeThread(int num)
 	struct jpeg_error_mgr jerr;
 	EncodeItem encode_item;
 	uint32_t frames = 0;
+	char name[16];
+
+	snprintf(name, sizeof(name), "mjpeg-enc-%d", num);
+	setupThread(name);
 
 	cinfo.err = jpeg_std_error(&jerr);
 	jpeg_create_compress(&cinfo);
@@ -110,29 +439,51 @@ void MjpegEncoder::encodeThread(int num)
 	{
 		{
 			std::unique_lock<std::mutex> lock(encode_mutex_);
-			while (true)
+			encode_cond_var_.wait(lock, [this] {
+				return abortEncode_ || !encode_queue_.empty();
+			});
+
+			if (encode_queue_.empty())
 			{
-				using namespace std::chrono_literals;
-				if (abortEncode_ && encode_queue_.empty())
-				{
-					jpeg_destroy_compress(&cinfo);
-					return;
-				}
-				if (!encode_queue_.empty())
-				{
-					encode_item = encode_queue_.front();
-					encode_queue_.pop();
-					break;
-				}
-				else
-					encode_cond_var_.wait_for(lock, 200ms);
+				jpeg_destroy_compress(&cinfo);
+				return;
 			}
+
+			encode_item = encode_queue_.front();
+			encode_queue_.pop();
 		}
 
-		uint8_t *encoded_buffer = (uint8_t *)encode_item.dest;
-		size_t buffer_len = encode_item.size;
+		uint64_t encode_start = monotonic_ns();
+		size_t bytes_used;
+
+		if (encode_item.num_bands > 1) {
+			SliceFrame &frame = slice_frames_[encode_item.index % MAX_FRAMES_IN_FLIGHT];
+			uint64_t unset = 0;
+
+			/* The frame starts with the first of its bands. */
+			frame.encode_start.compare_exchange_strong(unset, encode_start,
+								   std::memory_order_relaxed);
+
+			encodeBand(cinfo, encode_item, frame);
+
+			/* The last band to complete stitches the frame. */
+			if (frame.remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+				continue;
 
-		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_len);
+			encode_start = frame.encode_start.load(std::memory_order_relaxed);
+
+			bytes_used = stitchBands(encode_item, frame);
+
+			/*
+			 * A band overflowed its share of the buffer, encode the
+			 * whole frame instead and let the overflow policy
+			 * handle it if it still doesn't fit.
+			 */
+			if (!bytes_used)
+				bytes_used = encodeFrame(cinfo, encode_item);
+		} else {
+			bytes_used = encodeFrame(cinfo, encode_item);
+		}
 
 		frames++;
 
@@ -142,68 +493,100 @@ void MjpegEncoder::encodeThread(int num)
 		 *
 		 * We push this encoded buffer to another thread so that our
 		 * application can take its time with the data without blocking
-		 * the encode process.
+		 * the encode process. The output thread only needs waking up
+		 * when this is the frame it is waiting for, frames completed
+		 * ahead of their turn are picked up once their predecessors
+		 * have been delivered.
 		 */
 		OutputItem output_item = {
-			encoded_buffer,
-			buffer_len,
+			encode_item.dest,
+			bytes_used,
 			encode_item.timestamp_us,
 			encode_item.index,
-			encode_item.cookie
+			encode_item.cookie,
+			{ encode_start, monotonic_ns(), 0 },
 		};
-		std::lock_guard<std::mutex> lock(output_mutex_);
-		output_queue_[num].push(output_item);
-		output_cond_var_.notify_one();
+		bool wake;
+
+		{
+			std::unique_lock<std::mutex> lock(output_mutex_);
+			OutputSlot &slot = output_slots_[output_item.index % MAX_FRAMES_IN_FLIGHT];
+
+			/*
+			 * If more than frames_in_flight_ frames have been
+			 * queued, wait for the earlier frames to be delivered.
+			 * They have been dequeued before ours, so they don't
+			 * depend on this thread.
+			 */
+			slot_cond_var_.wait(lock, [this, &output_item] {
+				return output_item.index - output_index_ < frames_in_flight_;
+			});
+
+			slot.item = output_item;
+			slot.ready = true;
+			wake = output_item.index == output_index_;
+		}
+
+		if (wake)
+			output_cond_var_.notify_one();
 	}
 }
 
 void MjpegEncoder::outputThread()
 {
 	OutputItem item;
-	uint64_t index = 0;
+
 	while (true)
 	{
 		{
 			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-
-				/*
-				 * We look for the thread that's completed the
-				 * frame we want next. If we don't find it, we
-				 * wait.
-				 *
-				 * Must also check for an abort signal and if
-				 * set, all queues must be empty. This is done
-				 * first to ensure all frame callbacks have a
-				 * chance to run.
-				 */
-				bool abort = abortOutput_ ? true : false;
-				for (auto &q : output_queue_)
-				{
-					if (abort && !q.empty())
-						abort = false;
-
-					if (!q.empty() && q.front().index == index)
-					{
-						item = q.front();
-						q.pop();
-						goto got_item;
-					}
-				}
-				if (abort)
-					return;
-
-				output_cond_var_.wait_for(lock, 200ms);
-			}
+			OutputSlot &slot = output_slots_[output_index_ % MAX_FRAMES_IN_FLIGHT];
+
+			/*
+			 * Wait for the next frame in sequence. The abort signal
+			 * is only honoured once it has been delivered, the
+			 * encode threads have all been stopped by then so no
+			 * frame is left behind.
+			 */
+			output_cond_var_.wait(lock, [this, &slot] {
+				return slot.ready || abortOutput_;
+			});
+
+			if (!slot.ready)
+				return;
+
+			item = slot.item;
+			slot.ready = false;
+			output_index_++;
+		}
+
+		slot_cond_var_.notify_all();
+
+		item.times.output = monotonic_ns();
+		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us,
+				       item.cookie, item.times);
+
+		{
+			std::lock_guard<std::mutex> lock(output_mutex_);
+			delivered_index_++;
 		}
-	got_item:
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, item.cookie);
-		index++;
+
+		delivered_cond_var_.notify_all();
 	}
 }
 
+void MjpegEncoder::Flush()
+{
+	std::unique_lock<std::mutex> lock(output_mutex_);
+
+	/*
+	 * index_ is only written by the thread queueing frames, i.e. us. Wait
+	 * for the callback to return for the last frame, not only for it to
+	 * be dequeued, so that no cookie is handed back after we return.
+	 */
+	delivered_cond_var_.wait(lock, [this] { return delivered_index_ == index_; });
+}
+
 StreamInfo MjpegEncoder::getStreamInfo(libcamera::Stream *stream)
 {
 	libcamera::StreamConfiguration const &cfg = stream->configuration();
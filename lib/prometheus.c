@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Prometheus text exposition format
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "histogram.h"
+#include "prometheus.h"
+#include "tools.h"
+
+void prometheus_header(FILE *file, const char *name, const char *type,
+		       const char *help)
+{
+	fprintf(file, "# HELP %s %s\n", name, help);
+	fprintf(file, "# TYPE %s %s\n", name, type);
+}
+
+/* Write the metric name and labels of a sample, the caller writes the value. */
+static void prometheus_sample_name(FILE *file, const char *name,
+				   const char *suffix, const char *labels,
+				   const char *extra)
+{
+	bool braces = (labels && *labels) || extra;
+
+	fprintf(file, "%s%s%s%s%s%s%s ", name, suffix,
+		braces ? "{" : "", labels ? labels : "",
+		labels && *labels && extra ? "," : "", extra ? extra : "",
+		braces ? "}" : "");
+}
+
+/* %.17g round-trips doubles, integers are exact up to 2^53. */
+static void prometheus_sample(FILE *file, const char *name, const char *suffix,
+			      const char *labels, const char *extra,
+			      double value)
+{
+	prometheus_sample_name(file, name, suffix, labels, extra);
+	fprintf(file, "%.17g\n", value);
+}
+
+static void prometheus_sample_u64(FILE *file, const char *name,
+				  const char *suffix, const char *labels,
+				  uint64_t value)
+{
+	prometheus_sample_name(file, name, suffix, labels, NULL);
+	fprintf(file, "%" PRIu64 "\n", value);
+}
+
+void prometheus_value(FILE *file, const char *name, const char *labels,
+		      double value)
+{
+	prometheus_sample(file, name, "", labels, NULL, value);
+}
+
+void prometheus_counter(FILE *file, const char *name, const char *labels,
+			uint64_t value)
+{
+	prometheus_sample_u64(file, name, "", labels, value);
+}
+
+void prometheus_summary(FILE *file, const char *name, const char *labels,
+			const struct histogram *hist, double scale)
+{
+	static const struct {
+		const char *label;
+		double percentile;
+	} quantiles[] = {
+		{ "quantile=\"0.5\"", 50 },
+		{ "quantile=\"0.9\"", 90 },
+		{ "quantile=\"0.99\"", 99 },
+		{ "quantile=\"0.999\"", 99.9 },
+	};
+	struct histogram *snap;
+	unsigned int i;
+
+	snap = malloc(sizeof(*snap));
+	if (!snap)
+		return;
+
+	histogram_snapshot(hist, snap);
+
+	for (i = 0; i < ARRAY_SIZE(quantiles); ++i)
+		prometheus_sample(file, name, "", labels, quantiles[i].label,
+				  histogram_percentile(snap, quantiles[i].percentile) * scale);
+
+	prometheus_sample(file, name, "_sum", labels, NULL, snap->sum * scale);
+	prometheus_sample_u64(file, name, "_count", labels, snap->count);
+
+	free(snap);
+}
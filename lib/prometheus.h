@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Prometheus text exposition format
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+#ifndef __PROMETHEUS_H__
+#define __PROMETHEUS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct histogram;
+
+/*
+ * prometheus_header - Write the HELP and TYPE lines of a metric family
+ * @file: output file
+ * @name: metric name
+ * @type: "counter", "gauge" or "summary"
+ * @help: description of the metric
+ */
+void prometheus_header(FILE *file, const char *name, const char *type,
+		       const char *help);
+
+/*
+ * prometheus_value - Write a sample
+ * @file: output file
+ * @name: metric name
+ * @labels: comma-separated labels without braces, or NULL
+ * @value: sample value
+ */
+void prometheus_value(FILE *file, const char *name, const char *labels,
+		      double value);
+
+/*
+ * prometheus_counter - Write a counter sample
+ * @file: output file
+ * @name: metric name
+ * @labels: comma-separated labels without braces, or NULL
+ * @value: sample value
+ *
+ * Counters are written as integers, to keep them exact past the precision of a
+ * double.
+ */
+void prometheus_counter(FILE *file, const char *name, const char *labels,
+			uint64_t value);
+
+/*
+ * prometheus_summary - Write the quantiles, sum and count of a histogram
+ * @file: output file
+ * @name: metric name
+ * @labels: comma-separated labels without braces, or NULL
+ * @hist: the histogram, read with histogram_snapshot()
+ * @scale: factor applied to the histogram values, to convert them to the
+ *	metric unit
+ */
+void prometheus_summary(FILE *file, const char *name, const char *labels,
+			const struct histogram *hist, double scale);
+
+#endif /* __PROMETHEUS_H__ */
@@ -10,6 +10,8 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,15 +26,39 @@
 
 #include "events.h"
 #include "list.h"
+#include "log.h"
 #include "slideshow-source.h"
 #include "timer.h"
 #include "tools.h"
 #include "video-buffers.h"
 
+UVC_LOG_MODULE(slideshow);
+
+/*
+ * Slides are loaded on demand by a prefetch thread that reads the
+ * SLIDESHOW_PREFETCH slides starting at the current one. At most
+ * SLIDESHOW_CACHE_SIZE slides are kept in memory, the least recently used one
+ * is evicted to make room for a new one.
+ */
+#define SLIDESHOW_CACHE_SIZE	8
+#define SLIDESHOW_PREFETCH	4
+
+/*
+ * struct slide - A slideshow image
+ * @list: entry in the slideshow_source slides list
+ * @lru: entry in the slideshow_source cache list, when @imgdata is cached
+ * @path: file name, NULL for the dummy slide that is never evicted
+ * @imgsize: image size in bytes, valid once the image has been loaded
+ * @imgdata: image data, NULL when not cached
+ * @broken: the image couldn't be read
+ */
 struct slide {
 	struct list_entry list;
+	struct list_entry lru;
+	char *path;
 	unsigned int imgsize;
 	void *imgdata;
+	bool broken;
 };
 
 struct slideshow_source {
@@ -41,24 +67,78 @@ struct slideshow_source {
 	char img_dir[NAME_MAX];
 
 	struct slide *cur_slide;
+	struct slide *last_slide;
 	struct list_entry slides;
 
+	/* Slide currently held by each sink buffer, by index. */
+	struct slide *buffer_slides[VIDEO_MAX_FRAME];
+
+	/* Sink buffers waiting for the next timer expiration, in FIFO order. */
+	struct video_buffer pending[VIDEO_MAX_FRAME];
+	unsigned int pending_first;
+	unsigned int pending_count;
+
 	struct timer *timer;
+	uint64_t missed;
 	bool streaming;
+
+	/*
+	 * The lock protects cur_slide, last_slide and the image data of the
+	 * slides, the list of slides only changes when the prefetch thread
+	 * isn't running. Only the prefetch thread reads the slides from disk.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t prefetch_thread;
+	bool prefetching;
+	bool prefetch_stop;
+
+	/* Cached slides, least recently used first. */
+	struct list_entry cache;
+	unsigned int cached;
 };
 
 #define to_slideshow_source(s) container_of(s, struct slideshow_source, src)
 
-static void slideshow_source_destroy(struct video_source *s)
+static void slideshow_source_free_slides(struct slideshow_source *src)
 {
-	struct slideshow_source *src = to_slideshow_source(s);
 	struct slide *slide, *next;
 
 	list_for_each_entry_safe(slide, next, &src->slides, list) {
 		list_remove(&slide->list);
 		free(slide->imgdata);
+		free(slide->path);
 		free(slide);
 	}
+
+	list_init(&src->cache);
+	src->cached = 0;
+	src->cur_slide = NULL;
+	src->last_slide = NULL;
+}
+
+static void slideshow_source_stop_prefetch(struct slideshow_source *src)
+{
+	if (!src->prefetching)
+		return;
+
+	pthread_mutex_lock(&src->lock);
+	src->prefetch_stop = true;
+	pthread_cond_signal(&src->cond);
+	pthread_mutex_unlock(&src->lock);
+
+	pthread_join(src->prefetch_thread, NULL);
+	src->prefetching = false;
+}
+
+static void slideshow_source_destroy(struct video_source *s)
+{
+	struct slideshow_source *src = to_slideshow_source(s);
+
+	slideshow_source_stop_prefetch(src);
+	slideshow_source_free_slides(src);
+	pthread_cond_destroy(&src->cond);
+	pthread_mutex_destroy(&src->lock);
 	timer_destroy(src->timer);
 	free(src);
 }
@@ -87,6 +167,177 @@ static int filter_slides(const struct dirent *entry) {
     );
 }
 
+/*
+ * Read a whole image file. Returns the image data, to be freed with free(), or
+ * NULL on error.
+ */
+static void *slideshow_source_load(const char *path, unsigned int *size)
+{
+	struct stat st;
+	size_t done = 0;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_error("Unable to open file '%s': %s (%d)\n", path,
+			  strerror(errno), errno);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		log_error("failed to stat %s: %s (%d)\n", path,
+			  strerror(errno), errno);
+		goto err_close_fd;
+	}
+
+	/* An empty buffer would be sent with its full length. */
+	if (!st.st_size) {
+		log_error("image %s is empty\n", path);
+		goto err_close_fd;
+	}
+
+	data = malloc(st.st_size);
+	if (!data) {
+		log_error("failed to allocate memory for image\n");
+		goto err_close_fd;
+	}
+
+	while (done < (size_t)st.st_size) {
+		ssize_t ret = read(fd, data + done, st.st_size - done);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			log_error("failed to read from %s: %d\n", path,
+				  ret ? errno : EIO);
+			free(data);
+			goto err_close_fd;
+		}
+
+		done += ret;
+	}
+
+	close(fd);
+
+	*size = done;
+	return data;
+
+err_close_fd:
+	close(fd);
+	return NULL;
+}
+
+/* Must be called with the lock held. */
+static void slideshow_source_cache_insert(struct slideshow_source *src,
+					  struct slide *slide, void *data,
+					  unsigned int size)
+{
+	struct slide *old;
+
+	/* The slide may have been loaded by the other thread meanwhile. */
+	if (slide->imgdata) {
+		free(data);
+		return;
+	}
+
+	if (src->cached == SLIDESHOW_CACHE_SIZE) {
+		old = list_first_entry(&src->cache, struct slide, lru);
+		list_remove(&old->lru);
+		free(old->imgdata);
+		old->imgdata = NULL;
+		src->cached--;
+	}
+
+	slide->imgdata = data;
+	slide->imgsize = size;
+	list_append(&slide->lru, &src->cache);
+	src->cached++;
+}
+
+/* Must be called with the lock held. */
+static struct slide *slideshow_source_next(struct slideshow_source *src,
+					   struct slide *slide)
+{
+	if (slide == list_last_entry(&src->slides, struct slide, list))
+		return list_first_entry(&src->slides, struct slide, list);
+	else
+		return list_next_entry(&slide->list, struct slide, list);
+}
+
+/*
+ * Find the first slide of the prefetch window that needs to be loaded. Must be
+ * called with the lock held.
+ */
+static struct slide *slideshow_source_next_missing(struct slideshow_source *src)
+{
+	struct slide *slide = src->cur_slide;
+	unsigned int i;
+
+	for (i = 0; i < SLIDESHOW_PREFETCH; ++i) {
+		if (!slide->imgdata && !slide->broken)
+			return slide;
+
+		slide = slideshow_source_next(src, slide);
+		if (slide == src->cur_slide)
+			break;
+	}
+
+	return NULL;
+}
+
+static void *slideshow_source_prefetch(void *arg)
+{
+	struct slideshow_source *src = arg;
+
+	pthread_mutex_lock(&src->lock);
+
+	while (!src->prefetch_stop) {
+		struct slide *slide;
+		unsigned int size;
+		void *data;
+
+		slide = slideshow_source_next_missing(src);
+		if (!slide) {
+			pthread_cond_wait(&src->cond, &src->lock);
+			continue;
+		}
+
+		/* Read the file without holding the lock. */
+		pthread_mutex_unlock(&src->lock);
+		data = slideshow_source_load(slide->path, &size);
+		pthread_mutex_lock(&src->lock);
+
+		if (data)
+			slideshow_source_cache_insert(src, slide, data, size);
+		else
+			slide->broken = true;
+	}
+
+	pthread_mutex_unlock(&src->lock);
+
+	return NULL;
+}
+
+static int slideshow_source_start_prefetch(struct slideshow_source *src)
+{
+	int ret;
+
+	src->prefetch_stop = false;
+
+	ret = pthread_create(&src->prefetch_thread, NULL,
+			     slideshow_source_prefetch, src);
+	if (ret) {
+		log_error("failed to start prefetch thread: %s (%d)\n",
+			  strerror(ret), ret);
+		return -ret;
+	}
+
+	src->prefetching = true;
+
+	return 0;
+}
+
 /*
  * slideshow_source_set_format - set the V4L2 format
  *
@@ -123,140 +374,90 @@ static int slideshow_source_set_format(struct video_source *s,
 {
 	struct slideshow_source *src = to_slideshow_source(s);
 	char dirname[PATH_MAX];
-	struct slide *slide, *next;
 	struct dirent **dir_files;
-	struct dirent *file;
+	struct slide *slide;
 	char fourcc_buf[8];
-	int fd = -1;
-	int i = 0;
-	char *cwd;
-	DIR *dir;
-	int ret;
+	int ret = 0;
+	int i;
 	int n;
 
 	/*
 	 * If the format is changed, we need to clear the existing list of
 	 * slides before adding new ones.
 	 */
-	list_for_each_entry_safe(slide, next, &src->slides, list) {
-		list_remove(&slide->list);
-		free(slide->imgdata);
-		free(slide);
-	}
+	slideshow_source_stop_prefetch(src);
+	slideshow_source_free_slides(src);
+	memset(src->buffer_slides, 0, sizeof(src->buffer_slides));
 
 	ret = snprintf(dirname, sizeof(dirname), "%s/%s/%ux%u", src->img_dir,
 		       v4l2_fourcc2s(fmt->pixelformat, fourcc_buf),
 		       fmt->width, fmt->height);
-	if (ret < 0) {
-		fprintf(stderr, "failed to store directory name: %s (%d)\n",
-			strerror(ret), ret);
-		ret = errno;
+	if (ret < 0 || ret >= (int)sizeof(dirname)) {
+		log_error("failed to store directory name\n");
+		ret = -ENAMETOOLONG;
 		goto err_dummy_slide;
 	}
 
-	dir = opendir(dirname);
-	if (!dir) {
-		fprintf(stderr, "unable to find directory %s\n", dirname);
+	/*
+	 * Only list the slides here, their content is loaded by the prefetch
+	 * thread, so that the time to the first frame and the memory usage
+	 * don't depend on the number of slides.
+	 */
+	n = scandir(dirname, &dir_files, filter_slides, alphasort);
+	if (n < 0) {
+		log_error("unable to find directory %s\n", dirname);
 		ret = -ENOENT;
 		goto err_dummy_slide;
 	}
 
-	cwd = getcwd(NULL, 0);
-	if (!cwd) {
-		fprintf(stderr, "unable to allocate memory for cwd name\n");
-		ret = -ENOMEM;
-		goto err_dummy_slide;
-	}
-
-	ret = chdir(dirname);
-	if (ret) {
-		fprintf(stderr, "unable to cd to directory '%s': %s (%d)\n",
-			dirname, strerror(ret), ret);
-		goto err_close_dir;
-	}
-
-	n = scandir(dirname, &dir_files, filter_slides, alphasort);
-	if (n < 0) {
-		perror("scandir");
-		goto err_close_dir;
-	}
+	ret = 0;
 
 	for (i = 0; i < n; i++) {
-		file = dir_files[i];
-
-		fd = open(file->d_name, O_RDONLY);
-		if (fd == -1) {
-			fprintf(stderr, "Unable to open file '%s/%s'\n", dirname,
-				file->d_name);
-			ret = errno;
-			goto err_unwind;
+		size_t len = strlen(dirname) + strlen(dir_files[i]->d_name) + 2;
+
+		if (!ret) {
+			slide = calloc(1, sizeof(*slide));
+			if (slide)
+				slide->path = malloc(len);
+
+			if (!slide || !slide->path) {
+				log_error("failed to allocate memory for slide\n");
+				free(slide);
+				ret = -ENOMEM;
+			} else {
+				snprintf(slide->path, len, "%s/%s", dirname,
+					 dir_files[i]->d_name);
+				list_append(&slide->list, &src->slides);
+			}
 		}
 
-		slide = malloc(sizeof(*slide));
-		if (!slide) {
-			fprintf(stderr, "failed to allocate memory for slide\n");
-			ret = -ENOMEM;
-			goto err_close_fd;
-		}
-
-		slide->imgsize = lseek(fd, 0, SEEK_END);
-		lseek(fd, 0, SEEK_SET);
-
-		slide->imgdata = malloc(slide->imgsize);
-		if (!slide->imgdata) {
-			fprintf(stderr, "failed to allocate memory for image\n");
-			ret = -ENOMEM;
-			goto err_free_slide;
-		}
+		free(dir_files[i]);
+	}
 
-		ret = read(fd, slide->imgdata, slide->imgsize);
-		if (ret < 0) {
-			fprintf(stderr, "failed to read from %s/%s: %u\n",
-				dirname, file->d_name, errno);
-			ret = errno;
-			goto err_free_imgdata;
-		}
+	free(dir_files);
 
-		list_append(&slide->list, &src->slides);
-		close(fd);
-	}
+	if (ret)
+		goto err_free_slides;
 
 	if (list_empty(&src->slides)) {
-		fprintf(stderr, "failed to find any images in %s\n", dirname);
+		log_error("failed to find any images in %s\n", dirname);
 		ret = -ENOENT;
-		goto err_free_cwd;
+		goto err_dummy_slide;
 	}
 
-	ret = chdir(cwd);
-	if (ret) {
-		fprintf(stderr, "unable to cd to directory '%s': %s (%d)\n",
-			cwd, strerror(ret), ret);
-		goto err_free_cwd;
-	}
+	log_info("slideshow-source: %u slides in %s\n", n, dirname);
 
-	free(cwd);
-	closedir(dir);
 	src->cur_slide = list_first_entry(&src->slides, struct slide, list);
 
+	/* Without the prefetch thread the slides would never be loaded. */
+	ret = slideshow_source_start_prefetch(src);
+	if (ret)
+		goto err_free_slides;
+
 	return 0;
 
-err_free_imgdata:
-	free(slide->imgdata);
-err_free_slide:
-	free(slide);
-err_close_fd:
-	close(fd);
-err_unwind:
-	list_for_each_entry_safe(slide, next, &src->slides, list) {
-		list_remove(&slide->list);
-		free(slide->imgdata);
-		free(slide);
-	}
-err_free_cwd:
-	chdir(cwd);
-	free(cwd);
-err_close_dir:
-	closedir(dir);
+err_free_slides:
+	slideshow_source_free_slides(src);
 err_dummy_slide:
 
 	/*
@@ -267,11 +468,11 @@ err_dummy_slide:
 	* memory for it at least.
 	*/
 
-	printf("using dummy slideshow data\n");
+	log_info("using dummy slideshow data\n");
 
-	slide = malloc(sizeof(*slide));
+	slide = calloc(1, sizeof(*slide));
 	if (!slide) {
-		fprintf(stderr, "failed to allocate memory for slide\n");
+		log_error("failed to allocate memory for slide\n");
 		return ret;
 	}
 
@@ -279,7 +480,7 @@ err_dummy_slide:
 
 	slide->imgdata = malloc(slide->imgsize);
 	if (!slide->imgdata) {
-		fprintf(stderr, "failed to allocate memory for image\n");
+		log_error("failed to allocate memory for image\n");
 		free(slide);
 		return -ENOMEM;
 	}
@@ -292,17 +493,166 @@ err_dummy_slide:
 }
 
 static int slideshow_source_set_frame_rate(struct video_source *s,
-					   unsigned int fps)
+					   unsigned int interval)
 {
 	struct slideshow_source *src = to_slideshow_source(s);
 
-	timer_set_fps(src->timer, fps);
+	timer_set_interval(src->timer, interval);
 
 	return 0;
 }
 
-static int slideshow_source_free_buffers(struct video_source *s __attribute__((unused)))
+static int slideshow_source_free_buffers(struct video_source *s)
 {
+	struct slideshow_source *src = to_slideshow_source(s);
+
+	memset(src->buffer_slides, 0, sizeof(src->buffer_slides));
+
+	return 0;
+}
+
+/*
+ * Move to the next slide, skipping the ones that couldn't be read. Must be
+ * called with the lock held.
+ */
+static void slideshow_source_next_slide(struct slideshow_source *src)
+{
+	struct slide *slide = src->cur_slide;
+
+	do {
+		slide = slideshow_source_next(src, slide);
+	} while (slide->broken && slide != src->cur_slide);
+
+	src->cur_slide = slide;
+
+	/* Move the prefetch window. */
+	pthread_cond_signal(&src->cond);
+}
+
+/*
+ * Fill the buffer with the current slide and move to the next one. Slides are
+ * only read by the prefetch thread, if it fell behind the previous slide is
+ * sent again and the current one is tried again for the next frame. Return
+ * false if there's no slide to send yet.
+ */
+static bool slideshow_source_fill(struct slideshow_source *src,
+				  struct video_buffer *buf)
+{
+	struct slide *slide;
+	bool advance = true;
+	unsigned int size;
+
+	pthread_mutex_lock(&src->lock);
+
+	/* The current slide may have turned out to be broken when loaded. */
+	if (src->cur_slide->broken)
+		slideshow_source_next_slide(src);
+
+	slide = src->cur_slide;
+
+	if (!slide->imgdata) {
+		slide = src->last_slide;
+		if (!slide || !slide->imgdata) {
+			pthread_mutex_unlock(&src->lock);
+			return false;
+		}
+
+		advance = false;
+	}
+
+	/*
+	 * Sink buffers keep their content until they are freed, only copy the
+	 * slide if the buffer holds a different one.
+	 */
+	if (buf->index >= VIDEO_MAX_FRAME ||
+	    src->buffer_slides[buf->index] != slide) {
+		/*
+		 * Nothing currently stops the user from providing a source file
+		 * which is larger than the buffer size calculated from the
+		 * format we have set. Clamp the size of the buffer we copy to
+		 * be sure we don't overflow the buffer we was allocated to
+		 * receive it.
+		 */
+		size = min(slide->imgsize, buf->size);
+		memcpy(buf->mem, slide->imgdata, size);
+		if (buf->index < VIDEO_MAX_FRAME)
+			src->buffer_slides[buf->index] = slide;
+	}
+
+	buf->bytesused = min(slide->imgsize, buf->size);
+
+	/* Keep the slide most recently used. */
+	if (slide->path) {
+		list_remove(&slide->lru);
+		list_append(&slide->lru, &src->cache);
+	}
+
+	src->last_slide = slide;
+
+	if (advance)
+		slideshow_source_next_slide(src);
+
+	pthread_mutex_unlock(&src->lock);
+
+	return true;
+}
+
+/*
+ * Fill and hand over one pending buffer per timer expiration, so that the
+ * configured frame rate is adhered to without blocking the event loop. If
+ * expirations have been missed, the corresponding frames are skipped instead of
+ * being sent late.
+ */
+static void slideshow_source_timer_expired(void *d)
+{
+	struct slideshow_source *src = d;
+	struct video_buffer *buf;
+	uint64_t expirations;
+
+	expirations = timer_expirations(src->timer);
+	if (!expirations)
+		return;
+
+	if (expirations > 1) {
+		src->missed += expirations - 1;
+		log_warning_ratelimited("slideshow-source: missed %" PRIu64
+					" frame(s), %" PRIu64 " in total\n",
+					expirations - 1, src->missed);
+
+		/* Keep the slideshow in step with time. */
+		pthread_mutex_lock(&src->lock);
+		while (--expirations)
+			slideshow_source_next_slide(src);
+		pthread_mutex_unlock(&src->lock);
+	}
+
+	if (!src->pending_count)
+		return;
+
+	/* Keep the buffer pending if there's no slide to send yet. */
+	buf = &src->pending[src->pending_first];
+	if (!slideshow_source_fill(src, buf))
+		return;
+
+	src->pending_first = (src->pending_first + 1) % VIDEO_MAX_FRAME;
+	src->pending_count--;
+
+	src->src.handler(src->src.handler_data, &src->src, buf);
+}
+
+static int slideshow_source_queue_buffer(struct video_source *s,
+					 struct video_buffer *buf)
+{
+	struct slideshow_source *src = to_slideshow_source(s);
+	unsigned int index;
+
+	if (src->pending_count == VIDEO_MAX_FRAME)
+		return -EBUSY;
+
+	index = (src->pending_first + src->pending_count) % VIDEO_MAX_FRAME;
+	src->pending[index] = *buf;
+	src->pending_count++;
+
 	return 0;
 }
 
@@ -311,10 +661,16 @@ static int slideshow_source_stream_on(struct video_source *s)
 	struct slideshow_source *src = to_slideshow_source(s);
 	int ret;
 
+	src->pending_first = 0;
+	src->pending_count = 0;
+
 	ret = timer_arm(src->timer);
 	if (ret)
 		return ret;
 
+	events_watch_fd(src->src.events, timer_fd(src->timer), EVENT_READ,
+			slideshow_source_timer_expired, src);
+
 	src->streaming = true;
 	return 0;
 }
@@ -327,39 +683,21 @@ static int slideshow_source_stream_off(struct video_source *s)
 	 * No error check here, because we want to flag that streaming is over
 	 * even if the timer is still running due to the failure.
 	 */
+	events_unwatch_fd(src->src.events, timer_fd(src->timer), EVENT_READ);
 	timer_disarm(src->timer);
 	src->streaming = false;
+	src->pending_count = 0;
 
 	return 0;
 }
 
-static void slideshow_source_fill_buffer(struct video_source *s,
-					 struct video_buffer *buf)
+static void slideshow_source_get_stats(struct video_source *s,
+				       struct video_source_stats *stats)
 {
 	struct slideshow_source *src = to_slideshow_source(s);
-	unsigned int size;
-
-	/*
-	 * Nothing currently stops the user from providing a source file which is
-	 * larger than the buffer size calculated from the format we have set.
-	 * Clamp the size of the buffer we copy to be sure we don't overflow the
-	 * buffer we was allocated to receive it.
-	 */
-	size = min(src->cur_slide->imgsize, buf->size);
-	memcpy(buf->mem, src->cur_slide->imgdata, size);
-	buf->bytesused = size;
-
-	if (src->cur_slide == list_last_entry(&src->slides, struct slide, list))
-		src->cur_slide = list_first_entry(&src->slides, struct slide, list);
-	else
-		src->cur_slide = list_next_entry(&src->cur_slide->list, struct slide, list);
 
-	/*
-	 * Wait for the timer to elapse to ensure that our configured frame rate
-	 * is adhered to.
-	 */
-	if (src->streaming)
-		timer_wait(src->timer);
+	stats->queued = src->pending_count;
+	stats->dropped = src->missed;
 }
 
 static const struct video_source_ops slideshow_source_ops = {
@@ -369,8 +707,8 @@ static const struct video_source_ops slideshow_source_ops = {
 	.free_buffers = slideshow_source_free_buffers,
 	.stream_on = slideshow_source_stream_on,
 	.stream_off = slideshow_source_stream_off,
-	.queue_buffer = NULL,
-	.fill_buffer = slideshow_source_fill_buffer,
+	.queue_buffer = slideshow_source_queue_buffer,
+	.get_stats = slideshow_source_get_stats,
 };
 
 struct video_source *slideshow_video_source_create(const char *img_dir)
@@ -398,6 +736,9 @@ struct video_source *slideshow_video_source_create(const char *img_dir)
 		goto err_free_src;
 
 	list_init(&src->slides);
+	list_init(&src->cache);
+	pthread_mutex_init(&src->lock, NULL);
+	pthread_cond_init(&src->cond, NULL);
 
 	return &src->src;
 
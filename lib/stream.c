@@ -8,123 +8,276 @@
  */
 
 #include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include <linux/videodev2.h>
 
 #include "events.h"
+#include "host-emulator.h"
+#include "latency.h"
+#include "log.h"
+#include "prometheus.h"
 #include "stream.h"
+#include "tools.h"
 #include "uvc.h"
-#include "v4l2.h"
 #include "video-buffers.h"
+#include "video-sink.h"
 #include "video-source.h"
 
+UVC_LOG_MODULE(stream);
+
 /*
  * struct uvc_stream - Representation of a UVC stream
  * @src: video source
- * @uvc: UVC V4L2 output device
+ * @sink: video sink, the UVC V4L2 output device unless overridden
+ * @sink_buffers: buffers allocated and mapped by the sink, NULL if the sink
+ *	imports its buffers from the source
+ * @uvc: UVC device, NULL for streams without a UDC
  * @events: struct events containing event information
+ * @nbufs: number of buffers to allocate when starting the stream
+ * @format: format the buffers have been allocated for
+ * @allocated: whether the source and sink buffers are allocated
+ * @streaming: whether the stream is running
+ * @idle_timeout: delay in ms before the buffers of a stopped stream are freed
+ * @idle_timer: timerfd implementing @idle_timeout, -1 if not created yet
+ * @frames: pipeline stage time stamps and size of the buffers queued to the
+ *	sink, by index, as sinks don't preserve them
+ * @latency: per-stage latency of the frames that went through the sink
+ * @frame_bytes: size of the frames that went through the sink
+ * @stats: counters exported by uvc_stream_write_metrics()
+ * @stats.frames_in: frames produced by the source
+ * @stats.frames_out: frames the sink has completed successfully
+ * @stats.frames_dropped: frames the sink has completed with an error
+ * @stats.bytes_out: payload bytes of @stats.frames_out
+ * @stats.sink_queued: number of buffers currently queued to the sink
+ * @stats.sink_underruns: times the sink ran out of buffers while streaming
+ * @stats.starts: stream starts, including restarts
+ * @stats.restarts: stream starts that reused the allocated buffers
  */
 struct uvc_stream
 {
 	struct video_source *src;
+	struct video_sink *sink;
+	struct video_buffer_set *sink_buffers;
 	struct uvc_device *uvc;
 
 	struct events *events;
+
+	unsigned int nbufs;
+
+	struct v4l2_pix_format format;
+	bool allocated;
+	bool streaming;
+	unsigned int idle_timeout;
+	int idle_timer;
+
+	struct {
+		uint64_t stamps[VIDEO_BUFFER_NUM_STAGES];
+		unsigned int bytesused;
+	} frames[VIDEO_MAX_FRAME];
+	struct frame_latency latency;
+	struct histogram frame_bytes;
+
+	struct {
+		uint64_t frames_in;
+		uint64_t frames_out;
+		uint64_t frames_dropped;
+		uint64_t bytes_out;
+		unsigned int sink_queued;
+		uint64_t sink_underruns;
+		uint64_t starts;
+		uint64_t restarts;
+	} stats;
 };
 
 /* ---------------------------------------------------------------------------
  * Video streaming
  */
 
-static void uvc_stream_source_process(void *d,
-				      struct video_source *src __attribute__((unused)),
-				      struct video_buffer *buffer)
+static int uvc_stream_queue_sink(struct uvc_stream *stream,
+				 struct video_buffer *buf)
+{
+	int ret;
+
+	video_buffer_stamp(buf, VIDEO_BUFFER_STAGE_SINK_QUEUE);
+
+	if (buf->index < VIDEO_MAX_FRAME) {
+		memcpy(stream->frames[buf->index].stamps, buf->stamps,
+		       sizeof(buf->stamps));
+		stream->frames[buf->index].bytesused = buf->bytesused;
+	}
+
+	stream->stats.frames_in++;
+
+	ret = video_sink_queue_buffer(stream->sink, buf);
+	if (!ret)
+		stream->stats.sink_queued++;
+
+	return ret;
+}
+
+/*
+ * Account the statistics and latency of a frame the sink is done with, and
+ * clear the stamps before the buffer is reused.
+ */
+static void uvc_stream_sink_done(struct uvc_stream *stream,
+				 struct video_buffer *buf)
+{
+	unsigned int bytesused;
+
+	if (stream->stats.sink_queued && !--stream->stats.sink_queued &&
+	    stream->streaming)
+		stream->stats.sink_underruns++;
+
+	video_buffer_clear_stamps(buf);
+
+	if (buf->index >= VIDEO_MAX_FRAME)
+		return;
+
+	memcpy(buf->stamps, stream->frames[buf->index].stamps,
+	       sizeof(buf->stamps));
+	bytesused = stream->frames[buf->index].bytesused;
+	memset(&stream->frames[buf->index], 0, sizeof(stream->frames[0]));
+
+	if (!buf->stamps[VIDEO_BUFFER_STAGE_SINK_QUEUE])
+		return;
+
+	if (buf->error) {
+		stream->stats.frames_dropped++;
+	} else {
+		stream->stats.frames_out++;
+		stream->stats.bytes_out += bytesused;
+		histogram_record(&stream->frame_bytes, bytesused);
+
+		video_buffer_stamp(buf, VIDEO_BUFFER_STAGE_SINK_DEQUEUE);
+		frame_latency_record(&stream->latency, buf->stamps);
+	}
+
+	video_buffer_clear_stamps(buf);
+}
+
+static void uvc_stream_sink_process(void *d,
+				    struct video_sink *sink __attribute__((unused)),
+				    struct video_buffer *buf)
 {
 	struct uvc_stream *stream = d;
-	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
 
-	v4l2_queue_buffer(sink, buffer);
+	uvc_stream_sink_done(stream, buf);
+	video_source_queue_buffer(stream->src, buf);
+}
+
+/*
+ * Static sources have no capture time, time stamp their frames when they're
+ * generated.
+ */
+static void uvc_stream_timestamp(struct video_buffer *buf)
+{
+	uint64_t now = video_buffer_clock();
+
+	buf->timestamp.tv_sec = now / 1000000000;
+	buf->timestamp.tv_usec = now / 1000 % 1000000;
+	buf->stamps[VIDEO_BUFFER_STAGE_CAPTURE] = now;
 }
 
-static void uvc_stream_uvc_process(void *d)
+static void uvc_stream_source_process(void *d,
+				      struct video_source *src __attribute__((unused)),
+				      struct video_buffer *buffer)
 {
 	struct uvc_stream *stream = d;
-	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
-	struct video_buffer buf;
-	int ret;
 
-	ret = v4l2_dequeue_buffer(sink, &buf);
-	if (ret < 0)
-		return;
+	if (stream->src->type == VIDEO_SOURCE_STATIC)
+		uvc_stream_timestamp(buffer);
 
-	video_source_queue_buffer(stream->src, &buf);
+	uvc_stream_queue_sink(stream, buffer);
 }
 
-static void uvc_stream_uvc_process_no_buf(void *d)
+static void uvc_stream_sink_process_no_buf(void *d,
+					   struct video_sink *sink __attribute__((unused)),
+					   struct video_buffer *buf)
 {
 	struct uvc_stream *stream = d;
-	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
-	struct video_buffer buf;
-	int ret;
 
-	ret = v4l2_dequeue_buffer(sink, &buf);
-	if (ret < 0)
+	uvc_stream_sink_done(stream, buf);
+
+	/*
+	 * Sources that pace their frames take the buffer and hand it back
+	 * through the buffer handler when it's due, the others fill it right
+	 * away.
+	 */
+	if (stream->src->ops->queue_buffer) {
+		video_source_queue_buffer(stream->src, buf);
 		return;
+	}
 
-	video_source_fill_buffer(stream->src, &buf);
+	video_source_fill_buffer(stream->src, buf);
+	uvc_stream_timestamp(buf);
 
-	v4l2_queue_buffer(sink, &buf);
+	uvc_stream_queue_sink(stream, buf);
 }
 
+/*
+ * Start the source and sink with buffers already allocated, either right after
+ * allocating them or to restart a stream that has been stopped without
+ * freeing them.
+ */
+static void uvc_stream_resume(struct uvc_stream *stream)
+{
+	video_sink_set_buffer_handler(stream->sink, uvc_stream_sink_process,
+				      stream);
+
+	video_source_stream_on(stream->src);
+	video_sink_stream_on(stream->sink);
+}
 
 static int uvc_stream_start_alloc(struct uvc_stream *stream)
 {
-	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
 	struct video_buffer_set *buffers = NULL;
 	int ret;
 
 	/* Allocate and export the buffers on the source. */
-	ret = video_source_alloc_buffers(stream->src, 4);
+	ret = video_source_alloc_buffers(stream->src, stream->nbufs);
 	if (ret < 0) {
-		printf("Failed to allocate source buffers: %s (%d)\n",
-		       strerror(-ret), -ret);
+		log_error("Failed to allocate source buffers: %s (%d)\n",
+			  strerror(-ret), -ret);
 		return ret;
 	}
 
 	ret = video_source_export_buffers(stream->src, &buffers);
 	if (ret < 0) {
-		printf("Failed to export buffers on source: %s (%d)\n",
-		       strerror(-ret), -ret);
+		log_error("Failed to export buffers on source: %s (%d)\n",
+			  strerror(-ret), -ret);
 		goto error_free_source;
 	}
 
 	/* Allocate and import the buffers on the sink. */
-	ret = v4l2_alloc_buffers(sink, V4L2_MEMORY_DMABUF, buffers->nbufs);
+	ret = video_sink_alloc_buffers(stream->sink, V4L2_MEMORY_DMABUF,
+				       buffers->nbufs);
 	if (ret < 0) {
-		printf("Failed to allocate sink buffers: %s (%d)\n",
-		       strerror(-ret), -ret);
+		log_error("Failed to allocate sink buffers: %s (%d)\n",
+			  strerror(-ret), -ret);
 		goto error_free_source;
 	}
 
-	ret = v4l2_import_buffers(sink, buffers);
+	ret = video_sink_import_buffers(stream->sink, buffers);
 	if (ret < 0) {
-		printf("Failed to import buffers on sink: %s (%d)\n",
-		       strerror(-ret), -ret);
+		log_error("Failed to import buffers on sink: %s (%d)\n",
+			  strerror(-ret), -ret);
 		goto error_free_sink;
 	}
 
-	/* Start the source and sink. */
-	video_source_stream_on(stream->src);
-	v4l2_stream_on(sink);
-
-	events_watch_fd(stream->events, sink->fd, EVENT_WRITE,
-			uvc_stream_uvc_process, stream);
+	uvc_stream_resume(stream);
 
 	return 0;
 
 error_free_sink:
-	v4l2_free_buffers(sink);
+	video_sink_free_buffers(stream->sink);
 error_free_source:
 	video_source_free_buffers(stream->src);
 	if (buffers)
@@ -132,144 +285,271 @@ error_free_source:
 	return ret;
 }
 
-static int uvc_stream_start_no_alloc(struct uvc_stream *stream)
+static int uvc_stream_resume_no_alloc(struct uvc_stream *stream)
 {
-	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
-	int ret;
+	struct video_buffer_set *buffers = stream->sink_buffers;
+	bool paced = stream->src->ops->queue_buffer;
 	unsigned int i;
+	int ret;
 
-	/* Allocate buffers on the sink. */
-	ret = v4l2_alloc_buffers(sink, V4L2_MEMORY_MMAP, 4);
-	if (ret < 0) {
-		printf("Failed to allocate sink buffers: %s (%d)\n",
-		       strerror(-ret), -ret);
-		return ret;
-	}
+	/*
+	 * Sources that pace their frames are given the buffers, and hand them
+	 * to the sink when they're due. Start them first, as starting resets
+	 * their queue. The other sources fill the buffers right away.
+	 */
+	if (paced)
+		video_source_stream_on(stream->src);
 
-	/* mmap buffers. */
-	ret = v4l2_mmap_buffers(sink);
-	if (ret < 0) {
-		printf("Failed to query sink buffers: %s (%d)\n",
-				strerror(-ret), -ret);
-		return ret;
-	}
-
-	/* Queue buffers to sink. */
-	for (i = 0; i < sink->buffers.nbufs; ++i) {
+	for (i = 0; i < buffers->nbufs; ++i) {
 		struct video_buffer buf = {
 			.index = i,
-			.size = sink->buffers.buffers[i].size,
-			.mem = sink->buffers.buffers[i].mem,
+			.size = buffers->buffers[i].size,
+			.mem = buffers->buffers[i].mem,
 		};
 
-		video_source_fill_buffer(stream->src, &buf);
-		ret = v4l2_queue_buffer(sink, &buf);
+		if (paced) {
+			ret = video_source_queue_buffer(stream->src, &buf);
+		} else {
+			video_source_fill_buffer(stream->src, &buf);
+			uvc_stream_timestamp(&buf);
+			ret = uvc_stream_queue_sink(stream, &buf);
+		}
 		if (ret < 0)
 			return ret;
 	}
 
 	/* Start the source and sink. */
-	video_source_stream_on(stream->src);
-	ret = v4l2_stream_on(sink);
-	if (ret < 0)
+	video_sink_set_buffer_handler(stream->sink,
+				      uvc_stream_sink_process_no_buf, stream);
+
+	if (!paced)
+		video_source_stream_on(stream->src);
+	return video_sink_stream_on(stream->sink);
+}
+
+static int uvc_stream_start_no_alloc(struct uvc_stream *stream)
+{
+	int ret;
+
+	/* Allocate buffers on the sink. */
+	ret = video_sink_alloc_buffers(stream->sink, V4L2_MEMORY_MMAP,
+				       stream->nbufs);
+	if (ret < 0) {
+		log_error("Failed to allocate sink buffers: %s (%d)\n",
+			  strerror(-ret), -ret);
 		return ret;
+	}
 
-	events_watch_fd(stream->events, sink->fd, EVENT_WRITE,
-			uvc_stream_uvc_process_no_buf, stream);
+	/* mmap buffers. */
+	ret = video_sink_mmap_buffers(stream->sink, &stream->sink_buffers);
+	if (ret < 0) {
+		log_error("Failed to query sink buffers: %s (%d)\n",
+			  strerror(-ret), -ret);
+		goto error_free_sink;
+	}
+
+	ret = uvc_stream_resume_no_alloc(stream);
+	if (ret < 0)
+		goto error_free_sink;
 
 	return 0;
+
+error_free_sink:
+	video_sink_free_buffers(stream->sink);
+	stream->sink_buffers = NULL;
+	return ret;
 }
 
 static int uvc_stream_start_encoded(struct uvc_stream *stream)
 {
-	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
 	int ret;
 
 	/* Allocate the buffers on the source. */
-	ret = video_source_alloc_buffers(stream->src, 4);
+	ret = video_source_alloc_buffers(stream->src, stream->nbufs);
 	if (ret < 0) {
-		printf("Failed to allocate source buffers: %s (%d)\n",
-		       strerror(-ret), -ret);
+		log_error("Failed to allocate source buffers: %s (%d)\n",
+			  strerror(-ret), -ret);
 		return ret;
 	}
 
-	/* Allocate buffers on the sink. */
-	ret = v4l2_alloc_buffers(sink, V4L2_MEMORY_MMAP, 4);
+	/*
+	 * Allocate buffers on the sink, as many as the source provided as
+	 * frames are encoded into the sink buffer of the same index.
+	 */
+	ret = video_sink_alloc_buffers(stream->sink, V4L2_MEMORY_MMAP, ret);
 	if (ret < 0) {
-		printf("Failed to allocate sink buffers: %s (%d)\n",
-		       strerror(-ret), -ret);
+		log_error("Failed to allocate sink buffers: %s (%d)\n",
+			  strerror(-ret), -ret);
 		goto error_free_source;
 	}
 
 	/* mmap buffers. */
-	ret = v4l2_mmap_buffers(sink);
+	ret = video_sink_mmap_buffers(stream->sink, &stream->sink_buffers);
 	if (ret < 0) {
-		printf("Failed to query sink buffers: %s (%d)\n",
-				strerror(-ret), -ret);
+		log_error("Failed to query sink buffers: %s (%d)\n",
+			  strerror(-ret), -ret);
 		goto error_free_sink;
 	}
 
 	/* Import the sink's buffers to the source */
-	ret = video_source_import_buffers(stream->src, &sink->buffers);
-	if (ret) {
-		printf("Failed to import sink buffers: %s (%d)\n",
-		       strerror(ret), ret);
+	ret = video_source_import_buffers(stream->src, stream->sink_buffers);
+	if (ret < 0) {
+		log_error("Failed to import sink buffers: %s (%d)\n",
+			  strerror(-ret), -ret);
 		goto error_free_sink;
 	}
 
-	/* Start the source and sink. */
-	video_source_stream_on(stream->src);
-	v4l2_stream_on(sink);
-
-	events_watch_fd(stream->events, sink->fd, EVENT_WRITE,
-			uvc_stream_uvc_process, stream);
+	uvc_stream_resume(stream);
 
 	return 0;
 
 error_free_sink:
-	v4l2_free_buffers(sink);
+	video_sink_free_buffers(stream->sink);
+	stream->sink_buffers = NULL;
 error_free_source:
 	video_source_free_buffers(stream->src);
 
 	return ret;
 }
 
+static void uvc_stream_free_buffers(struct uvc_stream *stream)
+{
+	if (!stream->allocated)
+		return;
+
+	log_info("Freeing video buffers.\n");
+
+	video_sink_free_buffers(stream->sink);
+	video_source_free_buffers(stream->src);
+
+	stream->sink_buffers = NULL;
+	stream->allocated = false;
+}
+
+static void uvc_stream_cancel_idle_timer(struct uvc_stream *stream)
+{
+	struct itimerspec its = { 0 };
+
+	if (stream->idle_timer < 0)
+		return;
+
+	timerfd_settime(stream->idle_timer, 0, &its, NULL);
+}
+
+static void uvc_stream_idle_timeout(void *d)
+{
+	struct uvc_stream *stream = d;
+	uint64_t expirations;
+
+	if (read(stream->idle_timer, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	if (!stream->streaming)
+		uvc_stream_free_buffers(stream);
+}
+
+static void uvc_stream_arm_idle_timer(struct uvc_stream *stream)
+{
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = stream->idle_timeout / 1000,
+			.tv_nsec = (stream->idle_timeout % 1000) * 1000000,
+		},
+	};
+
+	if (stream->idle_timer < 0) {
+		stream->idle_timer = timerfd_create(CLOCK_MONOTONIC,
+						    TFD_NONBLOCK | TFD_CLOEXEC);
+		if (stream->idle_timer < 0) {
+			log_error("Failed to create idle timer: %s (%d)\n",
+				  strerror(errno), errno);
+			uvc_stream_free_buffers(stream);
+			return;
+		}
+
+		/* A disarmed timerfd never becomes readable, watch it for good. */
+		events_watch_fd(stream->events, stream->idle_timer, EVENT_READ,
+				uvc_stream_idle_timeout, stream);
+	}
+
+	timerfd_settime(stream->idle_timer, 0, &its, NULL);
+}
+
 static int uvc_stream_start(struct uvc_stream *stream)
 {
-	printf("Starting video stream.\n");
+	int ret;
+
+	uvc_stream_cancel_idle_timer(stream);
+
+	/*
+	 * If the buffers of the previous session are still allocated for the
+	 * same format, restart the source and sink without reallocating them.
+	 */
+	stream->stats.starts++;
+
+	if (stream->allocated) {
+		log_info("Restarting video stream.\n");
+
+		stream->stats.restarts++;
+
+		if (stream->src->type == VIDEO_SOURCE_STATIC)
+			ret = uvc_stream_resume_no_alloc(stream);
+		else {
+			uvc_stream_resume(stream);
+			ret = 0;
+		}
+
+		stream->streaming = ret == 0;
+		return ret;
+	}
+
+	log_info("Starting video stream.\n");
 
 	switch (stream->src->type) {
 	case VIDEO_SOURCE_DMABUF:
 		video_source_set_buffer_handler(stream->src, uvc_stream_source_process,
 						stream);
-		return uvc_stream_start_alloc(stream);
+		ret = uvc_stream_start_alloc(stream);
+		break;
 	case VIDEO_SOURCE_STATIC:
-		return uvc_stream_start_no_alloc(stream);
+		video_source_set_buffer_handler(stream->src, uvc_stream_source_process,
+						stream);
+		ret = uvc_stream_start_no_alloc(stream);
+		break;
 	case VIDEO_SOURCE_ENCODED:
 		video_source_set_buffer_handler(stream->src, uvc_stream_source_process,
 						stream);
-		return uvc_stream_start_encoded(stream);
-	default:
-		fprintf(stderr, "invalid video source type\n");
+		ret = uvc_stream_start_encoded(stream);
 		break;
+	default:
+		log_error("invalid video source type\n");
+		return -EINVAL;
 	}
 
-	return -EINVAL;
+	stream->allocated = ret == 0;
+	stream->streaming = ret == 0;
+
+	return ret;
 }
 
 static int uvc_stream_stop(struct uvc_stream *stream)
 {
-	struct v4l2_device *sink = uvc_v4l2_device(stream->uvc);
-
-	printf("Stopping video stream.\n");
+	log_info("Stopping video stream.\n");
 
-	events_unwatch_fd(stream->events, sink->fd, EVENT_WRITE);
-
-	v4l2_stream_off(sink);
+	video_sink_stream_off(stream->sink);
 	video_source_stream_off(stream->src);
 
-	v4l2_free_buffers(sink);
-	video_source_free_buffers(stream->src);
+	stream->streaming = false;
+	stream->stats.sink_queued = 0;
+
+	/*
+	 * Keep the buffers around for a while, hosts commonly stop and restart
+	 * streaming with the same format.
+	 */
+	if (stream->idle_timeout)
+		uvc_stream_arm_idle_timer(stream);
+	else
+		uvc_stream_free_buffers(stream);
 
 	return 0;
 }
@@ -288,27 +568,128 @@ int uvc_stream_set_format(struct uvc_stream *stream,
 	struct v4l2_pix_format fmt = *format;
 	int ret;
 
-	printf("Setting format to 0x%08x %ux%u\n",
-		format->pixelformat, format->width, format->height);
+	/*
+	 * Hosts commit the format before every stream start. If it hasn't
+	 * changed, keep the buffers allocated for it and skip reconfiguration.
+	 */
+	if (stream->allocated) {
+		if (format->pixelformat == stream->format.pixelformat &&
+		    format->width == stream->format.width &&
+		    format->height == stream->format.height &&
+		    format->sizeimage == stream->format.sizeimage)
+			return 0;
+
+		if (!stream->streaming) {
+			uvc_stream_cancel_idle_timer(stream);
+			uvc_stream_free_buffers(stream);
+		}
+	}
+
+	log_info("Setting format to 0x%08x %ux%u\n",
+		 format->pixelformat, format->width, format->height);
 
-	ret = uvc_set_format(stream->uvc, &fmt);
+	ret = video_sink_set_format(stream->sink, &fmt);
 	if (ret < 0)
 		return ret;
 
+	stream->format = *format;
+
 	return video_source_set_format(stream->src, &fmt);
 }
 
-int uvc_stream_set_frame_rate(struct uvc_stream *stream, unsigned int fps)
+void uvc_stream_dump_latency(struct uvc_stream *stream, FILE *file)
 {
-	printf("=== Setting frame rate to %u fps\n", fps);
-	return video_source_set_frame_rate(stream->src, fps);
+	frame_latency_dump(&stream->latency, file);
+}
+
+void uvc_stream_write_metrics(struct uvc_stream *stream, FILE *file)
+{
+	struct video_source_stats src_stats;
+	char labels[64];
+	unsigned int i;
+
+	video_source_get_stats(stream->src, &src_stats);
+
+	prometheus_header(file, "uvc_gadget_streaming", "gauge",
+			  "Whether the host is streaming.");
+	prometheus_value(file, "uvc_gadget_streaming", NULL, stream->streaming);
+
+	prometheus_header(file, "uvc_gadget_stream_starts_total", "counter",
+			  "Stream starts requested by the host.");
+	prometheus_counter(file, "uvc_gadget_stream_starts_total", NULL,
+			   stream->stats.starts);
+
+	prometheus_header(file, "uvc_gadget_stream_restarts_total", "counter",
+			  "Stream starts that reused the buffers of the previous session.");
+	prometheus_counter(file, "uvc_gadget_stream_restarts_total", NULL,
+			   stream->stats.restarts);
+
+	prometheus_header(file, "uvc_gadget_frames_in_total", "counter",
+			  "Frames produced by the source and queued to the sink.");
+	prometheus_counter(file, "uvc_gadget_frames_in_total", NULL,
+			   stream->stats.frames_in);
+
+	prometheus_header(file, "uvc_gadget_frames_out_total", "counter",
+			  "Frames transmitted by the sink.");
+	prometheus_counter(file, "uvc_gadget_frames_out_total", NULL,
+			   stream->stats.frames_out);
+
+	prometheus_header(file, "uvc_gadget_frames_dropped_total", "counter",
+			  "Frames dropped by the source or completed with an error by the sink.");
+	prometheus_counter(file, "uvc_gadget_frames_dropped_total",
+			   "stage=\"source\"", src_stats.dropped);
+	prometheus_counter(file, "uvc_gadget_frames_dropped_total",
+			   "stage=\"sink\"", stream->stats.frames_dropped);
+
+	prometheus_header(file, "uvc_gadget_bytes_out_total", "counter",
+			  "Payload bytes of the frames transmitted by the sink.");
+	prometheus_counter(file, "uvc_gadget_bytes_out_total", NULL,
+			   stream->stats.bytes_out);
+
+	prometheus_header(file, "uvc_gadget_sink_underruns_total", "counter",
+			  "Times the sink ran out of buffers while streaming.");
+	prometheus_counter(file, "uvc_gadget_sink_underruns_total", NULL,
+			   stream->stats.sink_underruns);
+
+	prometheus_header(file, "uvc_gadget_sink_queued_buffers", "gauge",
+			  "Buffers queued to the sink.");
+	prometheus_value(file, "uvc_gadget_sink_queued_buffers", NULL,
+			 stream->stats.sink_queued);
+
+	prometheus_header(file, "uvc_gadget_source_queued_frames", "gauge",
+			  "Frames waiting in the source, to be paced or encoded.");
+	prometheus_value(file, "uvc_gadget_source_queued_frames", NULL,
+			 src_stats.queued);
+
+	prometheus_header(file, "uvc_gadget_frame_bytes", "summary",
+			  "Payload size of the frames transmitted by the sink.");
+	prometheus_summary(file, "uvc_gadget_frame_bytes", NULL,
+			   &stream->frame_bytes, 1);
+
+	prometheus_header(file, "uvc_gadget_frame_latency_seconds", "summary",
+			  "Time frames take to reach each pipeline stage from the previous one.");
+	for (i = VIDEO_BUFFER_STAGE_COMPLETE; i < VIDEO_BUFFER_NUM_STAGES; ++i) {
+		snprintf(labels, sizeof(labels), "stage=\"%s\"",
+			 video_buffer_stage_name(i));
+		prometheus_summary(file, "uvc_gadget_frame_latency_seconds",
+				   labels, &stream->latency.stages[i], 1e-9);
+	}
+	prometheus_summary(file, "uvc_gadget_frame_latency_seconds",
+			   "stage=\"total\"", &stream->latency.total, 1e-9);
+}
+
+int uvc_stream_set_frame_rate(struct uvc_stream *stream, unsigned int interval)
+{
+	log_info("=== Setting frame interval to %u.%07u s (%.3f fps)\n",
+		 interval / 10000000, interval % 10000000, 10000000.0 / interval);
+	return video_source_set_frame_rate(stream->src, interval);
 }
 
 /* ---------------------------------------------------------------------------
  * Stream handling
  */
 
-struct uvc_stream *uvc_stream_new(const char *uvc_device)
+static struct uvc_stream *uvc_stream_alloc(void)
 {
 	struct uvc_stream *stream;
 
@@ -317,11 +698,31 @@ struct uvc_stream *uvc_stream_new(const char *uvc_device)
 		return NULL;
 
 	memset(stream, 0, sizeof(*stream));
+	stream->nbufs = UVC_STREAM_DEFAULT_BUFFERS;
+	stream->idle_timeout = UVC_STREAM_DEFAULT_IDLE_TIMEOUT;
+	stream->idle_timer = -1;
+
+	return stream;
+}
+
+struct uvc_stream *uvc_stream_new(const char *uvc_device)
+{
+	struct uvc_stream *stream;
+
+	stream = uvc_stream_alloc();
+	if (stream == NULL)
+		return NULL;
+
+	/* Streams without a UDC need a sink set by the caller. */
+	if (!uvc_device)
+		return stream;
 
 	stream->uvc = uvc_open(uvc_device, stream);
 	if (stream->uvc == NULL)
 		goto error;
 
+	stream->sink = uvc_video_sink(stream->uvc);
+
 	return stream;
 
 error:
@@ -329,21 +730,60 @@ error:
 	return NULL;
 }
 
+struct uvc_stream *uvc_stream_new_emulated(struct uvc_host_emulator *host)
+{
+	struct uvc_stream *stream;
+
+	stream = uvc_stream_alloc();
+	if (stream == NULL)
+		return NULL;
+
+	stream->uvc = uvc_open_transport(uvc_host_emulator_transport(host),
+					 stream);
+	if (stream->uvc == NULL) {
+		free(stream);
+		return NULL;
+	}
+
+	stream->sink = uvc_host_emulator_sink(host);
+
+	return stream;
+}
+
 void uvc_stream_delete(struct uvc_stream *stream)
 {
 	if (stream == NULL)
 		return;
 
-	uvc_close(stream->uvc);
+	if (stream->idle_timer >= 0) {
+		events_unwatch_fd(stream->events, stream->idle_timer, EVENT_READ);
+		close(stream->idle_timer);
+	}
+
+	if (stream->streaming)
+		uvc_stream_stop(stream);
+	uvc_stream_free_buffers(stream);
+
+	if (stream->uvc)
+		uvc_close(stream->uvc);
 
 	free(stream);
 }
 
-void uvc_stream_init_uvc(struct uvc_stream *stream,
-			 struct uvc_function_config *fc)
+int uvc_stream_init_uvc(struct uvc_stream *stream,
+			struct uvc_function_config *fc)
 {
-	uvc_set_config(stream->uvc, fc);
+	int ret;
+
+	if (!stream->uvc)
+		return -ENODEV;
+
+	ret = uvc_set_config(stream->uvc, fc);
+	if (ret < 0)
+		return ret;
+
 	uvc_events_init(stream->uvc, stream->events);
+	return 0;
 }
 
 void uvc_stream_set_event_handler(struct uvc_stream *stream,
@@ -357,3 +797,45 @@ void uvc_stream_set_video_source(struct uvc_stream *stream,
 {
 	stream->src = src;
 }
+
+void uvc_stream_set_video_sink(struct uvc_stream *stream,
+			       struct video_sink *sink)
+{
+	stream->sink = sink;
+}
+
+int uvc_stream_set_buffer_count(struct uvc_stream *stream, unsigned int nbufs)
+{
+	if (nbufs < UVC_STREAM_MIN_BUFFERS || nbufs > UVC_STREAM_MAX_BUFFERS)
+		return -EINVAL;
+
+	stream->nbufs = nbufs;
+	return 0;
+}
+
+void uvc_stream_set_idle_timeout(struct uvc_stream *stream,
+				 unsigned int timeout)
+{
+	stream->idle_timeout = timeout;
+}
+
+static const struct {
+	const char *name;
+	unsigned int nbufs;
+} uvc_stream_buffer_presets[] = {
+	{ "low-latency", 3 },
+	{ "balanced", UVC_STREAM_DEFAULT_BUFFERS },
+	{ "throughput", 8 },
+};
+
+int uvc_stream_buffer_preset(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(uvc_stream_buffer_presets); ++i) {
+		if (!strcmp(name, uvc_stream_buffer_presets[i].name))
+			return uvc_stream_buffer_presets[i].nbufs;
+	}
+
+	return -EINVAL;
+}
@@ -0,0 +1,149 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Frame identification barcode
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "test-barcode.h"
+#include "tools.h"
+
+#define YUYV_BLACK	0x80108010
+#define YUYV_WHITE	0x80eb80eb
+
+#define LUMA_THRESHOLD	128
+
+/*
+ * Layout of the barcode payload, in bytes: sync word, sequence number, time
+ * stamp and CRC, all big endian.
+ */
+#define BARCODE_SEQUENCE	2
+#define BARCODE_TIMESTAMP	6
+#define BARCODE_CRC		14
+#define BARCODE_SIZE		(TEST_BARCODE_BITS / 8)
+
+static uint16_t test_barcode_crc16(const uint8_t *data, unsigned int size)
+{
+	uint16_t crc = 0xffff;
+	unsigned int i, j;
+
+	/* CRC-16/CCITT-FALSE */
+	for (i = 0; i < size; ++i) {
+		crc ^= data[i] << 8;
+		for (j = 0; j < 8; ++j)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+
+	return crc;
+}
+
+static void put_be(uint8_t *data, uint64_t value, unsigned int size)
+{
+	while (size--) {
+		data[size] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+static uint64_t get_be(const uint8_t *data, unsigned int size)
+{
+	uint64_t value = 0;
+	unsigned int i;
+
+	for (i = 0; i < size; ++i)
+		value = (value << 8) | data[i];
+
+	return value;
+}
+
+unsigned int test_barcode_size(unsigned int width, unsigned int height)
+{
+	unsigned int size;
+
+	size = min(width / TEST_BARCODE_COLUMNS, height / TEST_BARCODE_ROWS);
+
+	return size & ~1U;
+}
+
+void test_barcode_draw_yuyv(void *mem, unsigned int width, unsigned int height,
+			    unsigned int stride, const struct test_barcode *code)
+{
+	unsigned int size = test_barcode_size(width, height);
+	uint8_t data[BARCODE_SIZE];
+	uint32_t *line;
+	unsigned int row, col;
+	unsigned int i, y;
+
+	if (!size)
+		return;
+
+	put_be(&data[0], TEST_BARCODE_SYNC, 2);
+	put_be(&data[BARCODE_SEQUENCE], code->sequence, 4);
+	put_be(&data[BARCODE_TIMESTAMP], code->timestamp, 8);
+	put_be(&data[BARCODE_CRC],
+	       test_barcode_crc16(&data[BARCODE_SEQUENCE],
+				  BARCODE_CRC - BARCODE_SEQUENCE), 2);
+
+	/* Draw the first line of each row of blocks and replicate it. */
+	for (row = 0; row < TEST_BARCODE_ROWS; ++row) {
+		line = (uint32_t *)((uint8_t *)mem + row * size * stride);
+
+		for (col = 0; col < TEST_BARCODE_COLUMNS; ++col) {
+			unsigned int bit = row * TEST_BARCODE_COLUMNS + col;
+			bool one = data[bit / 8] & (0x80 >> (bit % 8));
+			uint32_t colour = one ? YUYV_WHITE : YUYV_BLACK;
+
+			for (i = 0; i < size / 2; ++i)
+				line[col * size / 2 + i] = colour;
+		}
+
+		for (y = 1; y < size; ++y)
+			memcpy((uint8_t *)line + y * stride, line,
+			       TEST_BARCODE_COLUMNS * size * 2);
+	}
+}
+
+int test_barcode_read(const uint8_t *luma, unsigned int pixel_step,
+		      unsigned int width, unsigned int height,
+		      unsigned int stride, struct test_barcode *code)
+{
+	unsigned int size = test_barcode_size(width, height);
+	uint8_t data[BARCODE_SIZE] = { 0 };
+	unsigned int bit;
+
+	if (!size)
+		return -EINVAL;
+
+	/*
+	 * Sample the four pixels around the centre of each block to be robust
+	 * against compression artifacts.
+	 */
+	for (bit = 0; bit < TEST_BARCODE_BITS; ++bit) {
+		unsigned int x = (bit % TEST_BARCODE_COLUMNS) * size + size / 2;
+		unsigned int y = (bit / TEST_BARCODE_COLUMNS) * size + size / 2;
+		const uint8_t *p = luma + (y - 1) * stride + (x - 1) * pixel_step;
+		unsigned int sum;
+
+		sum = p[0] + p[pixel_step] + p[stride] + p[stride + pixel_step];
+		if (sum / 4 >= LUMA_THRESHOLD)
+			data[bit / 8] |= 0x80 >> (bit % 8);
+	}
+
+	if (get_be(&data[0], 2) != TEST_BARCODE_SYNC)
+		return -EINVAL;
+
+	if (get_be(&data[BARCODE_CRC], 2) !=
+	    test_barcode_crc16(&data[BARCODE_SEQUENCE],
+			       BARCODE_CRC - BARCODE_SEQUENCE))
+		return -EINVAL;
+
+	code->sequence = get_be(&data[BARCODE_SEQUENCE], 4);
+	code->timestamp = get_be(&data[BARCODE_TIMESTAMP], 8);
+
+	return 0;
+}
@@ -8,11 +8,15 @@
  */
 
 #include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <linux/videodev2.h>
 
 #include "events.h"
+#include "test-barcode.h"
 #include "test-source.h"
 #include "tools.h"
 #include "video-buffers.h"
@@ -33,21 +37,53 @@ struct test_source {
 	unsigned int width;
 	unsigned int height;
 	unsigned int pixelformat;
+
+	enum test_source_pattern pattern;
+
+	/*
+	 * One line of colour bars, stored twice in a row so that scrolled
+	 * lines can be copied from it in one go, and the length of one line
+	 * in 32-bit YUYV pixel pairs.
+	 */
+	uint32_t *bars;
+	unsigned int line_pairs;
+
+	unsigned int sequence;
+	unsigned int scroll;
+
+	/* Sink buffers that already contain the static bars, by index. */
+	bool filled[VIDEO_MAX_FRAME];
 };
 
 #define to_test_source(s) container_of(s, struct test_source, src)
 
+/* Height of the frame counter band drawn by the moving patterns. */
+#define TEST_COUNTER_HEIGHT	16U
+#define TEST_COUNTER_BITS	32U
+
+/* Number of frames it takes the scrolling bars to scroll one line width. */
+#define TEST_SCROLL_FRAMES	64
+
 static void test_source_destroy(struct video_source *s)
 {
 	struct test_source *src = to_test_source(s);
 
+	free(src->bars);
 	free(src);
 }
 
 static int test_source_set_format(struct video_source *s,
 				  struct v4l2_pix_format *fmt)
 {
+	static const uint32_t colours[8] = {
+		WHITE, YELLOW, CYAN, GREEN, MAGENTA, RED, BLUE, BLACK,
+	};
 	struct test_source *src = to_test_source(s);
+	unsigned int i;
+
+	/* The patterns are drawn in pairs of pixels, a pair at least. */
+	if (fmt->width < 2)
+		return -EINVAL;
 
 	src->width = fmt->width;
 	src->height = fmt->height;
@@ -56,22 +92,47 @@ static int test_source_set_format(struct video_source *s,
 	if (src->pixelformat != v4l2_fourcc('Y', 'U', 'Y', 'V'))
 		return -EINVAL;
 
+	/* Render the colour bars once, buffers are filled by copying them. */
+	free(src->bars);
+	src->line_pairs = src->width / 2;
+	src->bars = malloc(src->line_pairs * 2 * sizeof(*src->bars));
+	if (!src->bars)
+		return -ENOMEM;
+
+	for (i = 0; i < src->line_pairs; ++i) {
+		uint32_t colour = colours[i * 8 / src->line_pairs];
+
+		src->bars[i] = colour;
+		src->bars[i + src->line_pairs] = colour;
+	}
+
+	memset(src->filled, 0, sizeof(src->filled));
+
 	return 0;
 }
 
 static int test_source_set_frame_rate(struct video_source *s __attribute__((unused)),
-				      unsigned int fps __attribute__((unused)))
+				      unsigned int interval __attribute__((unused)))
 {
 	return 0;
 }
 
-static int test_source_free_buffers(struct video_source *s __attribute__((unused)))
+static int test_source_free_buffers(struct video_source *s)
 {
+	struct test_source *src = to_test_source(s);
+
+	memset(src->filled, 0, sizeof(src->filled));
+
 	return 0;
 }
 
-static int test_source_stream_on(struct video_source *s __attribute__((unused)))
+static int test_source_stream_on(struct video_source *s)
 {
+	struct test_source *src = to_test_source(s);
+
+	src->sequence = 0;
+	src->scroll = 0;
+
 	return 0;
 }
 
@@ -80,37 +141,81 @@ static int test_source_stream_off(struct video_source *s __attribute__((unused))
 	return 0;
 }
 
+/*
+ * Draw the frame sequence number in binary as a band of blocks at the top of
+ * the frame, most significant bit first, white for ones and black for zeros.
+ */
+static void test_source_draw_counter(struct test_source *src, uint32_t *mem)
+{
+	unsigned int block = src->line_pairs / TEST_COUNTER_BITS;
+	unsigned int height = min(src->height, TEST_COUNTER_HEIGHT);
+	unsigned int i;
+
+	if (!block)
+		return;
+
+	for (i = 0; i < TEST_COUNTER_BITS; ++i) {
+		bool one = src->sequence & (1U << (TEST_COUNTER_BITS - 1 - i));
+		uint32_t colour = one ? WHITE : BLACK;
+		unsigned int j;
+
+		for (j = 0; j < block; ++j)
+			mem[i * block + j] = colour;
+	}
+
+	for (i = 1; i < height; ++i)
+		memcpy(mem + i * src->line_pairs, mem,
+		       TEST_COUNTER_BITS * block * sizeof(*mem));
+}
+
 static void test_source_fill_buffer(struct video_source *s,
 				    struct video_buffer *buf)
 {
 	struct test_source *src = to_test_source(s);
-	unsigned int bpl;
-	unsigned int i, j;
-	void *mem = buf->mem;
-
-	bpl = src->width * 2;
-	for (i = 0; i < src->height; ++i) {
-		for (j = 0; j < bpl; j += 4) {
-			if (j < bpl * 1 / 8)
-				*(unsigned int *)(mem + i*bpl + j) = WHITE;
-			else if (j < bpl * 2 / 8)
-				*(unsigned int *)(mem + i*bpl + j) = YELLOW;
-			else if (j < bpl * 3 / 8)
-				*(unsigned int *)(mem + i*bpl + j) = CYAN;
-			else if (j < bpl * 4 / 8)
-				*(unsigned int *)(mem + i*bpl + j) = GREEN;
-			else if (j < bpl * 5 / 8)
-				*(unsigned int *)(mem + i*bpl + j) = MAGENTA;
-			else if (j < bpl * 6 / 8)
-				*(unsigned int *)(mem + i*bpl + j) = RED;
-			else if (j < bpl * 7 / 8)
-				*(unsigned int *)(mem + i*bpl + j) = BLUE;
-			else
-				*(unsigned int *)(mem + i*bpl + j) = BLACK;
-		}
-	}
+	unsigned int bpl = src->line_pairs * sizeof(*src->bars);
+	const uint32_t *line = src->bars;
+	uint32_t *mem = buf->mem;
+	unsigned int i;
 
 	buf->bytesused = bpl * src->height;
+
+	switch (src->pattern) {
+	case TEST_PATTERN_BARS:
+	default:
+		/* The bars never change, sink buffers are only filled once. */
+		if (buf->index < VIDEO_MAX_FRAME && src->filled[buf->index])
+			return;
+		if (buf->index < VIDEO_MAX_FRAME)
+			src->filled[buf->index] = true;
+		break;
+
+	case TEST_PATTERN_SCROLL:
+	case TEST_PATTERN_BARCODE:
+		line += src->scroll;
+		src->scroll = (src->scroll + max(src->line_pairs / TEST_SCROLL_FRAMES, 1U))
+			    % src->line_pairs;
+		break;
+	}
+
+	for (i = 0; i < src->height; ++i)
+		memcpy((uint8_t *)mem + i * bpl, line, bpl);
+
+	if (src->pattern == TEST_PATTERN_SCROLL)
+		test_source_draw_counter(src, mem);
+
+	if (src->pattern == TEST_PATTERN_BARCODE) {
+		struct test_barcode code = {
+			.sequence = src->sequence,
+		};
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		code.timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+		test_barcode_draw_yuyv(mem, src->width, src->height, bpl, &code);
+	}
+
+	src->sequence++;
 }
 
 static const struct video_source_ops test_source_ops = {
@@ -139,6 +244,14 @@ struct video_source *test_video_source_create()
 	return &src->src;
 }
 
+void test_video_source_set_pattern(struct video_source *s,
+				   enum test_source_pattern pattern)
+{
+	struct test_source *src = to_test_source(s);
+
+	src->pattern = pattern;
+}
+
 void test_video_source_init(struct video_source *s, struct events *events)
 {
 	struct test_source *src = to_test_source(s);
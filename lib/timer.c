@@ -8,9 +8,11 @@
  */
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/timerfd.h>
 #include <unistd.h>
 
@@ -18,7 +20,7 @@
 
 struct timer {
         int fd;
-        struct itimerspec settings;
+        struct timespec period;
 };
 
 struct timer *timer_new(void)
@@ -31,7 +33,7 @@ struct timer *timer_new(void)
 
         memset(timer, 0, sizeof(*timer));
 
-        timer->fd = timerfd_create(CLOCK_REALTIME, 0);
+        timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
         if (timer->fd < 0) {
 		fprintf(stderr, "failed to create timer: %s (%d)\n",
 			strerror(errno), errno);
@@ -46,19 +48,41 @@ err_free_timer:
         return NULL;
 }
 
-void timer_set_fps(struct timer *timer, int fps)
+void timer_set_interval(struct timer *timer, unsigned int interval)
 {
-	int ns_per_frame = 1000000000 / fps;
+	uint64_t ns = (uint64_t)interval * 100;
 
-	timer->settings.it_value.tv_nsec = ns_per_frame;
-	timer->settings.it_interval.tv_nsec = ns_per_frame;
+	timer->period.tv_sec = ns / 1000000000;
+	timer->period.tv_nsec = ns % 1000000000;
 }
 
 int timer_arm(struct timer *timer)
 {
+	struct itimerspec settings = {
+		.it_interval = timer->period,
+	};
         int ret;
 
-	ret = timerfd_settime(timer->fd, 0, &timer->settings, NULL);
+	/*
+	 * Schedule the first expiration at an absolute time, the kernel then
+	 * advances the deadline by exactly one period at each expiration, so
+	 * the time it takes to service the timer doesn't accumulate.
+	 */
+	ret = clock_gettime(CLOCK_MONOTONIC, &settings.it_value);
+	if (ret) {
+		fprintf(stderr, "failed to read the time: %s (%d)\n",
+			strerror(errno), errno);
+		return -errno;
+	}
+
+	settings.it_value.tv_sec += timer->period.tv_sec;
+	settings.it_value.tv_nsec += timer->period.tv_nsec;
+	if (settings.it_value.tv_nsec >= 1000000000) {
+		settings.it_value.tv_sec++;
+		settings.it_value.tv_nsec -= 1000000000;
+	}
+
+	ret = timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, &settings, NULL);
 	if (ret)
 		fprintf(stderr, "failed to change timer settings: %s (%d)\n",
 			strerror(errno), errno);
@@ -82,11 +106,21 @@ int timer_disarm(struct timer *timer)
 	return ret;
 }
 
-void timer_wait(struct timer *timer)
+int timer_fd(struct timer *timer)
 {
-        char read_buf[8];
+	return timer->fd;
+}
+
+uint64_t timer_expirations(struct timer *timer)
+{
+	uint64_t expirations;
+	ssize_t ret;
+
+	ret = read(timer->fd, &expirations, sizeof(expirations));
+	if (ret != sizeof(expirations))
+		return 0;
 
-        read(timer->fd, read_buf, 8);
+	return expirations;
 }
 
 void timer_destroy(struct timer *timer)
@@ -8,10 +8,13 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb/g_uvc.h>
 #include <linux/usb/video.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,18 +22,65 @@
 
 #include "configfs.h"
 #include "events.h"
+#include "log.h"
 #include "stream.h"
 #include "tools.h"
 #include "uvc.h"
 #include "v4l2.h"
+#include "v4l2-sink.h"
+
+UVC_LOG_MODULE(uvc);
+
+/*
+ * struct uvc_mode - Entry of the probe/commit negotiation table
+ * @ctrl: Streaming control returned to the host for this mode
+ * @bandwidth: Bandwidth required to transfer frames at the mode's frame
+ *	interval, in bytes per second. For compressed formats this is based on
+ *	an estimate of the compressed frame size.
+ */
+struct uvc_mode {
+	struct uvc_streaming_control ctrl;
+	uint64_t bandwidth;
+};
+
+/*
+ * struct uvc_frame_modes - Range of negotiation table entries for one frame
+ * @first: Index of the first entry, with the shortest frame interval
+ * @count: Number of entries, one per frame interval
+ */
+struct uvc_frame_modes {
+	unsigned int first;
+	unsigned int count;
+};
 
 struct uvc_device
 {
 	struct v4l2_device *vdev;
+	struct video_sink *sink;
+
+	/* Event transport, the V4L2 device unless emulated. */
+	struct uvc_transport *transport;
+	struct uvc_transport v4l2_transport;
+	struct events *events;
 
 	struct uvc_stream *stream;
 	struct uvc_function_config *fc;
 
+	/*
+	 * The negotiation table is computed from the function configuration
+	 * and holds one entry per (format, frame, interval) combination,
+	 * sorted by format index, frame index and frame interval. Frames are
+	 * indexed by format through format_frames.
+	 */
+	struct uvc_mode *modes;
+	unsigned int num_modes;
+	struct uvc_frame_modes *frames;
+	unsigned int *format_frames;
+
+	/* Bus speed and payload bandwidth available for the streaming endpoint. */
+	enum usb_device_speed speed;
+	uint64_t bandwidth;
+
 	struct uvc_streaming_control probe;
 	struct uvc_streaming_control commit;
 
@@ -91,7 +141,71 @@ static const char *pu_control_name(uint8_t cs)
         return "UNKNOWN";
 }
 
-struct uvc_device *uvc_open(const char *devname, struct uvc_stream *stream)
+/* ---------------------------------------------------------------------------
+ * V4L2 event transport
+ */
+
+#define to_uvc_device(t) container_of(t, struct uvc_device, v4l2_transport)
+
+static int uvc_v4l2_subscribe_event(struct uvc_transport *transport,
+				    unsigned int type)
+{
+	struct uvc_device *dev = to_uvc_device(transport);
+	struct v4l2_event_subscription sub;
+	int ret;
+
+	memset(&sub, 0, sizeof sub);
+	sub.type = type;
+
+	ret = ioctl(dev->vdev->fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
+	return ret < 0 ? -errno : 0;
+}
+
+static int uvc_v4l2_dequeue_event(struct uvc_transport *transport,
+				  struct v4l2_event *event)
+{
+	struct uvc_device *dev = to_uvc_device(transport);
+	int ret;
+
+	ret = ioctl(dev->vdev->fd, VIDIOC_DQEVENT, event);
+	if (ret < 0) {
+		ret = -errno;
+		log_error_ratelimited("VIDIOC_DQEVENT failed: %s (%d)\n",
+				      strerror(-ret), -ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+static int uvc_v4l2_send_response(struct uvc_transport *transport,
+				  struct uvc_request_data *resp)
+{
+	struct uvc_device *dev = to_uvc_device(transport);
+	int ret;
+
+	ret = ioctl(dev->vdev->fd, UVCIOC_SEND_RESPONSE, resp);
+	if (ret < 0) {
+		ret = -errno;
+		log_error_ratelimited("UVCIOC_SEND_RESPONSE failed: %s (%d)\n",
+				      strerror(-ret), -ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+static const struct uvc_transport_ops uvc_v4l2_transport_ops = {
+	.subscribe_event = uvc_v4l2_subscribe_event,
+	.dequeue_event = uvc_v4l2_dequeue_event,
+	.send_response = uvc_v4l2_send_response,
+};
+
+/* ---------------------------------------------------------------------------
+ * Open and close
+ */
+
+static struct uvc_device *uvc_alloc(struct uvc_stream *stream)
 {
 	struct uvc_device *dev;
 
@@ -102,20 +216,79 @@ struct uvc_device *uvc_open(const char *devname, struct uvc_stream *stream)
 	memset(dev, 0, sizeof *dev);
 	dev->stream = stream;
 
+	return dev;
+}
+
+struct uvc_device *uvc_open(const char *devname, struct uvc_stream *stream)
+{
+	struct uvc_device *dev;
+
+	dev = uvc_alloc(stream);
+	if (dev == NULL)
+		return NULL;
+
 	dev->vdev = v4l2_open(devname);
 	if (dev->vdev == NULL) {
 		free(dev);
 		return NULL;
 	}
 
+	dev->sink = v4l2_video_sink_create(dev->vdev);
+	if (dev->sink == NULL) {
+		v4l2_close(dev->vdev);
+		free(dev);
+		return NULL;
+	}
+
+	dev->v4l2_transport.ops = &uvc_v4l2_transport_ops;
+	dev->v4l2_transport.fd = dev->vdev->fd;
+	dev->v4l2_transport.fd_event = EVENT_EXCEPTION;
+	dev->transport = &dev->v4l2_transport;
+
 	return dev;
 }
 
+struct uvc_device *uvc_open_transport(struct uvc_transport *transport,
+				      struct uvc_stream *stream)
+{
+	struct uvc_device *dev;
+
+	dev = uvc_alloc(stream);
+	if (dev == NULL)
+		return NULL;
+
+	dev->transport = transport;
+
+	return dev;
+}
+
+static void uvc_free_modes(struct uvc_device *dev)
+{
+	free(dev->modes);
+	free(dev->frames);
+	free(dev->format_frames);
+
+	dev->modes = NULL;
+	dev->num_modes = 0;
+	dev->frames = NULL;
+	dev->format_frames = NULL;
+}
+
 void uvc_close(struct uvc_device *dev)
 {
-	v4l2_close(dev->vdev);
+	if (dev->events)
+		events_unwatch_fd(dev->events, dev->transport->fd,
+				  dev->transport->fd_event);
+
+	video_sink_destroy(dev->sink);
+	dev->sink = NULL;
+
+	if (dev->vdev)
+		v4l2_close(dev->vdev);
 	dev->vdev = NULL;
 
+	uvc_free_modes(dev);
+
 	free(dev);
 }
 
@@ -123,60 +296,68 @@ void uvc_close(struct uvc_device *dev)
  * Request processing
  */
 
-static void
-uvc_fill_streaming_control(struct uvc_device *dev,
-			   struct uvc_streaming_control *ctrl,
-			   int iformat, int iframe, unsigned int ival)
+static const struct uvc_streaming_control *
+uvc_find_streaming_control(struct uvc_device *dev, int iformat, int iframe,
+			   unsigned int ival, bool *steered)
 {
+	unsigned int requested;
 	const struct uvc_function_config_format *format;
-	const struct uvc_function_config_frame *frame;
-	unsigned int i;
+	const struct uvc_frame_modes *frame;
+	unsigned int low, high;
 
 	/*
 	 * Restrict the iformat, iframe and ival to valid values. Negative
 	 * values for iformat or iframe will result in the maximum valid value
 	 * being selected.
 	 */
-        iformat = clamp((unsigned int)iformat, 1U,
-                        dev->fc->streaming.num_formats);
+	iformat = clamp((unsigned int)iformat, 1U,
+			dev->fc->streaming.num_formats);
 	format = &dev->fc->streaming.formats[iformat-1];
 
 	iframe = clamp((unsigned int)iframe, 1U, format->num_frames);
-	frame = &format->frames[iframe-1];
+	frame = &dev->frames[dev->format_frames[iformat-1] + iframe - 1];
 
-	for (i = 0; i < frame->num_intervals; ++i) {
-		if (ival <= frame->intervals[i]) {
-			ival = frame->intervals[i];
-			break;
-		}
-	}
+	/*
+	 * Select the shortest interval not shorter than the requested one, or
+	 * the longest interval if none is.
+	 */
+	low = frame->first;
+	high = frame->first + frame->count - 1;
 
-	if (i == frame->num_intervals)
-		ival = frame->intervals[frame->num_intervals-1];
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
 
-	memset(ctrl, 0, sizeof *ctrl);
+		if (dev->modes[mid].ctrl.dwFrameInterval < ival)
+			low = mid + 1;
+		else
+			high = mid;
+	}
 
-	ctrl->bmHint = 1;
-	ctrl->bFormatIndex = iformat;
-	ctrl->bFrameIndex = iframe ;
-	ctrl->dwFrameInterval = ival;
+	requested = low;
 
 	/*
-	 * The maximum size in bytes for a single frame depends on the format.
-	 * This switch will need extending for any new formats that are added
-	 * to ensure the buffer size calculations are done correctly.
+	 * Steer the host to the nearest interval whose bandwidth fits in the
+	 * endpoint. Longer intervals need less bandwidth, so that's the first
+	 * feasible one after the requested interval. If none fits, use the
+	 * longest interval, which has the best chance to stream anyway.
 	 */
-	switch (format->fcc) {
-	case V4L2_PIX_FMT_YUYV:
-	case V4L2_PIX_FMT_MJPEG:
-		ctrl->dwMaxVideoFrameSize = frame->width * frame->height * 2;
-		break;
-	}
+	while (low < frame->first + frame->count - 1 &&
+	       dev->modes[low].bandwidth > dev->bandwidth)
+		low++;
+
+	if (steered)
+		*steered = low != requested;
 
-	ctrl->dwMaxPayloadTransferSize = dev->fc->streaming.ep.wMaxPacketSize;
-	ctrl->bmFramingInfo = 3;
-	ctrl->bPreferedVersion = 1;
-	ctrl->bMaxVersion = 1;
+	return &dev->modes[low].ctrl;
+}
+
+static void
+uvc_fill_streaming_control(struct uvc_device *dev,
+			   struct uvc_streaming_control *ctrl,
+			   int iformat, int iframe, unsigned int ival)
+{
+	memcpy(ctrl, uvc_find_streaming_control(dev, iformat, iframe, ival, NULL),
+	       sizeof *ctrl);
 }
 
 static void
@@ -184,7 +365,7 @@ uvc_events_process_standard(struct uvc_device *dev,
 			    const struct usb_ctrlrequest *ctrl,
 			    struct uvc_request_data *resp)
 {
-	printf("standard request\n");
+	log_debug("standard request\n");
 	(void)dev;
 	(void)ctrl;
 	(void)resp;
@@ -194,7 +375,7 @@ static void
 uvc_events_process_control(struct uvc_device *dev, uint8_t req, uint8_t cs, uint8_t len,
 			   struct uvc_request_data *resp)
 {
-	printf("control request (req %s cs %s)\n", uvc_request_name(req), pu_control_name(cs));
+	log_debug("control request (req %s cs %s)\n", uvc_request_name(req), pu_control_name(cs));
 	(void)dev;
 
 	/*
@@ -211,7 +392,7 @@ uvc_events_process_streaming(struct uvc_device *dev, uint8_t req, uint8_t cs,
 {
 	struct uvc_streaming_control *ctrl;
 
-	printf("streaming request (req %s cs %02x)\n", uvc_request_name(req), cs);
+	log_debug("streaming request (req %s cs %02x)\n", uvc_request_name(req), cs);
 
 	if (cs != UVC_VS_PROBE_CONTROL && cs != UVC_VS_COMMIT_CONTROL)
 		return;
@@ -236,7 +417,10 @@ uvc_events_process_streaming(struct uvc_device *dev, uint8_t req, uint8_t cs,
 	case UVC_GET_MAX:
 	case UVC_GET_DEF:
 		if (req == UVC_GET_MAX)
-			uvc_fill_streaming_control(dev, ctrl, -1, -1, UINT_MAX);
+			memcpy(ctrl, &dev->modes[dev->num_modes - 1].ctrl,
+			       sizeof *ctrl);
+		else if (req == UVC_GET_MIN)
+			memcpy(ctrl, &dev->modes[0].ctrl, sizeof *ctrl);
 		else
 			uvc_fill_streaming_control(dev, ctrl, 1, 1, 0);
 		break;
@@ -281,7 +465,7 @@ uvc_events_process_setup(struct uvc_device *dev,
 {
 	dev->control = 0;
 
-	printf("bRequestType %02x bRequest %02x wValue %04x wIndex %04x "
+	log_debug("bRequestType %02x bRequest %02x wValue %04x wIndex %04x "
 		"wLength %04x\n", ctrl->bRequestType, ctrl->bRequest,
 		ctrl->wValue, ctrl->wIndex, ctrl->wLength);
 
@@ -306,31 +490,38 @@ uvc_events_process_data(struct uvc_device *dev,
 	const struct uvc_streaming_control *ctrl =
 		(const struct uvc_streaming_control *)&data->data;
 	struct uvc_streaming_control *target;
+	bool steered;
 
 	switch (dev->control) {
 	case UVC_VS_PROBE_CONTROL:
-		printf("setting probe control, length = %d\n", data->length);
+		log_debug("setting probe control, length = %d\n", data->length);
 		target = &dev->probe;
 		break;
 
 	case UVC_VS_COMMIT_CONTROL:
-		printf("setting commit control, length = %d\n", data->length);
+		log_debug("setting commit control, length = %d\n", data->length);
 		target = &dev->commit;
 		break;
 
 	default:
-		printf("setting unknown control, length = %d\n", data->length);
+		log_debug("setting unknown control, length = %d\n", data->length);
 		return;
 	}
 
-	uvc_fill_streaming_control(dev, target, ctrl->bFormatIndex,
-				   ctrl->bFrameIndex, ctrl->dwFrameInterval);
+	memcpy(target, uvc_find_streaming_control(dev, ctrl->bFormatIndex,
+						  ctrl->bFrameIndex,
+						  ctrl->dwFrameInterval,
+						  &steered),
+	       sizeof *target);
+
+	if (steered)
+		log_info("interval %u exceeds the available bandwidth, using %u\n",
+			 ctrl->dwFrameInterval, target->dwFrameInterval);
 
 	if (dev->control == UVC_VS_COMMIT_CONTROL) {
 		const struct uvc_function_config_format *format;
 		const struct uvc_function_config_frame *frame;
 		struct v4l2_pix_format pixfmt;
-		unsigned int fps;
 
 		format = &dev->fc->streaming.formats[target->bFormatIndex-1];
 		frame = &format->frames[target->bFrameIndex-1];
@@ -349,9 +540,161 @@ uvc_events_process_data(struct uvc_device *dev,
 
 		uvc_stream_set_format(dev->stream, &pixfmt);
 
-		/* fps is guaranteed to be non-zero and thus valid. */
-		fps = 1.0 / (target->dwFrameInterval / 10000000.0);
-		uvc_stream_set_frame_rate(dev->stream, fps);
+		/* The interval is guaranteed to be non-zero and thus valid. */
+		uvc_stream_set_frame_rate(dev->stream, target->dwFrameInterval);
+	}
+}
+
+/* ---------------------------------------------------------------------------
+ * Bandwidth
+ */
+
+/*
+ * The gadget driver prepends a payload header of up to 12 bytes to the data
+ * sent in every service interval.
+ */
+#define UVC_PAYLOAD_HEADER_SIZE		12
+
+static const char *uvc_speed_names[] = {
+	[USB_SPEED_UNKNOWN] = "UNKNOWN",
+	[USB_SPEED_LOW] = "low-speed",
+	[USB_SPEED_FULL] = "full-speed",
+	[USB_SPEED_HIGH] = "high-speed",
+	[USB_SPEED_WIRELESS] = "wireless",
+	[USB_SPEED_SUPER] = "super-speed",
+	[USB_SPEED_SUPER_PLUS] = "super-speed-plus",
+};
+
+static const char *uvc_speed_name(enum usb_device_speed speed)
+{
+	if ((unsigned int)speed < ARRAY_SIZE(uvc_speed_names))
+		return uvc_speed_names[speed];
+	else
+		return "UNKNOWN";
+}
+
+/*
+ * Read the bus speed of the UDC from sysfs. The current speed is only known
+ * when the gadget is connected, fall back to the maximum speed supported by
+ * the UDC otherwise, and to high-speed if the UDC is unknown.
+ */
+static enum usb_device_speed uvc_udc_speed(const char *udc)
+{
+	static const char * const attributes[] = {
+		"current_speed",
+		"maximum_speed",
+	};
+	unsigned int i, j;
+
+	for (i = 0; udc && i < ARRAY_SIZE(attributes); ++i) {
+		char path[PATH_MAX];
+		char buf[32];
+		FILE *file;
+
+		snprintf(path, sizeof path, "/sys/class/udc/%s/%s", udc,
+			 attributes[i]);
+
+		file = fopen(path, "r");
+		if (!file)
+			continue;
+
+		if (!fgets(buf, sizeof buf, file))
+			buf[0] = '\0';
+		fclose(file);
+
+		buf[strcspn(buf, "\n")] = '\0';
+
+		for (j = USB_SPEED_LOW; j < ARRAY_SIZE(uvc_speed_names); ++j) {
+			if (!strcmp(buf, uvc_speed_names[j]))
+				return j;
+		}
+	}
+
+	return USB_SPEED_HIGH;
+}
+
+/*
+ * Compute the number of bytes the isochronous streaming endpoint can transfer
+ * in one service interval, and the length of the service interval in
+ * microseconds, at the given bus speed. The wMaxPacketSize value includes the
+ * high-bandwidth multiplier, and bMaxBurst only applies to super-speed.
+ */
+static unsigned int
+uvc_endpoint_payload(const struct uvc_function_config_endpoint *ep,
+		     enum usb_device_speed speed, unsigned int *period)
+{
+	unsigned int interval;
+
+	interval = clamp_t(unsigned int, ep->bInterval, 1U, 16U);
+
+	switch (speed) {
+	case USB_SPEED_LOW:
+	case USB_SPEED_FULL:
+		*period = 1000 << (interval - 1);
+		return min(ep->wMaxPacketSize, 1023U);
+
+	case USB_SPEED_HIGH:
+	case USB_SPEED_WIRELESS:
+	case USB_SPEED_UNKNOWN:
+		*period = 125 << (interval - 1);
+		return min(ep->wMaxPacketSize, 3072U);
+
+	default:
+		*period = 125 << (interval - 1);
+		return min(ep->wMaxPacketSize, 3072U)
+		     * (min(ep->bMaxBurst, 15U) + 1);
+	}
+}
+
+static void uvc_set_speed(struct uvc_device *dev, enum usb_device_speed speed)
+{
+	unsigned int payload;
+	unsigned int period;
+	unsigned int i;
+
+	payload = uvc_endpoint_payload(&dev->fc->streaming.ep, speed, &period);
+
+	dev->speed = speed;
+	dev->bandwidth = payload > UVC_PAYLOAD_HEADER_SIZE
+		       ? (uint64_t)(payload - UVC_PAYLOAD_HEADER_SIZE)
+			 * 1000000 / period
+		       : 0;
+
+	for (i = 0; i < dev->num_modes; ++i)
+		dev->modes[i].ctrl.dwMaxPayloadTransferSize = payload;
+
+	/* Renegotiate the defaults, they may not fit at the new speed. */
+	uvc_fill_streaming_control(dev, &dev->probe, 1, 1, 0);
+	uvc_fill_streaming_control(dev, &dev->commit, 1, 1, 0);
+}
+
+static void uvc_report_modes(struct uvc_device *dev)
+{
+	const struct uvc_function_config_streaming *streaming = &dev->fc->streaming;
+	unsigned int i;
+
+	log_info("streaming modes at %s, endpoint bandwidth %" PRIu64 " bytes/s\n",
+		 uvc_speed_name(dev->speed), dev->bandwidth);
+
+	for (i = 0; i < dev->num_modes; ++i) {
+		const struct uvc_mode *mode = &dev->modes[i];
+		const struct uvc_streaming_control *ctrl = &mode->ctrl;
+		const struct uvc_function_config_format *format =
+			&streaming->formats[ctrl->bFormatIndex - 1];
+		const struct uvc_function_config_frame *frame =
+			&format->frames[ctrl->bFrameIndex - 1];
+
+		unsigned int fps = ctrl->dwFrameInterval
+				 ? 1000000000 / ctrl->dwFrameInterval : 0;
+
+		log_info("  %c%c%c%c %ux%u %u.%02u fps: %" PRIu64 " bytes/s%s %s\n",
+			 format->fcc & 0xff, (format->fcc >> 8) & 0xff,
+			 (format->fcc >> 16) & 0xff, (format->fcc >> 24) & 0xff,
+			 frame->width, frame->height,
+			 fps / 100, fps % 100,
+			 mode->bandwidth,
+			 format->fcc == V4L2_PIX_FMT_MJPEG ? " (estimated)" : "",
+			 mode->bandwidth <= dev->bandwidth ? "ok" : "exceeds bandwidth");
 	}
 }
 
@@ -363,18 +706,21 @@ static void uvc_events_process(void *d)
 	struct uvc_request_data resp;
 	int ret;
 
-	ret = ioctl(dev->vdev->fd, VIDIOC_DQEVENT, &v4l2_event);
-	if (ret < 0) {
-		printf("VIDIOC_DQEVENT failed: %s (%d)\n", strerror(errno),
-			errno);
+	ret = dev->transport->ops->dequeue_event(dev->transport, &v4l2_event);
+	if (ret < 0)
 		return;
-	}
 
 	memset(&resp, 0, sizeof resp);
 	resp.length = -EL2HLT;
 
 	switch (v4l2_event.type) {
 	case UVC_EVENT_CONNECT:
+		if (uvc_event->speed != dev->speed) {
+			uvc_set_speed(dev, uvc_event->speed);
+			uvc_report_modes(dev);
+		}
+		return;
+
 	case UVC_EVENT_DISCONNECT:
 		return;
 
@@ -395,12 +741,7 @@ static void uvc_events_process(void *d)
 		return;
 	}
 
-	ret = ioctl(dev->vdev->fd, UVCIOC_SEND_RESPONSE, &resp);
-	if (ret < 0) {
-		printf("UVCIOC_SEND_RESPONSE failed: %s (%d)\n",
-		       strerror(errno), errno);
-		return;
-	}
+	dev->transport->ops->send_response(dev->transport, &resp);
 }
 
 /* ---------------------------------------------------------------------------
@@ -409,41 +750,213 @@ static void uvc_events_process(void *d)
 
 void uvc_events_init(struct uvc_device *dev, struct events *events)
 {
-	struct v4l2_event_subscription sub;
+	static const unsigned int types[] = {
+		UVC_EVENT_CONNECT,
+		UVC_EVENT_SETUP,
+		UVC_EVENT_DATA,
+		UVC_EVENT_STREAMON,
+		UVC_EVENT_STREAMOFF,
+	};
+	struct uvc_transport *transport = dev->transport;
+	unsigned int i;
 
 	/* Default to the minimum values. */
 	uvc_fill_streaming_control(dev, &dev->probe, 1, 1, 0);
 	uvc_fill_streaming_control(dev, &dev->commit, 1, 1, 0);
 
-	memset(&sub, 0, sizeof sub);
-	sub.type = UVC_EVENT_SETUP;
-	ioctl(dev->vdev->fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
-	sub.type = UVC_EVENT_DATA;
-	ioctl(dev->vdev->fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
-	sub.type = UVC_EVENT_STREAMON;
-	ioctl(dev->vdev->fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
-	sub.type = UVC_EVENT_STREAMOFF;
-	ioctl(dev->vdev->fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
-
-	events_watch_fd(events, dev->vdev->fd, EVENT_EXCEPTION,
+	for (i = 0; i < ARRAY_SIZE(types); ++i) {
+		if (transport->ops->subscribe_event)
+			transport->ops->subscribe_event(transport, types[i]);
+	}
+
+	dev->events = events;
+	events_watch_fd(events, transport->fd, transport->fd_event,
 			uvc_events_process, dev);
+
+	if (dev->sink)
+		video_sink_init(dev->sink, events);
 }
 
-void uvc_set_config(struct uvc_device *dev, struct uvc_function_config *fc)
+/*
+ * Compute the maximum size in bytes of a single frame. This switch will need
+ * extending for any new format added to the uvc_formats table in
+ * uvc-formats.h. MJPEG frames are bounded by the size of a YUYV frame.
+ *
+ * For compressed formats, the bandwidth is computed from an estimate of the
+ * compressed frame size instead, as the maximum size is far from typical.
+ */
+static unsigned int uvc_max_frame_size(unsigned int fcc, unsigned int width,
+				       unsigned int height)
 {
-	dev->fc = fc;
+	switch (fcc) {
+	case V4L2_PIX_FMT_GREY:
+		return width * height;
+
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+		return width * height * 3 / 2;
+
+	case V4L2_PIX_FMT_MJPEG:
+	case V4L2_PIX_FMT_Y10:
+	case V4L2_PIX_FMT_Y12:
+	case V4L2_PIX_FMT_Y16:
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_RGB565:
+		return width * height * 2;
+
+	default:
+		return 0;
+	}
 }
 
-int uvc_set_format(struct uvc_device *dev, struct v4l2_pix_format *format)
+/*
+ * Estimate the typical size of a frame. MJPEG frames produced by hardware and
+ * software encoders at usual quality settings are compressed by a factor of
+ * roughly 6 to 10 compared to YUYV, use the lower bound to stay on the safe
+ * side.
+ */
+#define UVC_MJPEG_COMPRESSION_RATIO	6
+
+static unsigned int uvc_estimated_frame_size(unsigned int fcc,
+					     unsigned int max_size)
 {
-	return v4l2_set_format(dev->vdev, format);
+	if (fcc == V4L2_PIX_FMT_MJPEG)
+		return max_size / UVC_MJPEG_COMPRESSION_RATIO;
+
+	return max_size;
 }
 
-struct v4l2_device *uvc_v4l2_device(struct uvc_device *dev)
+static int uvc_interval_compare(const void *a, const void *b)
 {
-	/*
-	 * TODO: The V4L2 device shouldn't be exposed. We should replace this
-	 * with an abstract video sink class when one will be avaiilable.
-	 */
-	return dev->vdev;
+	unsigned int ia = *(const unsigned int *)a;
+	unsigned int ib = *(const unsigned int *)b;
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+/*
+ * Build the probe/commit negotiation table from the function configuration.
+ * All streaming controls are computed here once, control requests from the
+ * host are then answered with table lookups.
+ */
+static int uvc_build_modes(struct uvc_device *dev)
+{
+	const struct uvc_function_config_streaming *streaming = &dev->fc->streaming;
+	unsigned int num_frames = 0;
+	unsigned int num_modes = 0;
+	unsigned int iformat, iframe, i;
+	struct uvc_mode *mode;
+
+	for (iformat = 0; iformat < streaming->num_formats; ++iformat) {
+		const struct uvc_function_config_format *format =
+			&streaming->formats[iformat];
+
+		for (iframe = 0; iframe < format->num_frames; ++iframe) {
+			if (!format->frames[iframe].num_intervals) {
+				log_error("format %u frame %u has no interval\n",
+					  iformat + 1, iframe + 1);
+				return -EINVAL;
+			}
+
+			num_modes += format->frames[iframe].num_intervals;
+		}
+
+		if (!format->num_frames) {
+			log_error("format %u has no frame\n", iformat + 1);
+			return -EINVAL;
+		}
+
+		num_frames += format->num_frames;
+	}
+
+	if (!num_modes) {
+		log_error("no streaming format configured\n");
+		return -EINVAL;
+	}
+
+	dev->modes = calloc(num_modes, sizeof *dev->modes);
+	dev->frames = calloc(num_frames, sizeof *dev->frames);
+	dev->format_frames = calloc(streaming->num_formats,
+				    sizeof *dev->format_frames);
+	if (!dev->modes || !dev->frames || !dev->format_frames) {
+		uvc_free_modes(dev);
+		return -ENOMEM;
+	}
+
+	dev->num_modes = num_modes;
+	mode = dev->modes;
+	num_frames = 0;
+
+	for (iformat = 0; iformat < streaming->num_formats; ++iformat) {
+		const struct uvc_function_config_format *format =
+			&streaming->formats[iformat];
+
+		dev->format_frames[iformat] = num_frames;
+
+		for (iframe = 0; iframe < format->num_frames; ++iframe) {
+			const struct uvc_function_config_frame *frame =
+				&format->frames[iframe];
+			struct uvc_frame_modes *modes = &dev->frames[num_frames++];
+			unsigned int size;
+
+			size = uvc_max_frame_size(format->fcc, frame->width,
+						  frame->height);
+			if (!size)
+				log_warning("format %u: unknown frame size for fourcc %08x\n",
+					    iformat + 1, format->fcc);
+
+			/* Lookups rely on the intervals being sorted. */
+			qsort(frame->intervals, frame->num_intervals,
+			      sizeof *frame->intervals, uvc_interval_compare);
+
+			modes->first = mode - dev->modes;
+			modes->count = frame->num_intervals;
+
+			for (i = 0; i < frame->num_intervals; ++i, ++mode) {
+				struct uvc_streaming_control *ctrl = &mode->ctrl;
+				unsigned int ival = frame->intervals[i];
+
+				ctrl->bmHint = 1;
+				ctrl->bFormatIndex = iformat + 1;
+				ctrl->bFrameIndex = iframe + 1;
+				ctrl->dwFrameInterval = ival;
+				ctrl->dwMaxVideoFrameSize = size;
+				ctrl->bmFramingInfo = 3;
+				ctrl->bPreferedVersion = 1;
+				ctrl->bMaxVersion = 1;
+
+				mode->bandwidth = ival
+						? (uint64_t)uvc_estimated_frame_size(format->fcc, size)
+						  * 10000000 / ival
+						: 0;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int uvc_set_config(struct uvc_device *dev, struct uvc_function_config *fc)
+{
+	int ret;
+
+	uvc_free_modes(dev);
+
+	dev->fc = fc;
+
+	ret = uvc_build_modes(dev);
+	if (ret < 0)
+		return ret;
+
+	uvc_set_speed(dev, uvc_udc_speed(fc->udc));
+	uvc_report_modes(dev);
+
+	return 0;
+}
+
+struct video_sink *uvc_video_sink(struct uvc_device *dev)
+{
+	return dev->sink;
 }
@@ -10,17 +10,57 @@
 #ifndef __UVC_H__
 #define __UVC_H__
 
-struct events;
-struct v4l2_device;
+#include <linux/usb/g_uvc.h>
+#include <linux/videodev2.h>
+
+#include "events.h"
+
 struct uvc_device;
 struct uvc_function_config;
+struct uvc_host_emulator;
 struct uvc_stream;
+struct uvc_transport;
+struct video_sink;
+
+/*
+ * struct uvc_transport_ops - UVC event transport operations
+ * @subscribe_event: Subscribe to a UVC event type (optional)
+ * @dequeue_event: Dequeue the next UVC event, called when the transport file
+ *	descriptor signals an event
+ * @send_response: Send the response to a setup request
+ */
+struct uvc_transport_ops {
+	int(*subscribe_event)(struct uvc_transport *transport, unsigned int type);
+	int(*dequeue_event)(struct uvc_transport *transport,
+			    struct v4l2_event *event);
+	int(*send_response)(struct uvc_transport *transport,
+			    struct uvc_request_data *resp);
+};
+
+/*
+ * struct uvc_transport - Transport for UVC events and responses
+ * @ops: Transport operations
+ * @fd: File descriptor that signals pending events
+ * @fd_event: Event type to watch @fd for
+ *
+ * UVC events are delivered by the UVC gadget V4L2 device by default. Other
+ * transports, such as the host emulator, replace it to drive the protocol
+ * handling without a UDC.
+ */
+struct uvc_transport {
+	const struct uvc_transport_ops *ops;
+	int fd;
+	enum event_type fd_event;
+};
 
 struct uvc_device *uvc_open(const char *devname, struct uvc_stream *stream);
+struct uvc_device *uvc_open_transport(struct uvc_transport *transport,
+				      struct uvc_stream *stream);
 void uvc_close(struct uvc_device *dev);
 void uvc_events_init(struct uvc_device *dev, struct events *events);
-void uvc_set_config(struct uvc_device *dev, struct uvc_function_config *fc);
-int uvc_set_format(struct uvc_device *dev, struct v4l2_pix_format *format);
-struct v4l2_device *uvc_v4l2_device(struct uvc_device *dev);
+int uvc_set_config(struct uvc_device *dev, struct uvc_function_config *fc);
+struct video_sink *uvc_video_sink(struct uvc_device *dev);
+
+struct uvc_transport *uvc_host_emulator_transport(struct uvc_host_emulator *host);
 
 #endif /* __UVC_H__ */
@@ -0,0 +1,145 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * V4L2 video sink
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "events.h"
+#include "tools.h"
+#include "v4l2.h"
+#include "v4l2-sink.h"
+#include "video-buffers.h"
+
+struct v4l2_sink {
+	struct video_sink sink;
+
+	struct v4l2_device *vdev;
+};
+
+#define to_v4l2_sink(s) container_of(s, struct v4l2_sink, sink)
+
+static void v4l2_sink_process(void *d)
+{
+	struct v4l2_sink *sink = d;
+	struct video_buffer buf;
+	int ret;
+
+	ret = v4l2_dequeue_buffer(sink->vdev, &buf);
+	if (ret < 0)
+		return;
+
+	sink->sink.handler(sink->sink.handler_data, &sink->sink, &buf);
+}
+
+static void v4l2_sink_destroy(struct video_sink *s)
+{
+	free(to_v4l2_sink(s));
+}
+
+static int v4l2_sink_set_format(struct video_sink *s,
+				struct v4l2_pix_format *fmt)
+{
+	struct v4l2_sink *sink = to_v4l2_sink(s);
+
+	return v4l2_set_format(sink->vdev, fmt);
+}
+
+static int v4l2_sink_alloc_buffers(struct video_sink *s,
+				   enum v4l2_memory memtype, unsigned int nbufs)
+{
+	struct v4l2_sink *sink = to_v4l2_sink(s);
+
+	return v4l2_alloc_buffers(sink->vdev, memtype, nbufs);
+}
+
+static int v4l2_sink_mmap_buffers(struct video_sink *s,
+				  struct video_buffer_set **buffers)
+{
+	struct v4l2_sink *sink = to_v4l2_sink(s);
+	int ret;
+
+	ret = v4l2_mmap_buffers(sink->vdev);
+	if (ret < 0)
+		return ret;
+
+	*buffers = &sink->vdev->buffers;
+	return 0;
+}
+
+static int v4l2_sink_import_buffers(struct video_sink *s,
+				    const struct video_buffer_set *buffers)
+{
+	struct v4l2_sink *sink = to_v4l2_sink(s);
+
+	return v4l2_import_buffers(sink->vdev, buffers);
+}
+
+static int v4l2_sink_free_buffers(struct video_sink *s)
+{
+	struct v4l2_sink *sink = to_v4l2_sink(s);
+
+	return v4l2_free_buffers(sink->vdev);
+}
+
+static int v4l2_sink_stream_on(struct video_sink *s)
+{
+	struct v4l2_sink *sink = to_v4l2_sink(s);
+	int ret;
+
+	ret = v4l2_stream_on(sink->vdev);
+	if (ret < 0)
+		return ret;
+
+	events_watch_fd(sink->sink.events, sink->vdev->fd, EVENT_WRITE,
+			v4l2_sink_process, sink);
+
+	return 0;
+}
+
+static int v4l2_sink_stream_off(struct video_sink *s)
+{
+	struct v4l2_sink *sink = to_v4l2_sink(s);
+
+	events_unwatch_fd(sink->sink.events, sink->vdev->fd, EVENT_WRITE);
+
+	return v4l2_stream_off(sink->vdev);
+}
+
+static int v4l2_sink_queue_buffer(struct video_sink *s,
+				  struct video_buffer *buf)
+{
+	struct v4l2_sink *sink = to_v4l2_sink(s);
+
+	return v4l2_queue_buffer(sink->vdev, buf);
+}
+
+static const struct video_sink_ops v4l2_sink_ops = {
+	.destroy = v4l2_sink_destroy,
+	.set_format = v4l2_sink_set_format,
+	.alloc_buffers = v4l2_sink_alloc_buffers,
+	.mmap_buffers = v4l2_sink_mmap_buffers,
+	.import_buffers = v4l2_sink_import_buffers,
+	.free_buffers = v4l2_sink_free_buffers,
+	.stream_on = v4l2_sink_stream_on,
+	.stream_off = v4l2_sink_stream_off,
+	.queue_buffer = v4l2_sink_queue_buffer,
+};
+
+struct video_sink *v4l2_video_sink_create(struct v4l2_device *dev)
+{
+	struct v4l2_sink *sink;
+
+	sink = malloc(sizeof *sink);
+	if (!sink)
+		return NULL;
+
+	memset(sink, 0, sizeof *sink);
+	sink->sink.ops = &v4l2_sink_ops;
+	sink->vdev = dev;
+
+	return &sink->sink;
+}
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * V4L2 video sink
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+#ifndef __V4L2_VIDEO_SINK_H__
+#define __V4L2_VIDEO_SINK_H__
+
+#include "video-sink.h"
+
+struct v4l2_device;
+
+/*
+ * v4l2_video_sink_create - Create a video sink for a V4L2 output device
+ * @dev: V4L2 output device, opened by the caller
+ *
+ * The sink doesn't take ownership of @dev, which must outlive the sink.
+ *
+ * Returns the new sink on success, or NULL if memory can't be allocated.
+ */
+struct video_sink *v4l2_video_sink_create(struct v4l2_device *dev);
+
+#endif /* __V4L2_VIDEO_SINK_H__ */
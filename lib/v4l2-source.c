@@ -57,18 +57,24 @@ static int v4l2_source_set_format(struct video_source *s,
 	return v4l2_set_format(src->vdev, fmt);
 }
 
-static int v4l2_source_set_frame_rate(struct video_source *s, unsigned int fps)
+static int v4l2_source_set_frame_rate(struct video_source *s,
+				      unsigned int interval)
 {
 	struct v4l2_source *src = to_v4l2_source(s);
 
-	return v4l2_set_frame_rate(src->vdev, fps);
+	return v4l2_set_frame_rate(src->vdev, interval);
 }
 
 static int v4l2_source_alloc_buffers(struct video_source *s, unsigned int nbufs)
 {
 	struct v4l2_source *src = to_v4l2_source(s);
+	int ret;
+
+	ret = v4l2_alloc_buffers(src->vdev, V4L2_MEMORY_MMAP, nbufs);
+	if (ret < 0)
+		return ret;
 
-	return v4l2_alloc_buffers(src->vdev, V4L2_MEMORY_MMAP, nbufs);
+	return src->vdev->buffers.nbufs;
 }
 
 static int v4l2_source_export_buffers(struct video_source *s,
@@ -28,10 +28,13 @@
 #include <sys/time.h>
 
 #include "list.h"
+#include "log.h"
 #include "tools.h"
 #include "v4l2.h"
 #include "video-buffers.h"
 
+UVC_LOG_MODULE(v4l2);
+
 #ifndef V4L2_BUF_FLAG_ERROR
 #define V4L2_BUF_FLAG_ERROR	0x0040
 #endif
@@ -88,16 +91,16 @@ v4l2_enum_frame_intervals(struct v4l2_device *dev, struct v4l2_format_desc *form
 			break;
 
 		if (i != ivalenum.index)
-			printf("Warning: driver returned wrong ival index "
+			log_warning("Warning: driver returned wrong ival index "
 				"%u.\n", ivalenum.index);
 		if (format->pixelformat != ivalenum.pixel_format)
-			printf("Warning: driver returned wrong ival pixel "
+			log_warning("Warning: driver returned wrong ival pixel "
 				"format %08x.\n", ivalenum.pixel_format);
 		if (frame->min_width != ivalenum.width)
-			printf("Warning: driver returned wrong ival width "
+			log_warning("Warning: driver returned wrong ival width "
 				"%u.\n", ivalenum.width);
 		if (frame->min_height != ivalenum.height)
-			printf("Warning: driver returned wrong ival height "
+			log_warning("Warning: driver returned wrong ival height "
 				"%u.\n", ivalenum.height);
 
 		ival = malloc(sizeof *ival);
@@ -121,7 +124,7 @@ v4l2_enum_frame_intervals(struct v4l2_device *dev, struct v4l2_format_desc *form
 			break;
 
 		default:
-			printf("Error: driver returned invalid frame ival "
+			log_error("Error: driver returned invalid frame ival "
 				"type %u\n", ivalenum.type);
 			return -EINVAL;
 		}
@@ -151,10 +154,10 @@ v4l2_enum_frame_sizes(struct v4l2_device *dev, struct v4l2_format_desc *format)
 			break;
 
 		if (i != frmenum.index)
-			printf("Warning: driver returned wrong frame index "
+			log_warning("Warning: driver returned wrong frame index "
 				"%u.\n", frmenum.index);
 		if (format->pixelformat != frmenum.pixel_format)
-			printf("Warning: driver returned wrong frame pixel "
+			log_warning("Warning: driver returned wrong frame pixel "
 				"format %08x.\n", frmenum.pixel_format);
 
 		frame = malloc(sizeof *frame);
@@ -187,7 +190,7 @@ v4l2_enum_frame_sizes(struct v4l2_device *dev, struct v4l2_format_desc *format)
 			break;
 
 		default:
-			printf("Error: driver returned invalid frame size "
+			log_error("Error: driver returned invalid frame size "
 				"type %u\n", frmenum.type);
 			return -EINVAL;
 		}
@@ -219,10 +222,10 @@ static int v4l2_enum_formats(struct v4l2_device *dev)
 			break;
 
 		if (i != fmtenum.index)
-			printf("Warning: driver returned wrong format index "
+			log_warning("Warning: driver returned wrong format index "
 				"%u.\n", fmtenum.index);
 		if (dev->type != fmtenum.type)
-			printf("Warning: driver returned wrong format type "
+			log_warning("Warning: driver returned wrong format type "
 				"%u.\n", fmtenum.type);
 
 		format = malloc(sizeof *format);
@@ -266,7 +269,7 @@ struct v4l2_device *v4l2_open(const char *devname)
 
 	dev->fd = open(devname, O_RDWR | O_NONBLOCK);
 	if (dev->fd < 0) {
-		printf("Error opening device %s: %d.\n", devname, errno);
+		log_error("Error opening device %s: %d.\n", devname, errno);
 		v4l2_close(dev);
 		return NULL;
 	}
@@ -274,7 +277,7 @@ struct v4l2_device *v4l2_open(const char *devname)
 	memset(&cap, 0, sizeof cap);
 	ret = ioctl(dev->fd, VIDIOC_QUERYCAP, &cap);
 	if (ret < 0) {
-		printf("Error opening device %s: unable to query "
+		log_error("Error opening device %s: unable to query "
 			"device.\n", devname);
 		v4l2_close(dev);
 		return NULL;
@@ -291,7 +294,7 @@ struct v4l2_device *v4l2_open(const char *devname)
 	else if (capabilities & V4L2_CAP_VIDEO_OUTPUT)
 		dev->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
 	else {
-		printf("Error opening device %s: neither video capture "
+		log_error("Error opening device %s: neither video capture "
 			"nor video output supported.\n", devname);
 		v4l2_close(dev);
 		return NULL;
@@ -299,13 +302,13 @@ struct v4l2_device *v4l2_open(const char *devname)
 
 	ret = v4l2_enum_formats(dev);
 	if (ret < 0) {
-		printf("Error opening device %s: unable to enumerate "
+		log_error("Error opening device %s: unable to enumerate "
 			"formats.\n", devname);
 		v4l2_close(dev);
 		return NULL;
 	}
 
-	printf("Device %s opened: %s (%s).\n", devname, cap.card, cap.bus_info);
+	log_info("Device %s opened: %s (%s).\n", devname, cap.card, cap.bus_info);
 
 	return dev;
 }
@@ -347,7 +350,7 @@ int v4l2_get_control(struct v4l2_device *dev, unsigned int id, int32_t *value)
 
 	ret = ioctl(dev->fd, VIDIOC_G_CTRL, &ctrl);
 	if (ret < 0) {
-		printf("%s: unable to get control (%d).\n", dev->name, errno);
+		log_error("%s: unable to get control (%d).\n", dev->name, errno);
 		return -errno;
 	}
 
@@ -365,7 +368,7 @@ int v4l2_set_control(struct v4l2_device *dev, unsigned int id, int32_t *value)
 
 	ret = ioctl(dev->fd, VIDIOC_S_CTRL, &ctrl);
 	if (ret < 0) {
-		printf("%s: unable to set control (%d).\n", dev->name, errno);
+		log_error("%s: unable to set control (%d).\n", dev->name, errno);
 		return -errno;
 	}
 
@@ -385,8 +388,8 @@ int v4l2_get_controls(struct v4l2_device *dev, unsigned int count,
 
 	ret = ioctl(dev->fd, VIDIOC_G_EXT_CTRLS, &controls);
 	if (ret < 0)
-		printf("%s: unable to get multiple controls (%d).\n", dev->name,
-		       errno);
+		log_error("%s: unable to get multiple controls (%d).\n", dev->name,
+			  errno);
 
 	return ret;
 }
@@ -403,8 +406,8 @@ int v4l2_set_controls(struct v4l2_device *dev, unsigned int count,
 
 	ret = ioctl(dev->fd, VIDIOC_S_EXT_CTRLS, &controls);
 	if (ret < 0)
-		printf("%s: unable to set multiple controls (%d).\n", dev->name,
-		       errno);
+		log_error("%s: unable to set multiple controls (%d).\n", dev->name,
+			  errno);
 
 	return ret;
 }
@@ -423,8 +426,8 @@ int v4l2_get_crop(struct v4l2_device *dev, struct v4l2_rect *rect)
 
 	ret = ioctl(dev->fd, VIDIOC_G_CROP, &crop);
 	if (ret < 0) {
-		printf("%s: unable to get crop rectangle (%d).\n", dev->name,
-		       errno);
+		log_error("%s: unable to get crop rectangle (%d).\n", dev->name,
+			  errno);
 		return -errno;
 	}
 
@@ -445,8 +448,8 @@ int v4l2_set_crop(struct v4l2_device *dev, struct v4l2_rect *rect)
 
 	ret = ioctl(dev->fd, VIDIOC_S_CROP, &crop);
 	if (ret < 0) {
-		printf("%s: unable to set crop rectangle (%d).\n", dev->name,
-		       errno);
+		log_error("%s: unable to set crop rectangle (%d).\n", dev->name,
+			  errno);
 		return -errno;
 	}
 
@@ -466,7 +469,7 @@ int v4l2_get_format(struct v4l2_device *dev, struct v4l2_pix_format *format)
 
 	ret = ioctl(dev->fd, VIDIOC_G_FMT, &fmt);
 	if (ret < 0) {
-		printf("%s: unable to get format (%d).\n", dev->name, errno);
+		log_error("%s: unable to get format (%d).\n", dev->name, errno);
 		return -errno;
 	}
 
@@ -491,7 +494,7 @@ int v4l2_set_format(struct v4l2_device *dev, struct v4l2_pix_format *format)
 
 	ret = ioctl(dev->fd, VIDIOC_S_FMT, &fmt);
 	if (ret < 0) {
-		printf("%s: unable to set format (%d).\n", dev->name, errno);
+		log_error("%s: unable to set format (%d).\n", dev->name, errno);
 		return -errno;
 	}
 
@@ -501,23 +504,30 @@ int v4l2_set_format(struct v4l2_device *dev, struct v4l2_pix_format *format)
 	return 0;
 }
 
-int v4l2_set_frame_rate(struct v4l2_device *dev, unsigned int fps)
+int v4l2_set_frame_rate(struct v4l2_device *dev, unsigned int interval)
 {
+	struct v4l2_fract *tpf;
 	struct v4l2_streamparm parm;
 	int ret;
 
 	memset(&parm, 0, sizeof parm);
 	parm.type = dev->type;
-	parm.parm.capture.timeperframe.numerator = 1;
-	parm.parm.capture.timeperframe.denominator = fps;
+	tpf = &parm.parm.capture.timeperframe;
+	tpf->numerator = interval;
+	tpf->denominator = 10000000;
 
 	ret = ioctl(dev->fd, VIDIOC_S_PARM, &parm);
 	if (ret < 0) {
-		printf("%s: unable to set frame rate (%d).\n", dev->name, errno);
+		log_error("%s: unable to set frame rate (%d).\n", dev->name, errno);
 		return -errno;
 	}
 
-	dev->fps = fps;
+	if (tpf->denominator)
+		dev->interval = (uint64_t)tpf->numerator * 10000000
+			      / tpf->denominator;
+	else
+		dev->interval = interval;
+
 	return 0;
 }
 
@@ -546,20 +556,20 @@ int v4l2_alloc_buffers(struct v4l2_device *dev, enum v4l2_memory memtype,
 
 	ret = ioctl(dev->fd, VIDIOC_REQBUFS, &rb);
 	if (ret < 0) {
-		printf("%s: unable to request buffers (%d).\n", dev->name,
-		       errno);
+		log_error("%s: unable to request buffers (%d).\n", dev->name,
+			  errno);
 		ret = -errno;
 		goto done;
 	}
 
 	if (rb.count > nbufs) {
-		printf("%s: driver needs more buffers (%u) than available (%u).\n",
-		       dev->name, rb.count, nbufs);
+		log_error("%s: driver needs more buffers (%u) than available (%u).\n",
+			  dev->name, rb.count, nbufs);
 		ret = -E2BIG;
 		goto done;
 	}
 
-	printf("%s: %u buffers requested.\n", dev->name, rb.count);
+	log_info("%s: %u buffers requested.\n", dev->name, rb.count);
 
 	/* Allocate the buffer objects. */
 	dev->memtype = memtype;
@@ -600,8 +610,8 @@ int v4l2_free_buffers(struct v4l2_device *dev)
 		if (buffer->mem) {
 			ret = munmap(buffer->mem, buffer->size);
 			if (ret < 0) {
-				printf("%s: unable to unmap buffer %u (%d)\n",
-				       dev->name, i, errno);
+				log_error("%s: unable to unmap buffer %u (%d)\n",
+					  dev->name, i, errno);
 				return -errno;
 			}
 
@@ -623,8 +633,8 @@ int v4l2_free_buffers(struct v4l2_device *dev)
 
 	ret = ioctl(dev->fd, VIDIOC_REQBUFS, &rb);
 	if (ret < 0) {
-		printf("%s: unable to release buffers (%d)\n", dev->name,
-		       errno);
+		log_error("%s: unable to release buffers (%d)\n", dev->name,
+			  errno);
 		return -errno;
 	}
 
@@ -659,22 +669,22 @@ int v4l2_export_buffers(struct v4l2_device *dev)
 
 		ret = ioctl(dev->fd, VIDIOC_QUERYBUF, &buf);
 		if (ret < 0) {
-			printf("%s: unable to query buffer %u (%d).\n",
-			       dev->name, i, errno);
+			log_error("%s: unable to query buffer %u (%d).\n",
+				  dev->name, i, errno);
 			return -errno;
 		}
 
 		ret = ioctl(dev->fd, VIDIOC_EXPBUF, &expbuf);
 		if (ret < 0) {
-			printf("Failed to export buffer %u.\n", i);
+			log_error("Failed to export buffer %u.\n", i);
 			return -errno;
 		}
 
 		dev->buffers.buffers[i].size = buf.length;
 		dev->buffers.buffers[i].dmabuf = expbuf.fd;
 
-		printf("%s: buffer %u exported with fd %u.\n",
-		       dev->name, i, dev->buffers.buffers[i].dmabuf);
+		log_debug("%s: buffer %u exported with fd %u.\n",
+			  dev->name, i, dev->buffers.buffers[i].dmabuf);
 	}
 
 	return 0;
@@ -703,25 +713,25 @@ int v4l2_import_buffers(struct v4l2_device *dev,
 
 		ret = ioctl(dev->fd, VIDIOC_QUERYBUF, &buf);
 		if (ret < 0) {
-			printf("%s: unable to query buffer %u (%d).\n",
-			       dev->name, i, errno);
+			log_error("%s: unable to query buffer %u (%d).\n",
+				  dev->name, i, errno);
 			return -errno;
 		}
 
 		if (buffer->size < buf.length) {
-			printf("%s: buffer %u too small (%u bytes required, %u bytes available).\n",
-			       dev->name, i, buf.length, buffer->size);
+			log_error("%s: buffer %u too small (%u bytes required, %u bytes available).\n",
+				  dev->name, i, buf.length, buffer->size);
 			return -EINVAL;
 		}
 
 		fd = dup(buffer->dmabuf);
 		if (fd < 0) {
-			printf("%s: failed to duplicate dmabuf fd %d.\n",
-			       dev->name, buffer->dmabuf);
+			log_error("%s: failed to duplicate dmabuf fd %d.\n",
+				  dev->name, buffer->dmabuf);
 			return ret;
 		}
 
-		printf("%s: buffer %u valid.\n", dev->name, i);
+		log_debug("%s: buffer %u valid.\n", dev->name, i);
 
 		dev->buffers.buffers[i].dmabuf = fd;
 		dev->buffers.buffers[i].size = buffer->size;
@@ -749,24 +759,24 @@ int v4l2_mmap_buffers(struct v4l2_device *dev)
 
 		ret = ioctl(dev->fd, VIDIOC_QUERYBUF, &buf);
 		if (ret < 0) {
-			printf("%s: unable to query buffer %u (%d).\n",
-			       dev->name, i, errno);
+			log_error("%s: unable to query buffer %u (%d).\n",
+				  dev->name, i, errno);
 			return -errno;
 		}
 
 		mem = mmap(0, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
 			   dev->fd, buf.m.offset);
 		if (mem == MAP_FAILED) {
-			printf("%s: unable to map buffer %u (%d)\n",
-			       dev->name, i, errno);
+			log_error("%s: unable to map buffer %u (%d)\n",
+				  dev->name, i, errno);
 			return -errno;
 		}
 
 		buffer->mem = mem;
 		buffer->size = buf.length;
 
-		printf("%s: buffer %u mapped at address %p.\n", dev->name, i,
-		       mem);
+		log_debug("%s: buffer %u mapped at address %p.\n", dev->name, i,
+			  mem);
 	}
 
 	return 0;
@@ -783,9 +793,11 @@ int v4l2_dequeue_buffer(struct v4l2_device *dev, struct video_buffer *buffer)
 
 	ret = ioctl(dev->fd, VIDIOC_DQBUF, &buf);
 	if (ret < 0) {
-		printf("%s: unable to dequeue buffer index %u/%u (%d)\n",
-		       dev->name, buf.index, dev->buffers.nbufs, errno);
-		return -errno;
+		ret = -errno;
+		log_error_ratelimited("%s: unable to dequeue buffer index %u/%u (%d)\n",
+				      dev->name, buf.index, dev->buffers.nbufs,
+				      -ret);
+		return ret;
 	}
 
 	buffer->index = buf.index;
@@ -795,6 +807,21 @@ int v4l2_dequeue_buffer(struct v4l2_device *dev, struct video_buffer *buffer)
 	buffer->timestamp = buf.timestamp;
 	buffer->error = !!(buf.flags & V4L2_BUF_FLAG_ERROR);
 
+	/*
+	 * Capture devices with monotonic time stamps tell when the frame was
+	 * captured, and dequeuing it completes the capture.
+	 */
+	video_buffer_clear_stamps(buffer);
+
+	if (dev->type == V4L2_BUF_TYPE_VIDEO_CAPTURE &&
+	    (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+	    V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+		buffer->stamps[VIDEO_BUFFER_STAGE_CAPTURE] =
+			buf.timestamp.tv_sec * 1000000000ULL +
+			buf.timestamp.tv_usec * 1000ULL;
+		video_buffer_stamp(buffer, VIDEO_BUFFER_STAGE_COMPLETE);
+	}
+
 	return 0;
 }
 
@@ -814,14 +841,24 @@ int v4l2_queue_buffer(struct v4l2_device *dev, struct video_buffer *buffer)
 	if (dev->memtype == V4L2_MEMORY_DMABUF)
 		buf.m.fd = (unsigned long)dev->buffers.buffers[buffer->index].dmabuf;
 
-	if (dev->type == V4L2_BUF_TYPE_VIDEO_OUTPUT)
+	/*
+	 * Pass the capture time stamp along with the data, so that the host
+	 * sees the time the frame was captured at rather than the time it was
+	 * queued.
+	 */
+	if (dev->type == V4L2_BUF_TYPE_VIDEO_OUTPUT) {
 		buf.bytesused = buffer->bytesused;
+		buf.timestamp = buffer->timestamp;
+		buf.flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+	}
 
 	ret = ioctl(dev->fd, VIDIOC_QBUF, &buf);
 	if (ret < 0) {
-		printf("%s: unable to queue buffer index %u/%u (%d)\n",
-		       dev->name, buf.index, dev->buffers.nbufs, errno);
-		return -errno;
+		ret = -errno;
+		log_error_ratelimited("%s: unable to queue buffer index %u/%u (%d)\n",
+				      dev->name, buf.index, dev->buffers.nbufs,
+				      -ret);
+		return ret;
 	}
 
 	return 0;
@@ -31,7 +31,7 @@ struct v4l2_device
 	struct list_entry formats;
 	struct v4l2_pix_format format;
 	struct v4l2_rect crop;
-	unsigned int fps;
+	unsigned int interval;
 
 	struct video_buffer_set buffers;
 };
@@ -89,15 +89,15 @@ int v4l2_set_format(struct v4l2_device *dev, struct v4l2_pix_format *format);
 /*
  * v4l2_set_frame_rate - Set the frame rate
  * @dev: Device instance
- * @fps: Frame rate
+ * @interval: Frame interval in 100ns units
  *
- * Set the frame rate specified by @fps.
- * The device can modify the requested format and size, in which case @dev->fps
+ * Set the frame rate corresponding to the frame interval @interval.
+ * The device can modify the requested interval, in which case @dev->interval
  * will be updated to reflect the modified setting.
  *
  * Return 0 on success or a negative error code on failure.
  */
-int v4l2_set_frame_rate(struct v4l2_device *dev, unsigned int fps);
+int v4l2_set_frame_rate(struct v4l2_device *dev, unsigned int interval);
 
 /*
  * v4l2_get_crop - Retrieve the current crop rectangle
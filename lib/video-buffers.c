@@ -11,6 +11,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include "tools.h"
 
 struct video_buffer_set *video_buffer_set_new(unsigned int nbufs)
 {
@@ -38,3 +41,42 @@ void video_buffer_set_delete(struct video_buffer_set *buffers)
 	free(buffers->buffers);
 	free(buffers);
 }
+
+/* Return the current CLOCK_MONOTONIC time in ns, the time base of the stamps. */
+uint64_t video_buffer_clock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void video_buffer_stamp(struct video_buffer *buffer,
+			enum video_buffer_stage stage)
+{
+	buffer->stamps[stage] = video_buffer_clock();
+}
+
+void video_buffer_clear_stamps(struct video_buffer *buffer)
+{
+	memset(buffer->stamps, 0, sizeof(buffer->stamps));
+}
+
+const char *video_buffer_stage_name(enum video_buffer_stage stage)
+{
+	static const char * const names[] = {
+		[VIDEO_BUFFER_STAGE_CAPTURE] = "capture",
+		[VIDEO_BUFFER_STAGE_COMPLETE] = "complete",
+		[VIDEO_BUFFER_STAGE_ENCODE_QUEUE] = "encode-queue",
+		[VIDEO_BUFFER_STAGE_ENCODE_START] = "encode-start",
+		[VIDEO_BUFFER_STAGE_ENCODE_END] = "encode-end",
+		[VIDEO_BUFFER_STAGE_REORDER] = "reorder",
+		[VIDEO_BUFFER_STAGE_SINK_QUEUE] = "sink-queue",
+		[VIDEO_BUFFER_STAGE_SINK_DEQUEUE] = "sink-dequeue",
+	};
+
+	if (stage >= ARRAY_SIZE(names))
+		return "unknown";
+
+	return names[stage];
+}
@@ -11,19 +11,47 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/time.h>
 
+/*
+ * enum video_buffer_stage - Pipeline stages time stamped in video buffers
+ * @VIDEO_BUFFER_STAGE_CAPTURE: The frame has been captured by the sensor, or
+ *	generated for sources without a sensor
+ * @VIDEO_BUFFER_STAGE_COMPLETE: The capture request has completed
+ * @VIDEO_BUFFER_STAGE_ENCODE_QUEUE: The frame has been queued to the encoder
+ * @VIDEO_BUFFER_STAGE_ENCODE_START: An encoder thread has started encoding
+ * @VIDEO_BUFFER_STAGE_ENCODE_END: Encoding has completed
+ * @VIDEO_BUFFER_STAGE_REORDER: The encoded frame has left the reorder buffer
+ * @VIDEO_BUFFER_STAGE_SINK_QUEUE: The buffer has been queued to the sink
+ * @VIDEO_BUFFER_STAGE_SINK_DEQUEUE: The sink has returned the buffer
+ */
+enum video_buffer_stage {
+	VIDEO_BUFFER_STAGE_CAPTURE,
+	VIDEO_BUFFER_STAGE_COMPLETE,
+	VIDEO_BUFFER_STAGE_ENCODE_QUEUE,
+	VIDEO_BUFFER_STAGE_ENCODE_START,
+	VIDEO_BUFFER_STAGE_ENCODE_END,
+	VIDEO_BUFFER_STAGE_REORDER,
+	VIDEO_BUFFER_STAGE_SINK_QUEUE,
+	VIDEO_BUFFER_STAGE_SINK_DEQUEUE,
+	VIDEO_BUFFER_NUM_STAGES,
+};
+
 /*
  *
  * struct video_buffer - Video buffer information
  * @index: Zero-based buffer index, limited to the number of buffers minus one
  * @size: Size of the video memory, in bytes
  * @bytesused: Number of bytes used by video data, smaller or equal to @size
- * @timestamp: Time stamp at which the buffer has been captured
+ * @timestamp: CLOCK_MONOTONIC time stamp at which the buffer has been captured
  * @error: True if an error occured while capturing video data for the buffer
  * @allocated: True if memory for the buffer has been allocated
  * @mem: Video data memory
  * @dmabuf: Video data dmabuf handle
+ * @stamps: CLOCK_MONOTONIC time in ns at which the buffer went through each
+ *	pipeline stage, indexed by enum video_buffer_stage, 0 for stages it hasn't
+ *	been through
  */
 struct video_buffer
 {
@@ -34,6 +62,7 @@ struct video_buffer
 	bool error;
 	void *mem;
 	int dmabuf;
+	uint64_t stamps[VIDEO_BUFFER_NUM_STAGES];
 };
 
 struct video_buffer_set
@@ -45,4 +74,10 @@ struct video_buffer_set
 struct video_buffer_set *video_buffer_set_new(unsigned int nbufs);
 void video_buffer_set_delete(struct video_buffer_set *buffers);
 
+uint64_t video_buffer_clock(void);
+void video_buffer_stamp(struct video_buffer *buffer,
+			enum video_buffer_stage stage);
+void video_buffer_clear_stamps(struct video_buffer *buffer);
+const char *video_buffer_stage_name(enum video_buffer_stage stage);
+
 #endif /* __VIDEO_BUFFERS_H__ */
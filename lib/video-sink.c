@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * Abstract video sink
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ */
+
+#include "video-sink.h"
+
+void video_sink_init(struct video_sink *sink, struct events *events)
+{
+	sink->events = events;
+}
+
+void video_sink_set_buffer_handler(struct video_sink *sink,
+				   video_sink_buffer_handler_t handler,
+				   void *data)
+{
+	sink->handler = handler;
+	sink->handler_data = data;
+}
+
+void video_sink_destroy(struct video_sink *sink)
+{
+	if (sink)
+		sink->ops->destroy(sink);
+}
+
+int video_sink_set_format(struct video_sink *sink,
+			  struct v4l2_pix_format *fmt)
+{
+	return sink->ops->set_format(sink, fmt);
+}
+
+int video_sink_alloc_buffers(struct video_sink *sink, enum v4l2_memory memtype,
+			     unsigned int nbufs)
+{
+	return sink->ops->alloc_buffers(sink, memtype, nbufs);
+}
+
+int video_sink_mmap_buffers(struct video_sink *sink,
+			    struct video_buffer_set **buffers)
+{
+	return sink->ops->mmap_buffers(sink, buffers);
+}
+
+int video_sink_import_buffers(struct video_sink *sink,
+			      const struct video_buffer_set *buffers)
+{
+	return sink->ops->import_buffers(sink, buffers);
+}
+
+int video_sink_free_buffers(struct video_sink *sink)
+{
+	return sink->ops->free_buffers(sink);
+}
+
+int video_sink_stream_on(struct video_sink *sink)
+{
+	return sink->ops->stream_on(sink);
+}
+
+int video_sink_stream_off(struct video_sink *sink)
+{
+	return sink->ops->stream_off(sink);
+}
+
+int video_sink_queue_buffer(struct video_sink *sink, struct video_buffer *buf)
+{
+	return sink->ops->queue_buffer(sink, buf);
+}
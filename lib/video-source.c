@@ -7,6 +7,8 @@
  * Contact: Laurent Pinchart <laurent.pinchart@ideasonboard.com>
  */
 
+#include <string.h>
+
 #include "video-source.h"
 
 void video_source_set_buffer_handler(struct video_source *src,
@@ -29,9 +31,10 @@ int video_source_set_format(struct video_source *src,
 	return src->ops->set_format(src, fmt);
 }
 
-int video_source_set_frame_rate(struct video_source *src, unsigned int fps)
+int video_source_set_frame_rate(struct video_source *src,
+				unsigned int interval)
 {
-	return src->ops->set_frame_rate(src, fps);
+	return src->ops->set_frame_rate(src, interval);
 }
 
 int video_source_alloc_buffers(struct video_source *src, unsigned int nbufs)
@@ -77,3 +80,13 @@ void video_source_fill_buffer(struct video_source *src,
 {
 	src->ops->fill_buffer(src, buf);
 }
+
+/* Sources that don't implement the operation report no statistics. */
+void video_source_get_stats(struct video_source *src,
+			    struct video_source_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (src->ops->get_stats)
+		src->ops->get_stats(src, stats);
+}
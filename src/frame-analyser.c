@@ -0,0 +1,545 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * UVC gadget frame analyser
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ *
+ * Reads frames captured on the host from a gadget running the barcode test
+ * pattern, and reports dropped, duplicated and out of order frames, the frame
+ * interval jitter and, given host receive time stamps, the latency.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#ifdef HAVE_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
+#include "test-barcode.h"
+
+#define HISTOGRAM_BINS	40
+
+enum frame_format {
+	FORMAT_YUYV,
+	FORMAT_MJPEG,
+};
+
+/*
+ * struct samples - Set of measurements, in milliseconds
+ * @name: description printed in the report
+ * @values: the measurements
+ * @count: number of measurements
+ * @size: number of measurements that @values can hold
+ */
+struct samples {
+	const char *name;
+	double *values;
+	unsigned int count;
+	unsigned int size;
+};
+
+struct analyser {
+	unsigned int width;
+	unsigned int height;
+
+	double *host_times;
+	unsigned int num_host_times;
+
+	unsigned int frames;
+	unsigned int unreadable;
+	unsigned int duplicates;
+	unsigned int dropped;
+	unsigned int out_of_order;
+
+	bool have_last;
+	struct test_barcode last;
+	double last_host_time;
+
+	struct samples gadget_intervals;
+	struct samples host_intervals;
+	struct samples latencies;
+};
+
+static int samples_add(struct samples *samples, double value)
+{
+	if (samples->count == samples->size) {
+		unsigned int size = samples->size ? samples->size * 2 : 1024;
+		double *values;
+
+		values = realloc(samples->values, size * sizeof(*values));
+		if (!values)
+			return -ENOMEM;
+
+		samples->values = values;
+		samples->size = size;
+	}
+
+	samples->values[samples->count++] = value;
+	return 0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void samples_report(struct samples *samples, double bin)
+{
+	unsigned int histogram[HISTOGRAM_BINS] = { 0 };
+	unsigned int overflow = 0;
+	unsigned int peak = 0;
+	double *v = samples->values;
+	unsigned int n = samples->count;
+	double sum = 0.0;
+	double first;
+	unsigned int i;
+
+	if (!n)
+		return;
+
+	qsort(v, n, sizeof(*v), compare_double);
+
+	for (i = 0; i < n; ++i)
+		sum += v[i];
+
+	printf("\n%s (ms): %u samples\n", samples->name, n);
+	printf("  min %.3f  avg %.3f  max %.3f\n", v[0], sum / n, v[n - 1]);
+	printf("  p50 %.3f  p95 %.3f  p99 %.3f\n", v[n / 2], v[n * 95 / 100],
+	       v[n * 99 / 100]);
+
+	/* Start the histogram at the bin holding the smallest value. */
+	first = floor(v[0] / bin) * bin;
+
+	for (i = 0; i < n; ++i) {
+		unsigned int index = (v[i] - first) / bin;
+
+		if (index < HISTOGRAM_BINS)
+			histogram[index]++;
+		else
+			overflow++;
+	}
+
+	for (i = 0; i < HISTOGRAM_BINS; ++i)
+		peak = histogram[i] > peak ? histogram[i] : peak;
+
+	for (i = 0; i < HISTOGRAM_BINS; ++i) {
+		if (!histogram[i])
+			continue;
+
+		printf("  [%8.3f, %8.3f) %8u %.*s\n", first + i * bin,
+		       first + (i + 1) * bin, histogram[i],
+		       (int)((histogram[i] * 50ULL + peak - 1) / peak),
+		       "##################################################");
+	}
+
+	if (overflow)
+		printf("  [%8.3f,      inf) %8u\n", first + HISTOGRAM_BINS * bin,
+		       overflow);
+}
+
+static void analyse_frame(struct analyser *a, const uint8_t *luma,
+			  unsigned int pixel_step, unsigned int stride)
+{
+	unsigned int index = a->frames++;
+	struct test_barcode code;
+	double host_time = NAN;
+	int ret;
+
+	if (index < a->num_host_times)
+		host_time = a->host_times[index];
+
+	ret = test_barcode_read(luma, pixel_step, a->width, a->height, stride,
+				&code);
+	if (ret < 0) {
+		a->unreadable++;
+		return;
+	}
+
+	if (a->have_last && code.sequence == a->last.sequence) {
+		a->duplicates++;
+		return;
+	}
+
+	/* Latency relative to the gadget clock, corrected in the report. */
+	if (!isnan(host_time))
+		samples_add(&a->latencies,
+			    host_time * 1000.0 - code.timestamp / 1000000.0);
+
+	if (a->have_last) {
+		if (code.sequence < a->last.sequence) {
+			/* Streaming restarted or frames got reordered. */
+			a->out_of_order++;
+		} else {
+			a->dropped += code.sequence - a->last.sequence - 1;
+			samples_add(&a->gadget_intervals,
+				    (code.timestamp - a->last.timestamp) / 1000000.0
+				    / (code.sequence - a->last.sequence));
+		}
+
+		if (!isnan(host_time) && !isnan(a->last_host_time))
+			samples_add(&a->host_intervals,
+				    (host_time - a->last_host_time) * 1000.0);
+	}
+
+	a->have_last = true;
+	a->last = code;
+	a->last_host_time = host_time;
+}
+
+static int analyse_yuyv(struct analyser *a, FILE *file)
+{
+	size_t size = a->width * a->height * 2;
+	uint8_t *frame;
+
+	frame = malloc(size);
+	if (!frame)
+		return -ENOMEM;
+
+	while (fread(frame, 1, size, file) == size)
+		analyse_frame(a, frame, 2, a->width * 2);
+
+	free(frame);
+	return 0;
+}
+
+#ifdef HAVE_LIBJPEG
+struct jpeg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf env;
+};
+
+/* Skip corrupted images instead of exiting. */
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	struct jpeg_error *err = (struct jpeg_error *)cinfo->err;
+
+	longjmp(err->env, 1);
+}
+
+/*
+ * Decode the luma of a JPEG image. The EOI marker can't appear in entropy
+ * coded data, so MJPEG streams are split on SOI and EOI markers.
+ */
+static int analyse_jpeg(struct analyser *a, const uint8_t *data, size_t size)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error jerr;
+	uint8_t *volatile luma = NULL;
+	volatile int ret = 0;
+
+	cinfo.err = jpeg_std_error(&jerr.mgr);
+	jerr.mgr.error_exit = jpeg_error_exit;
+	jpeg_create_decompress(&cinfo);
+
+	if (setjmp(jerr.env)) {
+		ret = -EINVAL;
+		goto done;
+	}
+
+	jpeg_mem_src(&cinfo, data, size);
+
+	if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+		ret = -EINVAL;
+		goto done;
+	}
+
+	cinfo.out_color_space = JCS_GRAYSCALE;
+	jpeg_start_decompress(&cinfo);
+
+	a->width = cinfo.output_width;
+	a->height = cinfo.output_height;
+
+	luma = malloc(a->width * a->height);
+	if (!luma) {
+		ret = -ENOMEM;
+		goto done;
+	}
+
+	while (cinfo.output_scanline < cinfo.output_height) {
+		JSAMPROW row = luma + cinfo.output_scanline * a->width;
+
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+
+	jpeg_finish_decompress(&cinfo);
+
+	analyse_frame(a, luma, 1, a->width);
+
+done:
+	if (ret == -EINVAL) {
+		a->frames++;
+		a->unreadable++;
+	}
+
+	free(luma);
+	jpeg_destroy_decompress(&cinfo);
+	return ret;
+}
+
+static int analyse_mjpeg(struct analyser *a, FILE *file)
+{
+	uint8_t *data = NULL;
+	size_t size = 0;
+	size_t used = 0;
+	size_t start = 0;
+	size_t i;
+	int ret = 0;
+
+	for (;;) {
+		uint8_t *buf;
+		size_t n;
+
+		if (used == size) {
+			size = size ? size * 2 : 1024 * 1024;
+			buf = realloc(data, size);
+			if (!buf) {
+				free(data);
+				return -ENOMEM;
+			}
+			data = buf;
+		}
+
+		n = fread(data + used, 1, size - used, file);
+		if (!n)
+			break;
+		used += n;
+	}
+
+	for (i = 0; i + 1 < used; ++i) {
+		if (data[i] != 0xff)
+			continue;
+
+		if (data[i + 1] == 0xd8) {
+			start = i;
+		} else if (data[i + 1] == 0xd9) {
+			ret = analyse_jpeg(a, data + start, i + 2 - start);
+			if (ret == -ENOMEM)
+				break;
+			ret = 0;
+		}
+	}
+
+	free(data);
+	return ret;
+}
+#endif
+
+static int read_host_times(struct analyser *a, const char *path)
+{
+	unsigned int size = 0;
+	double value;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	while (fscanf(file, "%lf", &value) == 1) {
+		if (a->num_host_times == size) {
+			double *times;
+
+			size = size ? size * 2 : 1024;
+			times = realloc(a->host_times, size * sizeof(*times));
+			if (!times) {
+				fclose(file);
+				return -ENOMEM;
+			}
+			a->host_times = times;
+		}
+
+		a->host_times[a->num_host_times++] = value;
+	}
+
+	fclose(file);
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options] <file>\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Analyse frames captured on the host from a gadget running the barcode test\n");
+	fprintf(stderr, "pattern (uvc-gadget --test-pattern barcode). <file> is a raw dump of the\n");
+	fprintf(stderr, "frames, or - for standard input.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Available options are\n");
+	fprintf(stderr, " -b|--bin <ms>                 Histogram bin width (default 1.0)\n");
+	fprintf(stderr, " -f|--format <format>          Frame format\n");
+#ifdef HAVE_LIBJPEG
+	fprintf(stderr, "                                  values: yuyv (default), mjpeg\n");
+#else
+	fprintf(stderr, "                                  values: yuyv (default)\n");
+#endif
+	fprintf(stderr, " -o|--offset <seconds>         Host clock minus gadget CLOCK_MONOTONIC\n");
+	fprintf(stderr, "                                    - without it, latencies are relative to the smallest one\n");
+	fprintf(stderr, " -s|--size <width>x<height>    Frame size, required for yuyv\n");
+	fprintf(stderr, " -t|--timestamps <file>        Host receive time of each frame in seconds, one per line\n");
+	fprintf(stderr, " -h|--help                     Print this help screen and exit\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option opts[] = {
+		{ "bin",        required_argument, 0, 'b' },
+		{ "format",     required_argument, 0, 'f' },
+		{ "offset",     required_argument, 0, 'o' },
+		{ "size",       required_argument, 0, 's' },
+		{ "timestamps", required_argument, 0, 't' },
+		{ "help",       no_argument,       0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	struct analyser a = {
+		.gadget_intervals = { .name = "Gadget frame interval" },
+		.host_intervals = { .name = "Host frame interval" },
+		.latencies = { .name = "Latency" },
+	};
+	enum frame_format format = FORMAT_YUYV;
+	const char *timestamps = NULL;
+	double offset = NAN;
+	double bin = 1.0;
+	FILE *file;
+	unsigned int i;
+	int ret;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "b:f:o:s:t:h", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			if (sscanf(optarg, "%lf", &bin) != 1 || bin <= 0.0) {
+				fprintf(stderr, "Invalid --bin value: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'f':
+			if (!strcmp(optarg, "yuyv")) {
+				format = FORMAT_YUYV;
+#ifdef HAVE_LIBJPEG
+			} else if (!strcmp(optarg, "mjpeg")) {
+				format = FORMAT_MJPEG;
+#endif
+			} else {
+				fprintf(stderr, "Invalid --format value: %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'o':
+			if (sscanf(optarg, "%lf", &offset) != 1) {
+				fprintf(stderr, "Invalid --offset value: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 's':
+			if (sscanf(optarg, "%ux%u", &a.width, &a.height) != 2 ||
+			    !a.width || !a.height) {
+				fprintf(stderr, "Invalid --size value: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 't':
+			timestamps = optarg;
+			break;
+
+		case 'h':
+			usage(argv[0]);
+			return 0;
+
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (format == FORMAT_YUYV && !a.width) {
+		fprintf(stderr, "The frame size is required for yuyv\n");
+		return 1;
+	}
+
+	if (timestamps && read_host_times(&a, timestamps) < 0)
+		return 1;
+
+	if (!strcmp(argv[optind], "-")) {
+		file = stdin;
+	} else {
+		file = fopen(argv[optind], "rb");
+		if (!file) {
+			fprintf(stderr, "Unable to open %s: %s\n", argv[optind],
+				strerror(errno));
+			return 1;
+		}
+	}
+
+#ifdef HAVE_LIBJPEG
+	if (format == FORMAT_MJPEG)
+		ret = analyse_mjpeg(&a, file);
+	else
+#endif
+		ret = analyse_yuyv(&a, file);
+
+	if (file != stdin)
+		fclose(file);
+
+	if (ret < 0) {
+		fprintf(stderr, "Failed to analyse frames: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	printf("Frames: %u\n", a.frames);
+	printf("  unreadable:   %u\n", a.unreadable);
+	printf("  duplicated:   %u\n", a.duplicates);
+	printf("  dropped:      %u\n", a.dropped);
+	printf("  out of order: %u\n", a.out_of_order);
+
+	/*
+	 * Without a known offset between the clocks, only latency variations
+	 * are meaningful, report them relative to the smallest latency.
+	 */
+	if (a.latencies.count) {
+		double base = offset * 1000.0;
+
+		if (isnan(offset)) {
+			base = a.latencies.values[0];
+			for (i = 1; i < a.latencies.count; ++i)
+				base = fmin(base, a.latencies.values[i]);
+			a.latencies.name = "Latency, relative to the smallest";
+		}
+
+		for (i = 0; i < a.latencies.count; ++i)
+			a.latencies.values[i] -= base;
+	}
+
+	samples_report(&a.gadget_intervals, bin);
+	samples_report(&a.host_intervals, bin);
+	samples_report(&a.latencies, bin);
+
+	free(a.gadget_intervals.values);
+	free(a.host_intervals.values);
+	free(a.latencies.values);
+	free(a.host_times);
+
+	return 0;
+}
@@ -0,0 +1,467 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * UVC host emulator
+ *
+ * Copyright (C) 2026 uvc-gadget contributors
+ *
+ * Drives the UVC protocol handling and the stream with scripted host
+ * operations, without a UDC. Each iteration negotiates a random mode with
+ * probe and commit requests, starts streaming, waits for frames and stops,
+ * and the control response latency, stream start to first frame time and
+ * stream stop time are reported at the end.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usb/g_uvc.h>
+#include <linux/usb/video.h>
+#include <linux/videodev2.h>
+
+#include "configfs.h"
+#include "events.h"
+#include "file-sink.h"
+#include "host-emulator.h"
+#include "stream.h"
+#include "test-source.h"
+#include "video-source.h"
+
+struct emulator {
+	struct events events;
+	const struct uvc_function_config *fc;
+
+	struct uvc_streaming_control probe;
+	unsigned int errors;
+	int status;
+};
+
+/* -----------------------------------------------------------------------------
+ * Default function configuration
+ */
+
+static unsigned int default_intervals[] = { 333333, 666666, 1000000 };
+
+static struct uvc_function_config_frame default_frames[] = {
+	{ 1, 640, 360, 3, default_intervals },
+	{ 2, 640, 480, 3, default_intervals },
+	{ 3, 1280, 720, 3, default_intervals },
+	{ 4, 1920, 1080, 3, default_intervals },
+};
+
+static struct uvc_function_config_format default_format = {
+	.index = 1,
+	.fcc = V4L2_PIX_FMT_YUYV,
+	.num_frames = 4,
+	.frames = default_frames,
+};
+
+static struct uvc_function_config default_config = {
+	.control = { .intf = { .bInterfaceNumber = 0 } },
+	.streaming = {
+		.intf = { .bInterfaceNumber = 1 },
+		.ep = {
+			.bInterval = 1,
+			.bMaxBurst = 0,
+			.wMaxPacketSize = 3072,
+		},
+		.num_formats = 1,
+		.formats = &default_format,
+	},
+};
+
+/* -----------------------------------------------------------------------------
+ * Script generation
+ */
+
+static void control_step(struct uvc_host_step *step,
+			 const struct uvc_function_config *fc, uint8_t req,
+			 uint8_t cs, uint16_t length)
+{
+	memset(step, 0, sizeof(*step));
+	step->type = UVC_HOST_STEP_CONTROL;
+	step->req.bRequestType = USB_TYPE_CLASS | USB_RECIP_INTERFACE |
+				 (req & 0x80 ? USB_DIR_IN : USB_DIR_OUT);
+	step->req.bRequest = req;
+	step->req.wValue = cs << 8;
+	step->req.wIndex = fc->streaming.intf.bInterfaceNumber;
+	step->req.wLength = length;
+}
+
+static unsigned int build_script(struct uvc_host_step *steps,
+				 const struct uvc_function_config *fc,
+				 enum usb_device_speed speed,
+				 unsigned int iterations, unsigned int frames)
+{
+	const unsigned int len = sizeof(struct uvc_streaming_control);
+	const struct uvc_function_config_streaming *streaming = &fc->streaming;
+	struct uvc_streaming_control ctrl = { 0 };
+	struct uvc_host_step *step = steps;
+	unsigned int i;
+
+	memset(step, 0, sizeof(*step));
+	step->type = UVC_HOST_STEP_CONNECT;
+	step->speed = speed;
+	step++;
+
+	for (i = 0; i < iterations; ++i) {
+		/* Hosts commonly restart with the same mode, do so half the time. */
+		if (!i || rand() % 2) {
+			const struct uvc_function_config_format *format;
+			const struct uvc_function_config_frame *frame;
+			unsigned int iformat;
+
+			do {
+				iformat = rand() % streaming->num_formats;
+				format = &streaming->formats[iformat];
+			} while (format->fcc != V4L2_PIX_FMT_YUYV);
+
+			frame = &format->frames[rand() % format->num_frames];
+
+			ctrl.bmHint = 1;
+			ctrl.bFormatIndex = iformat + 1;
+			ctrl.bFrameIndex = frame - format->frames + 1;
+			/* Request arbitrary intervals to exercise the rounding. */
+			ctrl.dwFrameInterval = frame->intervals[rand() % frame->num_intervals]
+					     + rand() % 3 * 100000;
+		}
+
+		control_step(step++, fc, UVC_GET_INFO, UVC_VS_PROBE_CONTROL, 1);
+		control_step(step++, fc, UVC_GET_MIN, UVC_VS_PROBE_CONTROL, len);
+		control_step(step++, fc, UVC_GET_MAX, UVC_VS_PROBE_CONTROL, len);
+		control_step(step++, fc, UVC_GET_DEF, UVC_VS_PROBE_CONTROL, len);
+
+		control_step(step, fc, UVC_SET_CUR, UVC_VS_PROBE_CONTROL, len);
+		memcpy(step->data, &ctrl, len);
+		step++;
+
+		control_step(step++, fc, UVC_GET_CUR, UVC_VS_PROBE_CONTROL, len);
+
+		control_step(step, fc, UVC_SET_CUR, UVC_VS_COMMIT_CONTROL, len);
+		step->flags = UVC_HOST_STEP_DATA_FROM_RESPONSE;
+		step++;
+
+		control_step(step++, fc, UVC_GET_CUR, UVC_VS_COMMIT_CONTROL, len);
+
+		memset(step, 0, sizeof(*step));
+		step->type = UVC_HOST_STEP_STREAM_ON;
+		step++;
+
+		if (frames > 1) {
+			memset(step, 0, sizeof(*step));
+			step->type = UVC_HOST_STEP_WAIT_FRAMES;
+			step->frames = frames - 1;
+			step++;
+		}
+
+		memset(step, 0, sizeof(*step));
+		step->type = UVC_HOST_STEP_STREAM_OFF;
+		step++;
+	}
+
+	return step - steps;
+}
+
+/* -----------------------------------------------------------------------------
+ * Response validation
+ */
+
+static bool valid_control(const struct uvc_function_config *fc,
+			  const struct uvc_streaming_control *ctrl)
+{
+	const struct uvc_function_config_format *format;
+	const struct uvc_function_config_frame *frame;
+	unsigned int i;
+
+	if (!ctrl->bFormatIndex || ctrl->bFormatIndex > fc->streaming.num_formats)
+		return false;
+
+	format = &fc->streaming.formats[ctrl->bFormatIndex - 1];
+	if (!ctrl->bFrameIndex || ctrl->bFrameIndex > format->num_frames)
+		return false;
+
+	frame = &format->frames[ctrl->bFrameIndex - 1];
+	for (i = 0; i < frame->num_intervals; ++i) {
+		if (ctrl->dwFrameInterval == frame->intervals[i])
+			break;
+	}
+
+	return i < frame->num_intervals && ctrl->dwMaxVideoFrameSize &&
+	       ctrl->dwMaxPayloadTransferSize;
+}
+
+static void check_response(void *data, const struct uvc_host_step *step,
+			   const struct uvc_request_data *resp)
+{
+	const struct uvc_streaming_control *ctrl = (const void *)resp->data;
+	struct emulator *emu = data;
+	uint8_t cs = step->req.wValue >> 8;
+	bool valid = true;
+
+	switch (step->req.bRequest) {
+	case UVC_GET_INFO:
+		valid = resp->length == 1;
+		break;
+
+	case UVC_SET_CUR:
+		valid = resp->length == sizeof(*ctrl);
+		break;
+
+	case UVC_GET_CUR:
+	case UVC_GET_MIN:
+	case UVC_GET_MAX:
+	case UVC_GET_DEF:
+		valid = resp->length == sizeof(*ctrl) &&
+			valid_control(emu->fc, ctrl);
+
+		if (step->req.bRequest != UVC_GET_CUR)
+			break;
+
+		/* The committed mode must be the one that has been probed. */
+		if (cs == UVC_VS_PROBE_CONTROL)
+			emu->probe = *ctrl;
+		else if (memcmp(&emu->probe, ctrl, sizeof(*ctrl)))
+			valid = false;
+		break;
+	}
+
+	if (!valid) {
+		fprintf(stderr, "invalid response to request %02x cs %02x\n",
+			step->req.bRequest, cs);
+		emu->errors++;
+	}
+}
+
+static void script_done(void *data, int status)
+{
+	struct emulator *emu = data;
+
+	emu->status = status;
+	events_stop(&emu->events);
+}
+
+/* -----------------------------------------------------------------------------
+ * Main
+ */
+
+static void print_latency(const char *name, const struct uvc_host_latency *l)
+{
+	fprintf(stderr, "%-12s count %6u  min %9.3f  p50 %9.3f  p99 %9.3f  max %9.3f ms\n",
+		name, l->count, l->min / 1e6, l->p50 / 1e6, l->p99 / 1e6,
+		l->max / 1e6);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options]\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Emulate a USB host negotiating a mode, starting and stopping the stream,\n");
+	fprintf(stderr, "in a loop, without a UDC. Frames are generated by the test source. The\n");
+	fprintf(stderr, "report is printed to stderr.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Available options are\n");
+	fprintf(stderr, " -c|--config <function>        Use the mode of a UVC function in ConfigFS\n");
+	fprintf(stderr, "                                  (default: built-in YUYV modes)\n");
+	fprintf(stderr, " -f|--frames <count>           Frames to receive per session (default 1)\n");
+	fprintf(stderr, " -i|--idle-timeout <ms>        Buffer idle timeout of the stream\n");
+	fprintf(stderr, " -n|--iterations <count>       Number of sessions (default 1000)\n");
+	fprintf(stderr, " -q|--quiet                    Discard the messages printed to stdout\n");
+	fprintf(stderr, " -r|--rate <bytes/s>           Rate of the emulated link (default unlimited)\n");
+	fprintf(stderr, " -S|--speed <speed>            Bus speed: full, high (default) or super\n");
+	fprintf(stderr, " -s|--seed <seed>              Random seed (default 1)\n");
+	fprintf(stderr, " -t|--timeout <ms>             Step timeout (default 2000)\n");
+	fprintf(stderr, " -h|--help                     Print this help screen and exit\n");
+}
+
+static struct option opts[] = {
+	{"config", required_argument, 0, 'c'},
+	{"frames", required_argument, 0, 'f'},
+	{"help", no_argument, 0, 'h'},
+	{"idle-timeout", required_argument, 0, 'i'},
+	{"iterations", required_argument, 0, 'n'},
+	{"quiet", no_argument, 0, 'q'},
+	{"rate", required_argument, 0, 'r'},
+	{"seed", required_argument, 0, 's'},
+	{"speed", required_argument, 0, 'S'},
+	{"timeout", required_argument, 0, 't'},
+	{0, 0, 0, 0}
+};
+
+int main(int argc, char *argv[])
+{
+	struct uvc_function_config *config = NULL;
+	enum usb_device_speed speed = USB_SPEED_HIGH;
+	struct uvc_host_emulator *host = NULL;
+	struct video_source *src = NULL;
+	struct video_sink *sink = NULL;
+	struct uvc_stream *stream = NULL;
+	struct uvc_host_step *steps = NULL;
+	struct uvc_host_stats stats;
+	struct emulator emu = { 0 };
+	unsigned int iterations = 1000;
+	unsigned int timeout = 2000;
+	unsigned int frames = 1;
+	int idle_timeout = -1;
+	unsigned long long rate = 0;
+	struct timespec start, end;
+	unsigned int num_steps;
+	unsigned int seed = 1;
+	int ret = 1;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "c:f:hi:n:qr:S:s:t:", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			config = configfs_parse_uvc_function(optarg);
+			if (!config) {
+				fprintf(stderr, "Failed to parse UVC function %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+
+		case 'f':
+			frames = atoi(optarg);
+			if (!frames) {
+				fprintf(stderr, "Invalid --frames value: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'h':
+			usage(argv[0]);
+			return 0;
+
+		case 'i':
+			idle_timeout = atoi(optarg);
+			break;
+
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+
+		case 'q':
+			if (!freopen("/dev/null", "w", stdout)) {
+				fprintf(stderr, "Unable to discard stdout\n");
+				return 1;
+			}
+			break;
+
+		case 'r':
+			rate = strtoull(optarg, NULL, 10);
+			break;
+
+		case 'S':
+			if (!strcmp(optarg, "full"))
+				speed = USB_SPEED_FULL;
+			else if (!strcmp(optarg, "high"))
+				speed = USB_SPEED_HIGH;
+			else if (!strcmp(optarg, "super"))
+				speed = USB_SPEED_SUPER;
+			else {
+				fprintf(stderr, "Invalid --speed value: %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 's':
+			seed = atoi(optarg);
+			break;
+
+		case 't':
+			timeout = atoi(optarg);
+			break;
+
+		default:
+			fprintf(stderr, "Invalid option '-%c'\n", opt);
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	emu.fc = config ? config : &default_config;
+	srand(seed);
+
+	events_init(&emu.events);
+
+	for (unsigned int i = 0; i < emu.fc->streaming.num_formats; ++i) {
+		if (emu.fc->streaming.formats[i].fcc == V4L2_PIX_FMT_YUYV)
+			break;
+		if (i == emu.fc->streaming.num_formats - 1) {
+			fprintf(stderr, "The UVC function has no YUYV format\n");
+			goto done;
+		}
+	}
+
+	/* Build the script for all iterations upfront. */
+	steps = calloc(iterations * 12 + 1, sizeof(*steps));
+	if (!steps)
+		goto done;
+
+	num_steps = build_script(steps, emu.fc, speed, iterations, frames);
+
+	sink = null_video_sink_create(rate);
+	src = test_video_source_create();
+	if (!sink || !src)
+		goto done;
+
+	video_sink_init(sink, &emu.events);
+	test_video_source_init(src, &emu.events);
+
+	host = uvc_host_emulator_new(&emu.events, sink);
+	if (!host)
+		goto done;
+
+	uvc_host_emulator_set_response_handler(host, check_response, &emu);
+
+	stream = uvc_stream_new_emulated(host);
+	if (!stream)
+		goto done;
+
+	uvc_stream_set_event_handler(stream, &emu.events);
+	uvc_stream_set_video_source(stream, src);
+	if (idle_timeout >= 0)
+		uvc_stream_set_idle_timeout(stream, idle_timeout);
+	if (uvc_stream_init_uvc(stream, (struct uvc_function_config *)emu.fc) < 0)
+		goto done;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	uvc_host_emulator_run(host, steps, num_steps, timeout, script_done,
+			      &emu);
+	events_loop(&emu.events);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	uvc_host_emulator_get_stats(host, &stats);
+
+	fprintf(stderr, "%u iterations in %.3f s, %u frames\n", iterations,
+		end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9,
+		stats.frames);
+	print_latency("control", &stats.control);
+	print_latency("stream on", &stats.stream_on);
+	print_latency("stream off", &stats.stream_off);
+	fprintf(stderr, "%u stalls, %u timeouts, %u invalid responses\n",
+		stats.stalls, stats.timeouts, emu.errors);
+	uvc_stream_dump_latency(stream, stderr);
+
+	ret = emu.status || emu.errors || stats.stalls ? 1 : 0;
+
+done:
+	uvc_stream_delete(stream);
+	uvc_host_emulator_delete(host);
+	video_sink_destroy(sink);
+	video_source_destroy(src);
+	events_cleanup(&emu.events);
+	if (config)
+		configfs_free_uvc_function(config);
+	free(steps);
+
+	return ret;
+}
@@ -7,15 +7,21 @@
  * Contact: Laurent Pinchart <laurent.pinchart@ideasonboard.com>
  */
 
+#include <ctype.h>
+#include <errno.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <sys/signalfd.h>
 
 #include "config.h"
 #include "configfs.h"
 #include "events.h"
+#include "log.h"
+#include "metrics-server.h"
 #include "stream.h"
 #include "libcamera-source.h"
 #include "v4l2-source.h"
@@ -38,6 +44,61 @@ static int is_camera_mode_valid(const char *mode, const char *valid_modes[])
 	}
 	return 0;
 }
+
+/* Parse a CPU number, rejecting signs and leading spaces that strtoul() accepts */
+static int parse_cpu_number(const char **p, unsigned long *cpu)
+{
+	char *end;
+
+	if (!isdigit((unsigned char)**p))
+		return -1;
+
+	errno = 0;
+	*cpu = strtoul(*p, &end, 10);
+	if (errno)
+		return -1;
+
+	*p = end;
+	return 0;
+}
+
+/* Parse a CPU list such as "0,2-3" into a mask, return -1 on error */
+static int parse_cpu_list(const char *list, unsigned long *mask)
+{
+	const unsigned long max_cpu = sizeof(*mask) * 8 - 1;
+	const char *p = list;
+
+	*mask = 0;
+
+	while (*p) {
+		unsigned long first, last;
+
+		if (parse_cpu_number(&p, &first) < 0)
+			return -1;
+		last = first;
+
+		if (*p == '-') {
+			p++;
+			if (parse_cpu_number(&p, &last) < 0)
+				return -1;
+		}
+
+		if (first > last || last > max_cpu)
+			return -1;
+
+		for (unsigned long cpu = first; cpu <= last; cpu++)
+			*mask |= 1UL << cpu;
+
+		/* A separator must be followed by another item. */
+		if (*p == ',' && p[1])
+			p++;
+		else if (*p)
+			return -1;
+	}
+
+	return *mask ? 0 : -1;
+}
+
 static const char *camera_valid_af_range_modes[] = {
 	"normal",
 	"macro",
@@ -65,6 +126,19 @@ static const char *camera_valid_exposure_modes[] = {
 	"long",
 	NULL
 };
+static const char *camera_valid_mjpeg_overflow_policies[] = {
+	"retry",
+	"truncate",
+	"drop",
+	NULL
+};
+static const char *camera_valid_encoder_sched_policies[] = {
+	"other",
+	"fifo",
+	"rr",
+	NULL
+};
+
 static const float camera_valid_col_gain_range[2] = { 0.0f, 32.0f };
 static const float camera_valid_lens_pos_range[2] = { 0.0f, 32.0f };
 static const float camera_valid_brightness_range[2] = { -1.0f, 1.0f };
@@ -124,10 +198,62 @@ static void usage(const char *argv0)
 	fprintf(stderr, "                                  range: [%.1f .. %.1f]\n", camera_valid_sharpness_range[0], camera_valid_sharpness_range[1]);
 	fprintf(stderr, "                                    - 1.0 = normal sharpening\n");
 	fprintf(stderr, "    --camera-debug-report      [libcamera] Print lens position and colour gains every second\n");
+	fprintf(stderr, "    --mjpeg-overflow <policy>  [libcamera] Handling of encoded frames larger than the UVC buffer\n");
+	fprintf(stderr, "                                  values: ");
+	for (int i = 0; camera_valid_mjpeg_overflow_policies[i] != NULL; i++)
+		fprintf(stderr, "%s%s", camera_valid_mjpeg_overflow_policies[i], camera_valid_mjpeg_overflow_policies[i+1] ? ", " : "\n");
+	fprintf(stderr, "                                    - \"retry\" re-encodes at lower quality (default)\n");
+	fprintf(stderr, "                                    - \"truncate\" cuts the frame and terminates it\n");
+	fprintf(stderr, "                                    - \"drop\" skips the frame\n");
+	fprintf(stderr, "    --mjpeg-slices <count>     [libcamera] Encode each frame as <count> slices in parallel\n");
+	fprintf(stderr, "                                  range: [1 .. 16], default 1\n");
+	fprintf(stderr, "    --encoder-threads <count>  [libcamera] Number of MJPEG encode threads\n");
+	fprintf(stderr, "                                  range: [1 .. 16], default: online CPUs minus reserved CPUs\n");
+	fprintf(stderr, "    --encoder-reserved-cpus <count>\n");
+	fprintf(stderr, "                               [libcamera] CPUs left to the rest of the pipeline when sizing\n");
+	fprintf(stderr, "                                           the encoder thread pool (default 1)\n");
+	fprintf(stderr, "    --encoder-cpus <list>      [libcamera] CPUs the encode threads run on, e.g. \"1-3\" or \"2,3\"\n");
+	fprintf(stderr, "                                    - without --encoder-threads, one thread is started per CPU\n");
+	fprintf(stderr, "    --encoder-sched <policy>   [libcamera] Scheduling policy of the encode threads\n");
+	fprintf(stderr, "                                  values: ");
+	for (int i = 0; camera_valid_encoder_sched_policies[i] != NULL; i++)
+		fprintf(stderr, "%s%s", camera_valid_encoder_sched_policies[i], camera_valid_encoder_sched_policies[i+1] ? ", " : "\n");
+	fprintf(stderr, "                                    - \"fifo\" and \"rr\" require CAP_SYS_NICE or an RLIMIT_RTPRIO allowance\n");
+	fprintf(stderr, "    --encoder-priority <value> [libcamera] Real-time priority of the encode threads\n");
+	fprintf(stderr, "                                  range: [1 .. 99], default: minimum priority of the policy\n");
 #endif
+	fprintf(stderr, " -b|--buffers <count|preset>   Number of video buffers\n");
+	fprintf(stderr, "                                  range: [%u .. %u], default %u\n",
+		UVC_STREAM_MIN_BUFFERS, UVC_STREAM_MAX_BUFFERS, UVC_STREAM_DEFAULT_BUFFERS);
+	fprintf(stderr, "                                  presets: low-latency (%d), balanced (%d), throughput (%d)\n",
+		uvc_stream_buffer_preset("low-latency"), uvc_stream_buffer_preset("balanced"),
+		uvc_stream_buffer_preset("throughput"));
 	fprintf(stderr, " -d|--device <device>          V4L2 source device\n");
+	fprintf(stderr, "    --events-backend <name>    Event loop backend\n");
+	fprintf(stderr, "                                  values: select, epoll\n");
 	fprintf(stderr, " -i|--image <image>            MJPEG image\n");
+	fprintf(stderr, "                                    - reloaded when the file changes, replace it with a rename\n");
+	fprintf(stderr, "                                      to avoid sending a partially written image\n");
+	fprintf(stderr, "    --idle-timeout <ms>        Delay before freeing the buffers once streaming stops\n");
+	fprintf(stderr, "                                  default %u, 0 frees them immediately\n",
+		UVC_STREAM_DEFAULT_IDLE_TIMEOUT);
+	fprintf(stderr, "                                    - restarting with the same format within the delay\n");
+	fprintf(stderr, "                                      reuses the buffers and camera configuration\n");
+	fprintf(stderr, "    --log <spec>               Log levels, a default level and module=level pairs\n");
+	fprintf(stderr, "                                  values: error, warning, info (default), debug\n");
+	fprintf(stderr, "                                  modules: jpg, libcamera, sink, slideshow, stream,\n");
+	fprintf(stderr, "                                  uvc, v4l2\n");
+	fprintf(stderr, "                                    - e.g. \"warning,uvc=debug\" to trace control requests\n");
+	fprintf(stderr, "    --metrics <socket>         Serve Prometheus metrics on a Unix domain socket\n");
+	fprintf(stderr, "                                    - e.g. curl --unix-socket <socket> http://localhost/metrics\n");
 	fprintf(stderr, " -s|--slideshow <directory>    directory of slideshow images\n");
+	fprintf(stderr, "    --test-pattern <pattern>   Pattern generated when no other source is selected\n");
+	fprintf(stderr, "                                  values: bars, scroll, barcode\n");
+	fprintf(stderr, "                                    - \"bars\" shows static colour bars (default)\n");
+	fprintf(stderr, "                                    - \"scroll\" scrolls the bars and shows a frame counter,\n");
+	fprintf(stderr, "                                      to load the USB path with changing frames\n");
+	fprintf(stderr, "                                    - \"barcode\" scrolls the bars and stamps each frame with its\n");
+	fprintf(stderr, "                                      sequence number and time, see uvc-frame-analyser\n");
 	fprintf(stderr, " -h|--help                     Print this help screen and exit\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, " <uvc device>                  UVC device instance specifier\n");
@@ -148,6 +274,8 @@ static void usage(const char *argv0)
 	fprintf(stderr, "    %s g1/functions/uvc.1\n", argv0);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "    %s musb-hdrc.0.auto\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Send SIGUSR1 to print the frame latency of each pipeline stage.\n");
 }
 
 /* Necessary for and only used by signal handler. */
@@ -159,6 +287,31 @@ static void sigint_handler(int signal __attribute__((unused)))
 	events_stop(sigint_events);
 }
 
+/*
+ * SIGUSR1 is delivered through a signalfd, so that the latency is printed from
+ * the event loop and not from signal context.
+ */
+struct latency_dump {
+	struct uvc_stream *stream;
+	int fd;
+};
+
+static void dump_latency(void *d)
+{
+	struct latency_dump *dump = d;
+	struct signalfd_siginfo info;
+
+	if (read(dump->fd, &info, sizeof(info)) != sizeof(info))
+		return;
+
+	uvc_stream_dump_latency(dump->stream, stdout);
+}
+
+static void write_metrics(void *data, FILE *file)
+{
+	uvc_stream_write_metrics(data, file);
+}
+
 int main(int argc, char *argv[])
 {
 	char *function = NULL;
@@ -177,16 +330,31 @@ int main(int argc, char *argv[])
 		.saturation = 0.f / 0.f, //NaN
 		.sharpness = 0.f / 0.f, //NaN
 		.debug_report_enabled = 0,
+		.mjpeg_overflow = NULL,
+		.mjpeg_slices = 1,
+		.encoder_threads = 0,
+		.encoder_reserved_cpus = 1,
+		.encoder_cpus = 0,
+		.encoder_sched = NULL,
+		.encoder_priority = 0,
 	};
 #endif
 	char *cap_device = NULL;
 	char *img_path = NULL;
 	char *slideshow_dir = NULL;
+	char *metrics_path = NULL;
+	unsigned int nbufs = UVC_STREAM_DEFAULT_BUFFERS;
+	unsigned int idle_timeout = UVC_STREAM_DEFAULT_IDLE_TIMEOUT;
+	enum events_backend events_backend = EVENTS_BACKEND_DEFAULT;
+	enum test_source_pattern test_pattern = TEST_PATTERN_BARS;
 
 	struct uvc_function_config *fc;
 	struct uvc_stream *stream = NULL;
 	struct video_source *src = NULL;
+	struct latency_dump dump = { .fd = -1 };
+	struct metrics_server *metrics = NULL;
 	struct events events;
+	sigset_t sigmask;
 	int ret = 0;
 	int opt;
 	int option_index = 0;
@@ -202,6 +370,18 @@ int main(int argc, char *argv[])
 	#define OPT_SATURATN 1008
 	#define OPT_SHRPNESS 1009
 	#define OPT_DBG_RPRT 1010
+	#define OPT_EVT_BKND 1011
+	#define OPT_MJPG_OVF 1012
+	#define OPT_MJPG_SLC 1013
+	#define OPT_ENC_THRD 1014
+	#define OPT_ENC_RSVD 1015
+	#define OPT_ENC_CPUS 1016
+	#define OPT_ENC_SCHD 1017
+	#define OPT_ENC_PRIO 1018
+	#define OPT_IDLE_TMO 1019
+	#define OPT_TST_PATT 1020
+	#define OPT_METRICS  1021
+	#define OPT_LOG_SPEC 1022
 	struct option long_options[] = {
 #ifdef HAVE_LIBCAMERA
 		{ "camera",              required_argument, 0, 'c' },
@@ -217,15 +397,38 @@ int main(int argc, char *argv[])
 		{ "saturation",          required_argument, 0, OPT_SATURATN },
 		{ "sharpness",           required_argument, 0, OPT_SHRPNESS },
 		{ "camera-debug-report", no_argument,       0, OPT_DBG_RPRT },
+		{ "mjpeg-overflow",      required_argument, 0, OPT_MJPG_OVF },
+		{ "mjpeg-slices",        required_argument, 0, OPT_MJPG_SLC },
+		{ "encoder-threads",     required_argument, 0, OPT_ENC_THRD },
+		{ "encoder-reserved-cpus", required_argument, 0, OPT_ENC_RSVD },
+		{ "encoder-cpus",        required_argument, 0, OPT_ENC_CPUS },
+		{ "encoder-sched",       required_argument, 0, OPT_ENC_SCHD },
+		{ "encoder-priority",    required_argument, 0, OPT_ENC_PRIO },
 #endif
+		{ "buffers",         required_argument, 0, 'b' },
 		{ "device",          required_argument, 0, 'd' },
+		{ "events-backend",  required_argument, 0, OPT_EVT_BKND },
+		{ "idle-timeout",    required_argument, 0, OPT_IDLE_TMO },
+		{ "test-pattern",    required_argument, 0, OPT_TST_PATT },
+		{ "metrics",         required_argument, 0, OPT_METRICS },
+		{ "log",             required_argument, 0, OPT_LOG_SPEC },
 		{ "image",           required_argument, 0, 'i' },
 		{ "slideshow",       required_argument, 0, 's' },
 		{ "help",            no_argument,       0, 'h' },
 		{ 0, 0, 0, 0 }
 	};
 
-	while ((opt = getopt_long(argc, argv, "c:d:i:s:h", long_options, &option_index)) != -1) {
+	/*
+	 * Block SIGUSR1 before any thread is created, threads inherit the
+	 * signal mask and the signal would otherwise be delivered to one that
+	 * doesn't block it, terminating the process instead of being read
+	 * from the signalfd.
+	 */
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &sigmask, NULL);
+
+	while ((opt = getopt_long(argc, argv, "b:c:d:i:s:h", long_options, &option_index)) != -1) {
 		switch (opt) {
 #ifdef HAVE_LIBCAMERA
 		case 'c':
@@ -369,11 +572,138 @@ int main(int argc, char *argv[])
 		case OPT_DBG_RPRT:
 			camera_arguments_opts.debug_report_enabled = 1;
 			break;
+		case OPT_MJPG_OVF:
+			if (!is_camera_mode_valid(optarg, camera_valid_mjpeg_overflow_policies)) {
+				fprintf(stderr, "Invalid --mjpeg-overflow value: %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			camera_arguments_opts.mjpeg_overflow = optarg;
+			break;
+		case OPT_MJPG_SLC:
+		{
+			unsigned int value;
+			if (sscanf(optarg, "%u", &value) != 1 || value < 1 || value > 16) {
+				fprintf(stderr, "Invalid --mjpeg-slices value - out of range [1 .. 16]: %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			camera_arguments_opts.mjpeg_slices = value;
+			break;
+		}
+		case OPT_ENC_THRD:
+		{
+			unsigned int value;
+			if (sscanf(optarg, "%u", &value) != 1 || value < 1 || value > 16) {
+				fprintf(stderr, "Invalid --encoder-threads value - out of range [1 .. 16]: %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			camera_arguments_opts.encoder_threads = value;
+			break;
+		}
+		case OPT_ENC_RSVD:
+		{
+			unsigned int value;
+			if (sscanf(optarg, "%u", &value) != 1) {
+				fprintf(stderr, "Invalid --encoder-reserved-cpus value - invalid format: %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			camera_arguments_opts.encoder_reserved_cpus = value;
+			break;
+		}
+		case OPT_ENC_CPUS:
+			if (parse_cpu_list(optarg, &camera_arguments_opts.encoder_cpus) < 0) {
+				fprintf(stderr, "Invalid --encoder-cpus value: %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case OPT_ENC_SCHD:
+			if (!is_camera_mode_valid(optarg, camera_valid_encoder_sched_policies)) {
+				fprintf(stderr, "Invalid --encoder-sched value: %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			camera_arguments_opts.encoder_sched = optarg;
+			break;
+		case OPT_ENC_PRIO:
+		{
+			int value;
+			if (sscanf(optarg, "%d", &value) != 1 || value < 1 || value > 99) {
+				fprintf(stderr, "Invalid --encoder-priority value - out of range [1 .. 99]: %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			camera_arguments_opts.encoder_priority = value;
+			break;
+		}
 #endif
+		case 'b':
+		{
+			int value = uvc_stream_buffer_preset(optarg);
+			if (value < 0 && sscanf(optarg, "%d", &value) != 1)
+				value = -1;
+			if (value < UVC_STREAM_MIN_BUFFERS || value > UVC_STREAM_MAX_BUFFERS) {
+				fprintf(stderr, "Invalid --buffers value: %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			nbufs = value;
+			break;
+		}
+
 		case 'd':
 			cap_device = optarg;
 			break;
 
+		case OPT_EVT_BKND:
+			if (!strcmp(optarg, "select")) {
+				events_backend = EVENTS_BACKEND_SELECT;
+			} else if (!strcmp(optarg, "epoll")) {
+				events_backend = EVENTS_BACKEND_EPOLL;
+			} else {
+				fprintf(stderr, "Invalid --events-backend value: %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case OPT_IDLE_TMO:
+			if (sscanf(optarg, "%u", &idle_timeout) != 1) {
+				fprintf(stderr, "Invalid --idle-timeout value: %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case OPT_TST_PATT:
+			if (!strcmp(optarg, "bars")) {
+				test_pattern = TEST_PATTERN_BARS;
+			} else if (!strcmp(optarg, "scroll")) {
+				test_pattern = TEST_PATTERN_SCROLL;
+			} else if (!strcmp(optarg, "barcode")) {
+				test_pattern = TEST_PATTERN_BARCODE;
+			} else {
+				fprintf(stderr, "Invalid --test-pattern value: %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case OPT_METRICS:
+			metrics_path = optarg;
+			break;
+
+		case OPT_LOG_SPEC:
+			if (uvc_log_set_filter(optarg) < 0) {
+				fprintf(stderr, "Invalid --log value: %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
 		case 'i':
 			img_path = optarg;
 			break;
@@ -412,7 +742,19 @@ int main(int argc, char *argv[])
 	 * received when the user presses CTRL-C. This will allow the main loop
 	 * to be interrupted, and resources to be freed cleanly.
 	 */
-	events_init(&events);
+	ret = events_init_backend(&events, events_backend);
+	if (ret < 0) {
+		printf("Failed to initialize %s event loop\n",
+		       events_backend_name(events_backend));
+		configfs_free_uvc_function(fc);
+		return 1;
+	}
+
+	printf("Using %s event loop\n", events_backend_name(events.backend));
+
+	/* Move the log output off the event loop thread. */
+	if (uvc_log_start() < 0)
+		printf("Failed to start the log thread, logging synchronously\n");
 
 	sigint_events = &events;
 	signal(SIGINT, sigint_handler);
@@ -439,11 +781,18 @@ int main(int argc, char *argv[])
 
 	if (cap_device)
 		v4l2_video_source_init(src, &events);
-
 #ifdef HAVE_LIBCAMERA
-	if (camera)
+	else if (camera)
 		libcamera_source_init(src, &events);
 #endif
+	else if (img_path)
+		jpg_video_source_init(src, &events);
+	else if (slideshow_dir)
+		slideshow_video_source_init(src, &events);
+	else {
+		test_video_source_set_pattern(src, test_pattern);
+		test_video_source_init(src, &events);
+	}
 
 	/* Create and initialise the stream. */
 	stream = uvc_stream_new(fc->video);
@@ -454,17 +803,47 @@ int main(int argc, char *argv[])
 
 	uvc_stream_set_event_handler(stream, &events);
 	uvc_stream_set_video_source(stream, src);
-	uvc_stream_init_uvc(stream, fc);
+	uvc_stream_set_buffer_count(stream, nbufs);
+	uvc_stream_set_idle_timeout(stream, idle_timeout);
+	if (uvc_stream_init_uvc(stream, fc) < 0) {
+		ret = 1;
+		goto done;
+	}
+
+	dump.stream = stream;
+	dump.fd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (dump.fd >= 0)
+		events_watch_fd(&events, dump.fd, EVENT_READ, dump_latency, &dump);
+
+	if (metrics_path) {
+		metrics = metrics_server_new(&events, metrics_path,
+					     write_metrics, stream);
+		if (!metrics) {
+			ret = 1;
+			goto done;
+		}
+	}
 
 	/* Main capture loop */
 	events_loop(&events);
 
+	printf("Event loop: %lu wakeups, %lu callbacks\n", events.wakeups,
+	       events.dispatches);
+
 done:
 	/* Cleanup */
+	metrics_server_delete(metrics);
+
+	if (dump.fd >= 0) {
+		events_unwatch_fd(&events, dump.fd, EVENT_READ);
+		close(dump.fd);
+	}
+
 	uvc_stream_delete(stream);
 	video_source_destroy(src);
 	events_cleanup(&events);
 	configfs_free_uvc_function(fc);
+	uvc_log_stop();
 
 	return ret;
 }